@@ -6,9 +6,20 @@
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include <stdbool.h>
 #include "3rdparty/miniz.h"
+#include "ssd1306_emulator.h"
+#include "ssd1306_player.h"
+
+#if defined(__SSSE3__)
+#	include <tmmintrin.h>
+#	define SIMD_SSSE3 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#	include <arm_neon.h>
+#	define SIMD_NEON 1
+#endif
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -25,7 +36,9 @@ typedef ptrdiff_t isize;
 #define GB(n) (n*MB(1024))
 #define MB(n) (n*KB(1024))
 #define KB(n) (n*1024)
+#define PROGRAM_MEMORY_SIZE ((usize)GB(1))
 #define PRINTLN(fmt, ...) printf(fmt NL, ##__VA_ARGS__)
+#define FPRINTLN(file, fmt, ...) fprintf(file, fmt NL, ##__VA_ARGS__)
 #define PRINTERR(fmt, ...) fprintf(stderr, fmt NL, ##__VA_ARGS__)
 
 #if RELEASE
@@ -42,6 +55,20 @@ typedef ptrdiff_t isize;
 #define CCT_RAW_CEL 0
 #define CCT_LINKED_CEL 1
 #define CCT_COMPRESSED_CEL 2
+#define CCT_COMPRESSED_TILEMAP 3
+
+//Blend modes that are composited.  Any other mode is treated as Normal.
+#define BLEND_MODE_NORMAL 0
+#define BLEND_MODE_MULTIPLY 1
+#define BLEND_MODE_SCREEN 2
+#define BLEND_MODE_DARKEN 4
+#define BLEND_MODE_LIGHTEN 5
+#define BLEND_MODE_DIFFERENCE 10
+#define BLEND_MODE_ADDITION 16
+#define BLEND_MODE_SUBTRACT 17
+
+//Aseprite Header Flags
+#define AHF_LAYER_OPACITY_IS_VALID 1
 
 typedef struct AsepriteLayerChunkHeader {
 	/*
@@ -59,6 +86,7 @@ typedef struct AsepriteLayerChunkHeader {
 	 * 
 	 0 = Normal (image) layer
 	 1 = Group
+	 2 = Tilemap, the name is followed by a u32 tileset index
 	 */
 	u16 layer_type; 
 	u16 layer_child_level;
@@ -115,10 +143,65 @@ typedef struct AsepriteRawAndCompressedCelHeader {
 	u16 width;
 	u16 height;
 } __attribute__((packed)) AsepriteRawAndCompressedCelHeader;
+typedef struct AsepriteTilemapCelHeader {
+	u16 width; //in tiles
+	u16 height; //in tiles
+	u16 bits_per_tile; //always 32
+	u32 tile_id_mask;
+	u32 x_flip_mask;
+	u32 y_flip_mask;
+	u32 diagonal_flip_mask;
+	u8 reserved[10];
+} __attribute__((packed)) AsepriteTilemapCelHeader;
 typedef struct AsepriteLinkedCelHeader {
 	u16 frame_to_link_with;
 } __attribute__((packed)) AsepriteLinkedCelHeader;
 
+typedef struct AsepritePaletteChunkHeader {
+	u32 new_palette_size;
+	u32 first_color_index;
+	u32 last_color_index;
+	u8 reserved[8];
+} __attribute__((packed)) AsepritePaletteChunkHeader;
+typedef struct AsepritePaletteEntry {
+	u16 flags; //1 = Has name
+	u8 red;
+	u8 green;
+	u8 blue;
+	u8 alpha;
+} __attribute__((packed)) AsepritePaletteEntry;
+
+typedef struct AsepriteTilesetChunkHeader {
+	u32 id;
+	/*
+	 1 = Links to an external file
+	 2 = Tiles are in this file: the name is followed by a u32 compressed length and the zlib compressed tileset 
+	     image, tile_width wide and tile_height*number_of_tiles tall
+	 4 = Tile 0 is the empty tile
+	 */
+	u32 flags;
+	u32 number_of_tiles;
+	u16 tile_width;
+	u16 tile_height;
+	i16 base_index; //only used for display
+	u8 reserved[14];
+	u16 name_len;
+} __attribute__((packed)) AsepriteTilesetChunkHeader;
+
+typedef struct AsepriteSliceChunkHeader {
+	u32 number_of_keys;
+	u32 flags; //1 = 9-patch slice, 2 = has pivot.  Each adds fields to every key.
+	u32 reserved;
+	u16 name_len;
+} __attribute__((packed)) AsepriteSliceChunkHeader;
+typedef struct AsepriteSliceKey {
+	u32 frame_number; //the key applies from this frame on
+	i32 x;
+	i32 y;
+	u32 width;
+	u32 height;
+} __attribute__((packed)) AsepriteSliceKey;
+
 typedef struct AsepriteChunkHeader {
 	u32 size;
 	u16 type;
@@ -157,23 +240,202 @@ typedef struct AsepriteHeader {
 } __attribute__((packed)) AsepriteHeader;
 
 
+//Bit i is set if palette index i is visible (not transparent).  Colors are used whenever the pixel's color matters.
+typedef struct PaletteLUT {
+	u8 bits[32];
+	AsepriteRGBAPixel colors[256];
+} PaletteLUT;
+
+#define LAYER_FLAG_VISIBLE 1
+#define LAYER_FLAG_BACKGROUND 8
+#define LAYER_FLAG_REFERENCE 64
+#define LAYER_TYPE_GROUP 1
+#define LAYER_TYPE_TILEMAP 2
+
+//A cel kept for linked cels in later frames: the rest of its chunk after the cel header, in place when the whole 
+//file is in memory, copied into the arena otherwise
+typedef struct KeptCel {
+	struct KeptCel *next; //the cel of an earlier frame of the same layer
+	AsepriteCelChunkHeader header;
+	u16 frame_index;
+	u64 offset; //where data starts in the file
+	usize len;
+	u8 *data;
+} KeptCel;
+
+//One entry per layer chunk, in file order
+typedef struct LayerInfo {
+	bool is_visible; //cels of this layer get drawn
+	bool is_shown; //own flag and every parent group's flag are set, or it was picked with --layer
+	bool is_selected; //no --layer given, or it or a parent group was picked with --layer
+	bool is_excluded; //it or a parent group was picked with --exclude-layer
+	u16 type;
+	u16 child_level;
+	u16 blend_mode;
+	u8 opacity;
+	u32 tileset_index; //LAYER_TYPE_TILEMAP
+	bool is_background; //indexed pixels are opaque, the transparent index included
+	KeptCel *kept_cels; //newest first
+	bool has_dropped_cels; //some cel didn't fit in the arena to be kept, so a link to it can't be drawn
+} LayerInfo;
+
+//cels address layers with a u16, so the table has room for all of them and never grows.  
+//untouched entries are never committed by the OS.
+#define MAX_LAYERS 65536
+typedef struct LayerTable {
+	LayerInfo *layers;
+	u32 count;
+} LayerTable;
+
+#define TILESET_FLAG_EXTERNAL_FILE 1
+#define TILESET_FLAG_TILES_IN_FILE 2
+
+//Tiles are decoded once when the tileset chunk is read, so tilemap cels just copy them.  Pixels are converted to 
+//RGBA with the palette at that point.  masks holds each tile's visible pixels packed 1bpp in rows, like the level 
+//plane they're ORed into: tile_height rows of mask_stride bytes, bit b of byte i is column 8*i + b.
+typedef struct Tileset {
+	u32 tile_count; //0 if the tileset wasn't decoded
+	u16 tile_width;
+	u16 tile_height;
+	u32 mask_stride; //ceil(tile_width/8)
+	AsepriteRGBAPixel *pixels; //tile i starts at i*tile_width*tile_height
+	u8 *masks; //tile i starts at i*tile_height*mask_stride
+	bool *is_empty; //every pixel is transparent, so drawing the tile changes nothing
+} Tileset;
+
+#define MAX_TILESETS 256
+typedef struct TilesetTable {
+	Tileset tilesets[MAX_TILESETS]; //by tileset id
+} TilesetTable;
+
+#define SLICE_FLAG_9_PATCH 1
+#define SLICE_FLAG_PIVOT 2
+
+typedef struct Slice {
+	char *name; //UTF-8, NUL terminated
+	u32 key_count;
+	AsepriteSliceKey *keys; //sorted by frame, as stored in the file
+} Slice;
+
+#define MAX_SLICES 1024
+typedef struct SliceTable {
+	Slice slices[MAX_SLICES]; //in file order
+	u32 count;
+} SliceTable;
+
+//Half open rectangle of the canvas
+typedef struct Rect {
+	i32 x0, y0, x1, y1;
+} Rect;
+
 typedef struct ByteStackAllocator {
 	u8 *data;
 	usize capacity;
 	u8 *cursor;
 } ByteStackAllocator;
 
+typedef enum ConversionMode {
+	CONVERSION_MODE_ALPHA, //any non-transparent pixel is white
+	CONVERSION_MODE_THRESHOLD, //pixels brighter than the threshold are white
+	CONVERSION_MODE_ORDERED_DITHER, //luminance is Bayer dithered
+	CONVERSION_MODE_ERROR_DIFFUSION, //luminance is error diffusion dithered
+} ConversionMode;
+
+typedef enum DiffusionKernelType {
+	DIFFUSION_KERNEL_FLOYD_STEINBERG,
+	DIFFUSION_KERNEL_ATKINSON,
+	DIFFUSION_KERNEL_SIERRA_LITE,
+} DiffusionKernelType;
+
+typedef enum CommandMode {
+	COMMAND_MODE_NONE,
+	COMMAND_MODE_FULL, //every frame rewrites the whole image
+	COMMAND_MODE_DELTA, //frames after the first only rewrite the pages that changed
+} CommandMode;
+
+typedef enum OptimizeGoal {
+	OPTIMIZE_NONE,
+	OPTIMIZE_SIZE, //fewest bytes of flash
+	OPTIMIZE_BUS_TIME, //least time sending frames to the display
+	OPTIMIZE_DECODE, //fewest cycles decoding frames
+} OptimizeGoal;
+
+typedef enum BusType {
+	BUS_I2C,
+	BUS_SPI,
+} BusType;
+
+typedef struct Bus {
+	BusType type;
+	u32 hz;
+} Bus;
+
+//--controller: the display command streams are made for
+typedef struct ControllerProfile {
+	const char *name;
+	SSD1306Controller controller;
+	u16 width, height; //of the display
+	u8 column_offset; //GRAM column of the display's leftmost pixel
+} ControllerProfile;
+
+//Modules wire 132 column controllers differently, --column-offset overrides these
+static const ControllerProfile CONTROLLER_PROFILES[] = {
+	{"ssd1306", SSD1306_CONTROLLER_SSD1306, 128, 64, 0},
+	{"ssd1306-128x32", SSD1306_CONTROLLER_SSD1306, 128, 32, 0},
+	{"ssd1309", SSD1306_CONTROLLER_SSD1309, 128, 64, 0},
+	{"ssd1305", SSD1306_CONTROLLER_SSD1305, 128, 64, 0},
+	{"ssd1305-128x32", SSD1306_CONTROLLER_SSD1305, 128, 32, 0},
+	{"sh1106", SSD1306_CONTROLLER_SH1106, 128, 64, 2},
+};
+
+#define MAX_THREADS 64
+#define MAX_BUSES 8
+#define MAX_PANELS 16
+#define MAX_LAYER_FILTERS 32
+#define MAX_SLICE_NAMES 32
+
 typedef struct ProgramArgs {
 	bool should_show_frames;
 	bool should_show_python;
 	bool is_valid;
-#ifdef _WIN32
-	const wchar_t *in_file_name;
-#else
-	const char *in_file_name;
-#endif
+	ConversionMode mode;
+	u8 threshold; //CONVERSION_MODE_THRESHOLD
+	u8 dither_size; //CONVERSION_MODE_ORDERED_DITHER: 2, 4 or 8
+	DiffusionKernelType diffusion_kernel; //CONVERSION_MODE_ERROR_DIFFUSION
+	u32 thread_count; //0 = one per processor
+	u32 tile_width; //--tiles: output a deduplicated tile atlas of one page tall tiles this wide, 0 = plain frames
+	const char *slice_names[MAX_SLICE_NAMES]; //--slice, UTF-8
+	u32 slice_name_count;
+	bool is_all_slices; //--all-slices
+	CommandMode command_mode; //--commands: output SSD1306 command streams instead of pages
+	bool should_scroll; //--scroll: let the display scroll frames that are the previous one moved a column sideways
+	OptimizeGoal optimize; //--optimize: output every frame in whichever format suits the goal best
+	bool should_output_player; //--player: also output what ssd1306_player.c needs to play them
+	u32 panel_columns, panel_rows; //--panels: split the image over a grid of displays, 0 = one display
+	u32 panel_width, panel_height; //--panel-size, of each display, the controller's by default
+	ControllerProfile controller; //--controller, with --column-offset applied
+	u16 rotation; //--rotate: degrees clockwise, 0, 90, 180 or 270
+	bool is_flipped_horizontally, is_flipped_vertically; //--flip, after rotating
+	Bus buses[MAX_BUSES]; //--bus: report how long each frame takes to send over these
+	u32 bus_count;
+	u8 shift_mask; //--shifts: bit s set = also export every frame shifted down s rows
+	bool is_font; //--font: output a glyph atlas, one glyph per slice (or per frame if there are no slices)
+	u8 font_first_char; //character code of the first glyph
+	const char *layer_names[MAX_LAYER_FILTERS]; //--layer, UTF-8
+	u32 layer_name_count;
+	const char *excluded_layer_names[MAX_LAYER_FILTERS]; //--exclude-layer, UTF-8
+	u32 excluded_layer_name_count;
+	const char *in_file_name; //UTF-8
+	const char *serve_path; //--serve: Unix socket to take conversion requests on, instead of converting in_file_name
 } ProgramArgs;
 
+//Provided by the platform layer.
+//Calls fn(data, i) for every i in [0, work_count) on up to thread_count threads and returns once all of them finished.
+typedef void ParallelWorkFn(void *data, u32 work_index);
+static void platform_parallel_for(ParallelWorkFn *fn, void *data, u32 work_count, u32 thread_count);
+static u32 platform_processor_count(void);
+static void platform_yield_thread(void);
+
 
 void *push_bytes(usize num_bytes, ByteStackAllocator *allocator) {
 	//align to 8 byte boundary
@@ -187,250 +449,3675 @@ void *push_bytes(usize num_bytes, ByteStackAllocator *allocator) {
 
 }
 
-void aseprite_to_ssd1306(ProgramArgs pa, u8 *file_buffer, usize file_size, ByteStackAllocator program_allocator) {
-	assert(sizeof(AsepriteHeader) == 128);
-	assert(sizeof(AsepriteFrameHeader) == 16);
-	assert(sizeof(AsepriteChunkHeader) == 6);
-	assert(sizeof(AsepriteLinkedCelHeader) == 2);
-	assert(sizeof(AsepriteRawAndCompressedCelHeader) == 4);
-	assert(sizeof(AsepriteRGBAPixel) == 4);
-	assert(sizeof(AsepriteGrayscalePixel) == 2);
-	assert(sizeof(AsepriteLayerChunkHeader) == 18);
-
-	AsepriteHeader *file_header = (AsepriteHeader*)file_buffer;
+//Whether count items of item_size bytes still fit in the arena.  Sizes that come from the file are checked with this 
+//before they're pushed, so a bogus header is reported instead of tripping the assert in push_bytes().
+static bool can_push_array(u64 count, u64 item_size, const ByteStackAllocator *allocator) {
+	u64 available = allocator->capacity - (allocator->cursor - allocator->data);
+	//leaves room for the alignment padding
+	available = (available > 8) ? available - 8 : 0;
+	return item_size == 0 || count <= available/item_size;
+}
 
-	//Validation
-	if (file_header->magic != 0xA5E0) {
-		PRINTERR("Invalid Aseprite file!");
-		exit(1);
+//push_bytes() for sizes that come from the file: NULL instead of the assert if they don't fit
+static void *push_array(u64 count, u64 item_size, ByteStackAllocator *allocator) {
+	if (!can_push_array(count, item_size, allocator)) {
+		return NULL;
 	}
+	return push_bytes((usize)(count*item_size), allocator);
+}
+
+//Streaming input.  The parser only ever asks for the next n contiguous bytes of the file, so the same code runs
+//over a fully resident buffer (read == NULL, zero copy) or over a pipe through a bounded refill buffer.
+//Pointers handed out by stream_take() are only valid until the next call that touches the stream.
+typedef isize AsepriteReadFn(void *context, u8 *dst, usize len); //returns bytes read, 0 on EOF, negative on error with errno set
+
+#define STREAM_BUFFER_SIZE KB(64)
 
+typedef struct AsepriteStream {
+	AsepriteReadFn *read;
+	void *read_context;
+	u8 *buffer;
+	usize capacity;
+	u8 *cursor;
+	u8 *end;
+	u64 offset; //bytes consumed from the start of the file
+	bool has_read_error; //read failed, the stream looks like it ended there
+	int read_errno; //errno of the failed read
+} AsepriteStream;
+
+AsepriteStream stream_from_memory(u8 *data, usize len) {
+	AsepriteStream ret = {0};
+	ret.buffer = ret.cursor = data;
+	ret.capacity = len;
+	ret.end = data + len;
+	return ret;
+}
+
+AsepriteStream stream_from_reader(AsepriteReadFn *read, void *read_context, ByteStackAllocator *allocator) {
+	AsepriteStream ret = {0};
+	ret.read = read;
+	ret.read_context = read_context;
+	ret.capacity = STREAM_BUFFER_SIZE;
+	ret.buffer = ret.cursor = ret.end = push_bytes(ret.capacity, allocator);
+	return ret;
+}
 
-	if (file_header->color_depth == 8) {
-		PRINTERR("Paletted images are not supported yet.");
-		exit(1);
+//Makes sure at least min_bytes are buffered (or as many as the buffer can hold).  Returns bytes available.
+static usize stream_refill(AsepriteStream *stream, usize min_bytes) {
+	usize available = stream->end - stream->cursor;
+	if (available >= min_bytes || !stream->read) {
+		return available;
 	}
-	if (file_header->color_depth != 32 && file_header->color_depth != 16) {
-		PRINTERR("Invalid color depth in Aseprite file!");
-		exit(1);
+	if (stream->cursor != stream->buffer) {
+		memmove(stream->buffer, stream->cursor, available);
+		stream->cursor = stream->buffer;
+		stream->end = stream->buffer + available;
 	}
-	//End Validation
-	
-	u16 byte_height = file_header->height/8;
-	if (byte_height == 0) byte_height = 1;	
-
-    if (!pa.should_show_frames) {
-        if (pa.should_show_python) {
-            PRINTLN("#Image width: %u pixels, or %u bytes, height: %u pixels, or %u bytes", file_header->width, file_header->width, file_header->height, byte_height);
-        }
-        else {
-            PRINTLN("//Image width: %u pixels, or %u bytes, height: %u pixels, or %u bytes", file_header->width, file_header->width, file_header->height, byte_height);
-        }
-    }
-	u8 *output_frames = push_bytes(file_header->width*file_header->height*file_header->frames, &program_allocator);
+	while (available < min_bytes && available < stream->capacity) {
+		isize bytes_read = stream->read(stream->read_context, stream->end, stream->capacity - available);
+		if (bytes_read < 0) {
+			stream->has_read_error = true;
+			stream->read_errno = errno;
+		}
+		if (bytes_read <= 0) {
+			break;
+		}
+		stream->end += bytes_read;
+		available += bytes_read;
+	}
+	return available;
+}
 
-	file_buffer += sizeof(AsepriteHeader);
+//Returns a pointer to the next num_bytes of the file and consumes them, or NULL if the file ends first.
+u8 *stream_take(AsepriteStream *stream, usize num_bytes) {
+	if (num_bytes > stream->capacity || stream_refill(stream, num_bytes) < num_bytes) {
+		return NULL;
+	}
+	u8 *ret = stream->cursor;
+	stream->cursor += num_bytes;
+	stream->offset += num_bytes;
+	return ret;
+}
 
-	AsepriteFrameHeader *frame_header = (AsepriteFrameHeader*)file_buffer;
-	const usize decompression_buffer_len = file_header->width * file_header->height * (file_header->color_depth / 8);
-	u8 *decompression_buffer = push_bytes(decompression_buffer_len, &program_allocator);
+//Returns whatever is buffered (refilling if empty), up to max_bytes, without consuming it.
+u8 *stream_peek(AsepriteStream *stream, usize max_bytes, usize *out_len) {
+	usize available = stream_refill(stream, 1);
+	*out_len = (available < max_bytes) ? available : max_bytes;
+	return (*out_len > 0) ? stream->cursor : NULL;
+}
 
+void stream_advance(AsepriteStream *stream, usize num_bytes) {
+	assert(num_bytes <= (usize)(stream->end - stream->cursor));
+	stream->cursor += num_bytes;
+	stream->offset += num_bytes;
+}
 
-    struct {
-		u8 *data;
+bool stream_skip(AsepriteStream *stream, u64 num_bytes) {
+	while (num_bytes > 0) {
 		usize len;
-		usize capacity;
-	} visible_layer_bit_list = {0};
-	visible_layer_bit_list.capacity = 2048; //in bits
-	visible_layer_bit_list.data = push_bytes((visible_layer_bit_list.capacity/8), &program_allocator);
+		if (!stream_peek(stream, (num_bytes < stream->capacity) ? (usize)num_bytes : stream->capacity, &len)) {
+			return false;
+		}
+		stream_advance(stream, len);
+		num_bytes -= len;
+	}
+	return true;
+}
 
-	//loop through frames
-	for (u16 frames_index = 0; 
-			file_buffer < file_buffer + file_size && frames_index < file_header->frames; 
-			frames_index++,file_buffer += frame_header->frame_size) {
-		frame_header = (AsepriteFrameHeader*)file_buffer;
-		assert(frame_header->magic == 0xF1FA);
-
-		DEBUGOUTLN("Frame size %u", frame_header->frame_size);
-		u8 *frame_data = (u8*)frame_header + sizeof(AsepriteFrameHeader);
-		u32 num_chunks = (frame_header->number_of_chunks > 0) ? frame_header->number_of_chunks : frame_header->old_number_of_chunks;
-		AsepriteChunkHeader *chunk_header = (AsepriteChunkHeader*)frame_data;
-		u8 *frame_bitmap = &output_frames[frames_index*file_header->height*file_header->width];
-		//loop through chunks
-		for (u32 chunk_index = 0; 
-				frame_data < file_buffer + file_size && chunk_index < num_chunks; 
-				chunk_index++,frame_data += chunk_header->size) {
-
-			chunk_header = (AsepriteChunkHeader*)frame_data;
-			DEBUGOUTLN("Chunk type: 0x%X", chunk_header->type);
-			u8 *chunk_data = frame_data + sizeof(AsepriteChunkHeader);
-            switch (chunk_header->type) {
-            case 0x2004: { //layer chunk
-				AsepriteLayerChunkHeader *layer_chunk = (AsepriteLayerChunkHeader*)chunk_data;
-				visible_layer_bit_list.len++;
-				if (visible_layer_bit_list.len > visible_layer_bit_list.capacity) {
-					//TODO: i don't like this.  this assumes the file is well formed.  maybe parse 0x2004 first and then 0x2005.  or just bite the bullet and use realloc (which can't guarentee zero memory)
-					//this pushes the cursor forward.  this should be the only caller of push_bytes() so until we get to 0x2005, so we can just assume the list grew
-					//and since we have a zero page, we can assume the new data is zero
-					push_bytes(visible_layer_bit_list.capacity*2/8, &program_allocator);
-					visible_layer_bit_list.capacity *= 2;
-				}
-				if ((layer_chunk->flags & 1) != 0) {
-					visible_layer_bit_list.data[visible_layer_bit_list.len/8] |= 1 << ((visible_layer_bit_list.len-1)%8);
+//Copies num_bytes of the file into dst.  Used for raw cels, which may be bigger than the refill buffer.
+bool stream_read_into(AsepriteStream *stream, u8 *dst, usize num_bytes) {
+	while (num_bytes > 0) {
+		usize len;
+		u8 *src = stream_peek(stream, num_bytes, &len);
+		if (!src) {
+			return false;
+		}
+		memcpy(dst, src, len);
+		stream_advance(stream, len);
+		dst += len;
+		num_bytes -= len;
+	}
+	return true;
+}
+
+//Inflates the first dst_len bytes of a zlib stream of compressed_len bytes into dst, feeding tinfl straight from 
+//the refill buffer.  Stops as soon as dst is full; returns false if the stream ends or is corrupt before that.
+bool stream_inflate_into(AsepriteStream *stream, usize compressed_len, u8 *dst, usize dst_len) {
+	tinfl_decompressor inflator;
+	tinfl_init(&inflator);
+	usize dst_pos = 0;
+	for (;;) {
+		usize in_len;
+		u8 *in = stream_peek(stream, compressed_len, &in_len);
+		if (!in) {
+			return false;
+		}
+		size_t in_bytes = in_len;
+		size_t out_bytes = dst_len - dst_pos;
+		mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+		if (in_len < compressed_len) {
+			flags |= TINFL_FLAG_HAS_MORE_INPUT;
+		}
+		tinfl_status status = tinfl_decompress(&inflator, in, &in_bytes, dst, dst + dst_pos, &out_bytes, flags);
+		stream_advance(stream, in_bytes);
+		compressed_len -= in_bytes;
+		dst_pos += out_bytes;
+		if (dst_pos == dst_len && (status == TINFL_STATUS_DONE || status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+			return true;
+		}
+		if (status == TINFL_STATUS_DONE) {
+			return false;
+		}
+		if (status != TINFL_STATUS_NEEDS_MORE_INPUT || compressed_len == 0) {
+			return false;
+		}
+	}
+}
+
+//Everything that stops a conversion.  The converter never exits, the platform layer maps these to exit codes.
+typedef enum ConversionErrorCode {
+	CONVERSION_OK,
+	CONVERSION_ERROR_INVALID_FILE, //not an Aseprite file
+	CONVERSION_ERROR_UNSUPPORTED, //valid, but not something this program can convert
+	CONVERSION_ERROR_TOO_BIG, //doesn't fit in the arena
+	CONVERSION_ERROR_TRUNCATED,
+	CONVERSION_ERROR_READ_FAILED,
+	CONVERSION_ERROR_INVALID_FRAME,
+	CONVERSION_ERROR_INVALID_CHUNK,
+	CONVERSION_ERROR_CORRUPT_DATA, //compressed cel or tileset data doesn't inflate
+	CONVERSION_ERROR_MISSING_SLICE, //--slice or --all-slices asked for slices the file doesn't have
+	CONVERSION_ERROR_VERIFY_FAILED, //the emulated display doesn't show what was converted, a bug in this program
+} ConversionErrorCode;
+
+typedef struct ConversionError {
+	ConversionErrorCode code;
+	u64 offset; //bytes into the file where the problem was found
+	i32 frame_index; //-1 when it isn't in a frame
+	i32 chunk_index; //-1 when it isn't in a chunk
+	char message[256];
+} ConversionError;
+
+static ConversionError conversion_error(ConversionErrorCode code, const AsepriteStream *stream, i32 frame_index, i32 chunk_index, 
+		const char *fmt, ...) {
+	ConversionError ret = {0};
+	ret.offset = stream->offset;
+	ret.frame_index = frame_index;
+	ret.chunk_index = chunk_index;
+	//a failed read shows up as the file ending early, whichever chunk was being parsed at the time
+	if (stream->has_read_error) {
+		ret.code = CONVERSION_ERROR_READ_FAILED;
+		snprintf(ret.message, sizeof(ret.message), "Failed to read in Aseprite file! -- %s", strerror(stream->read_errno));
+		return ret;
+	}
+	ret.code = code;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(ret.message, sizeof(ret.message), fmt, args);
+	va_end(args);
+	return ret;
+}
+
+//x*y/255, rounded
+static inline u8 mul_un8(u32 x, u32 y) {
+	u32 t = x*y + 128;
+	return (u8)((t + (t >> 8)) >> 8);
+}
+
+//Rec. 601 luma premultiplied by alpha, so that transparent pixels fade to black
+static inline u8 rgba_level(u8 red, u8 green, u8 blue, u8 alpha) {
+	u32 luma = (77*red + 150*green + 29*blue + 128) >> 8;
+	return mul_un8(luma, alpha);
+}
+
+static void set_palette_entry(PaletteLUT *lut, u32 index, AsepriteRGBAPixel color) {
+	lut->colors[index] = color;
+	if (color.alpha > 0) {
+		lut->bits[index/8] |= 1 << (index%8);
+	}
+	else {
+		lut->bits[index/8] &= ~(1 << (index%8));
+	}
+}
+
+//Until the palette chunk is seen, every index except the transparent one is white.  background_lut is for 
+//background layers, where the transparent index is white too.
+void init_palette_lut(PaletteLUT *lut, PaletteLUT *background_lut, u8 transparent_color_index) {
+	AsepriteRGBAPixel white = {255, 255, 255, 255};
+	AsepriteRGBAPixel transparent = {0};
+	for (u32 i = 0; i < 256; i++) {
+		set_palette_entry(lut, i, (i == transparent_color_index) ? transparent : white);
+		set_palette_entry(background_lut, i, white);
+	}
+}
+
+//Folds a palette chunk (0x2019) into the lookup tables.  The transparent index stays transparent in lut, 
+//background_lut takes every color as it is.
+bool parse_palette_chunk(AsepriteStream *stream, u8 transparent_color_index, PaletteLUT *lut, PaletteLUT *background_lut) {
+	u8 *palette_chunk_data = stream_take(stream, sizeof(AsepritePaletteChunkHeader));
+	if (!palette_chunk_data) {
+		return false;
+	}
+	AsepritePaletteChunkHeader palette_chunk_header = *(AsepritePaletteChunkHeader*)palette_chunk_data;
+	for (u32 i = palette_chunk_header.first_color_index; 
+			i <= palette_chunk_header.last_color_index && i < 256; 
+			i++) {
+		AsepritePaletteEntry *entry = (AsepritePaletteEntry*)stream_take(stream, sizeof(AsepritePaletteEntry));
+		if (!entry) {
+			return false;
+		}
+		AsepriteRGBAPixel color = {entry->red, entry->green, entry->blue, entry->alpha};
+		set_palette_entry(background_lut, i, color);
+		if (i == transparent_color_index) {
+			color.alpha = 0;
+		}
+		set_palette_entry(lut, i, color);
+		if (entry->flags & 1) {
+			u8 *name_len_data = stream_take(stream, sizeof(u16));
+			if (!name_len_data) {
+				return false;
+			}
+			u16 name_len;
+			memcpy(&name_len, name_len_data, sizeof(u16));
+			if (!stream_skip(stream, name_len)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//Converts palette indices to 0/255 (transparent/visible) through the lookup table.
+//The 256 bit table fits in two 16 byte registers, so 16 pixels are looked up per pshufb pair: 
+//the high 5 bits of the index pick the table byte and the low 3 bits pick the bit within it.
+void palette_indices_to_pixels(u8 *dst, const u8 *indices, usize count, const PaletteLUT *lut) {
+	usize i = 0;
+#if SIMD_SSSE3
+	const __m128i table_lo = _mm_loadu_si128((const __m128i*)&lut->bits[0]);
+	const __m128i table_hi = _mm_loadu_si128((const __m128i*)&lut->bits[16]);
+	const __m128i bit_table = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	for (; i + 16 <= count; i += 16) {
+		__m128i index = _mm_loadu_si128((const __m128i*)&indices[i]);
+		__m128i byte_index = _mm_and_si128(_mm_srli_epi16(index, 3), _mm_set1_epi8(0x1F));
+		__m128i use_hi = _mm_cmpgt_epi8(byte_index, _mm_set1_epi8(15));
+		__m128i lut_bytes = _mm_or_si128(_mm_and_si128(use_hi, _mm_shuffle_epi8(table_hi, byte_index)), 
+				_mm_andnot_si128(use_hi, _mm_shuffle_epi8(table_lo, byte_index)));
+		__m128i bit = _mm_shuffle_epi8(bit_table, _mm_and_si128(index, _mm_set1_epi8(7)));
+		__m128i on = _mm_cmpeq_epi8(_mm_and_si128(lut_bytes, bit), bit);
+		_mm_storeu_si128((__m128i*)&dst[i], on);
+	}
+#elif SIMD_NEON
+	const uint8x16x2_t table = {{vld1q_u8(&lut->bits[0]), vld1q_u8(&lut->bits[16])}};
+	static const u8 bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	const uint8x16_t bit_table = vld1q_u8(bits);
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t index = vld1q_u8(&indices[i]);
+		uint8x16_t lut_bytes = vqtbl2q_u8(table, vshrq_n_u8(index, 3));
+		uint8x16_t bit = vqtbl1q_u8(bit_table, vandq_u8(index, vdupq_n_u8(7)));
+		vst1q_u8(&dst[i], vtstq_u8(lut_bytes, bit));
+	}
+#endif
+	for (; i < count; i++) {
+		dst[i] = ((lut->bits[indices[i]/8] >> (indices[i]%8)) & 1) ? 0xFF : 0;
+	}
+}
+
+//Converts a cel row to RGBA
+static void cel_row_to_rgba(AsepriteRGBAPixel *dst, const u8 *data, usize count, u16 color_depth, const PaletteLUT *lut) {
+	switch (color_depth) {
+	case 32:
+		memcpy(dst, data, count*sizeof(AsepriteRGBAPixel));
+		break;
+	case 16: {
+		const AsepriteGrayscalePixel *pixels = (const AsepriteGrayscalePixel*)data;
+		for (usize i = 0; i < count; i++) {
+			dst[i] = (AsepriteRGBAPixel){pixels[i].value, pixels[i].value, pixels[i].value, pixels[i].alpha};
+		}
+	} break;
+	case 8:
+		for (usize i = 0; i < count; i++) {
+			dst[i] = lut->colors[data[i]];
+		}
+		break;
+	}
+}
+
+//Converts a row of composited RGBA to levels (0 = black, 255 = white).  The mode is switched on once per row so 
+//each inner loop stays branch free.
+static void rgba_row_to_levels(u8 *dst, const AsepriteRGBAPixel *pixels, usize count, ConversionMode mode) {
+	if (mode == CONVERSION_MODE_ALPHA) {
+		for (usize i = 0; i < count; i++) {
+			dst[i] = (pixels[i].alpha > 0) ? 0xFF : 0;
+		}
+	}
+	else {
+		for (usize i = 0; i < count; i++) {
+			dst[i] = rgba_level(pixels[i].red, pixels[i].green, pixels[i].blue, pixels[i].alpha);
+		}
+	}
+}
+
+//Fast path: Normal blending straight into the frame's level plane, used when every visible layer is Normal at full 
+//opacity.  Levels are luma premultiplied by alpha, and luma is linear, so src-over is just
+//level = src_level + level*(1 - src_alpha).  In alpha mode every visible pixel is fully white, so that's an OR.
+static void composite_row_levels(u8 *dst, const u8 *data, usize count, u16 color_depth, u8 opacity, ConversionMode mode, 
+		const PaletteLUT *lut, AsepriteRGBAPixel *rgba_scratch) {
+	if (mode == CONVERSION_MODE_ALPHA && color_depth == 8 && opacity == 255) {
+		//rgba_scratch is at least count bytes
+		u8 *visible = (u8*)rgba_scratch;
+		palette_indices_to_pixels(visible, data, count, lut);
+		for (usize i = 0; i < count; i++) {
+			dst[i] |= visible[i];
+		}
+		return;
+	}
+	cel_row_to_rgba(rgba_scratch, data, count, color_depth, lut);
+	if (mode == CONVERSION_MODE_ALPHA) {
+		for (usize i = 0; i < count; i++) {
+			dst[i] |= (mul_un8(rgba_scratch[i].alpha, opacity) > 0) ? 0xFF : 0;
+		}
+	}
+	else {
+		for (usize i = 0; i < count; i++) {
+			AsepriteRGBAPixel p = rgba_scratch[i];
+			u8 alpha = mul_un8(p.alpha, opacity);
+			dst[i] = rgba_level(p.red, p.green, p.blue, alpha) + mul_un8(dst[i], 255 - alpha);
+		}
+	}
+}
+
+//Full path: 8 bit RGBA compositing with layer/cel opacity and blend modes.  Blended colors are mixed in by the 
+//backdrop's alpha (Cs' = (1 - Ab)*Cs + Ab*B(Cb, Cs)) and then composited src-over, as in the W3C compositing spec.
+//When either alpha is opaque the result alpha is 255 and src-over is a plain lerp, which the SIMD kernel does 4 pixels 
+//at a time; only translucent-over-translucent pixels need the division.
+static inline bool is_supported_blend_mode(u16 blend_mode) {
+	switch (blend_mode) {
+	case BLEND_MODE_NORMAL: case BLEND_MODE_MULTIPLY: case BLEND_MODE_SCREEN: case BLEND_MODE_DARKEN: 
+	case BLEND_MODE_LIGHTEN: case BLEND_MODE_DIFFERENCE: case BLEND_MODE_ADDITION: case BLEND_MODE_SUBTRACT:
+		return true;
+	}
+	return false;
+}
+
+static bool layer_name_matches(const char *const *names, u32 name_count, const u8 *name, u16 name_len) {
+	for (u32 i = 0; i < name_count; i++) {
+		if (strlen(names[i]) == name_len && memcmp(names[i], name, name_len) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//Reads a layer chunk (0x2004) into the table, resolving whether its cels get drawn.
+//Layers come in file order with every group followed by its children, so the parent of a layer is the 
+//closest previous layer one child level up.  Reference layers and groups themselves are never drawn.
+bool parse_layer_chunk(AsepriteStream *stream, const ProgramArgs *pa, u32 file_flags, LayerTable *table) {
+	u8 *layer_chunk_data = stream_take(stream, sizeof(AsepriteLayerChunkHeader));
+	if (!layer_chunk_data) {
+		return false;
+	}
+	AsepriteLayerChunkHeader layer_chunk = *(AsepriteLayerChunkHeader*)layer_chunk_data;
+	u8 *name = stream_take(stream, layer_chunk.layer_name_len);
+	if (!name) {
+		return false;
+	}
+	if (table->count == MAX_LAYERS) {
+		return true;
+	}
+
+	LayerInfo *parent = NULL;
+	for (u32 i = table->count; layer_chunk.layer_child_level > 0 && i-- > 0;) {
+		if (table->layers[i].child_level < layer_chunk.layer_child_level) {
+			if (table->layers[i].child_level == layer_chunk.layer_child_level - 1) {
+				parent = &table->layers[i];
+			}
+			break;
+		}
+	}
+	bool is_picked = layer_name_matches(pa->layer_names, pa->layer_name_count, name, layer_chunk.layer_name_len);
+	bool is_dropped = layer_name_matches(pa->excluded_layer_names, pa->excluded_layer_name_count, name, layer_chunk.layer_name_len);
+	u32 tileset_index = 0;
+	if (layer_chunk.layer_type == LAYER_TYPE_TILEMAP) {
+		u8 *tileset_index_data = stream_take(stream, sizeof(u32));
+		if (!tileset_index_data) {
+			return false;
+		}
+		memcpy(&tileset_index, tileset_index_data, sizeof(u32));
+	}
+
+	LayerInfo *layer = &table->layers[table->count++];
+	layer->type = layer_chunk.layer_type;
+	layer->child_level = layer_chunk.layer_child_level;
+	layer->opacity = (file_flags & AHF_LAYER_OPACITY_IS_VALID) ? layer_chunk.opacity : 255;
+	layer->blend_mode = layer_chunk.blend_mode;
+	layer->tileset_index = tileset_index;
+	layer->is_background = (layer_chunk.flags & LAYER_FLAG_BACKGROUND) != 0;
+	layer->kept_cels = NULL;
+	layer->has_dropped_cels = false;
+	layer->is_shown = is_picked || ((layer_chunk.flags & LAYER_FLAG_VISIBLE) && (!parent || parent->is_shown));
+	layer->is_selected = pa->layer_name_count == 0 || is_picked || (parent && parent->is_selected);
+	layer->is_excluded = is_dropped || (parent && parent->is_excluded);
+	layer->is_visible = layer->is_shown && layer->is_selected && !layer->is_excluded && 
+		!(layer_chunk.flags & LAYER_FLAG_REFERENCE) && layer->type != LAYER_TYPE_GROUP;
+	if (!layer->is_visible) {
+		DEBUGOUTLN("Layer %u is not drawn", table->count - 1);
+	}
+	if (layer->is_visible && !is_supported_blend_mode(layer->blend_mode)) {
+		PRINTERR("Warning: blend mode %u is not supported, compositing layer %u as Normal.", layer->blend_mode, table->count - 1);
+		layer->blend_mode = BLEND_MODE_NORMAL;
+	}
+	return true;
+}
+
+//Reads a tileset chunk (0x2023), decoding its tiles into the table.  Tilesets linked from external files are left empty.  
+//Returns CONVERSION_ERROR_TOO_BIG if the tiles don't fit in the arena.
+ConversionErrorCode parse_tileset_chunk(AsepriteStream *stream, u64 chunk_end, const AsepriteHeader *file_header, const PaletteLUT *lut, 
+		TilesetTable *table, ByteStackAllocator *allocator) {
+	u8 *tileset_chunk_data = stream_take(stream, sizeof(AsepriteTilesetChunkHeader));
+	if (!tileset_chunk_data) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	AsepriteTilesetChunkHeader tileset_chunk = *(AsepriteTilesetChunkHeader*)tileset_chunk_data;
+	if (!stream_skip(stream, tileset_chunk.name_len)) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	if (!(tileset_chunk.flags & TILESET_FLAG_TILES_IN_FILE)) {
+		PRINTERR("Warning: tileset %u is in an external file, its tiles won't be drawn.", tileset_chunk.id);
+		return CONVERSION_OK;
+	}
+	if (tileset_chunk.id >= MAX_TILESETS) {
+		PRINTERR("Warning: only %u tilesets are supported, tileset %u won't be drawn.", MAX_TILESETS, tileset_chunk.id);
+		return CONVERSION_OK;
+	}
+	//a tileset linked from another file can also keep its tiles here, behind the file and tileset ids
+	if ((tileset_chunk.flags & TILESET_FLAG_EXTERNAL_FILE) && !stream_skip(stream, 2*sizeof(u32))) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	u8 *compressed_len_data = stream_take(stream, sizeof(u32));
+	if (!compressed_len_data) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	u32 compressed_len;
+	memcpy(&compressed_len, compressed_len_data, sizeof(u32));
+	if (stream->offset + compressed_len > chunk_end) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+
+	Tileset *tileset = &table->tilesets[tileset_chunk.id];
+	usize tile_size = (usize)tileset_chunk.tile_width*tileset_chunk.tile_height;
+	if (tile_size == 0) {
+		//nothing to draw, however many tiles it claims to have
+		return CONVERSION_OK;
+	}
+	u32 mask_stride = (tileset_chunk.tile_width + 7)/8;
+	AsepriteRGBAPixel *pixels = push_array(tileset_chunk.number_of_tiles, tile_size*sizeof(AsepriteRGBAPixel), allocator);
+	u8 *masks = push_array(tileset_chunk.number_of_tiles, (u64)tileset_chunk.tile_height*mask_stride, allocator);
+	bool *is_empty = push_array(tileset_chunk.number_of_tiles, sizeof(bool), allocator);
+	//the tileset image in the sprite's color depth only lives until it's converted
+	ByteStackAllocator scratch_allocator = *allocator;
+	u8 *image = push_array(tileset_chunk.number_of_tiles, tile_size*(file_header->color_depth/8), &scratch_allocator);
+	if (!pixels || !masks || !is_empty || !image) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+	usize pixel_count = tile_size*tileset_chunk.number_of_tiles;
+	usize image_len = pixel_count*(file_header->color_depth/8);
+	if (pixel_count > 0 && (compressed_len == 0 || !stream_inflate_into(stream, compressed_len, image, image_len))) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	cel_row_to_rgba(pixels, image, pixel_count, file_header->color_depth, lut);
+
+	for (u32 t = 0; t < tileset_chunk.number_of_tiles; t++) {
+		const AsepriteRGBAPixel *tile = &pixels[t*tile_size];
+		u8 *mask = &masks[(usize)t*tileset_chunk.tile_height*mask_stride];
+		is_empty[t] = true;
+		for (u32 y = 0; y < tileset_chunk.tile_height; y++) {
+			for (u32 i = 0; i < mask_stride; i++) {
+				u8 bits = 0;
+				for (u32 b = 0; b < 8 && 8*i + b < tileset_chunk.tile_width; b++) {
+					bits |= (tile[y*tileset_chunk.tile_width + 8*i + b].alpha > 0) << b;
 				}
-				else {
-					DEBUGOUTLN("Not visible!");
+				mask[y*mask_stride + i] = bits;
+				if (bits) {
+					is_empty[t] = false;
 				}
+			}
+		}
+	}
+	tileset->tile_width = tileset_chunk.tile_width;
+	tileset->tile_height = tileset_chunk.tile_height;
+	tileset->mask_stride = mask_stride;
+	tileset->pixels = pixels;
+	tileset->masks = masks;
+	tileset->is_empty = is_empty;
+	tileset->tile_count = tileset_chunk.number_of_tiles;
+	return CONVERSION_OK;
+}
 
-			} break;
-			
-            case 0x2005: { //cel chunk
+//Reads a slice chunk (0x2022) into the table.  Returns CONVERSION_ERROR_TOO_BIG if its keys don't fit in the arena.
+ConversionErrorCode parse_slice_chunk(AsepriteStream *stream, u64 chunk_end, SliceTable *table, ByteStackAllocator *allocator) {
+	u8 *slice_chunk_data = stream_take(stream, sizeof(AsepriteSliceChunkHeader));
+	if (!slice_chunk_data) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	AsepriteSliceChunkHeader slice_chunk = *(AsepriteSliceChunkHeader*)slice_chunk_data;
+	u8 *name = stream_take(stream, slice_chunk.name_len);
+	if (!name) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	usize extra_len = ((slice_chunk.flags & SLICE_FLAG_9_PATCH) ? 16 : 0) + ((slice_chunk.flags & SLICE_FLAG_PIVOT) ? 8 : 0);
+	if (stream->offset > chunk_end || 
+			(u64)slice_chunk.number_of_keys*(sizeof(AsepriteSliceKey) + extra_len) > chunk_end - stream->offset) {
+		return CONVERSION_ERROR_INVALID_CHUNK;
+	}
+	if (table->count == MAX_SLICES) {
+		PRINTERR("Warning: only %u slices are supported, ignoring the rest.", MAX_SLICES);
+		return CONVERSION_OK;
+	}
+	Slice *slice = &table->slices[table->count];
+	slice->name = push_array((u64)slice_chunk.name_len + 1, 1, allocator);
+	slice->keys = push_array(slice_chunk.number_of_keys, sizeof(AsepriteSliceKey), allocator);
+	if (!slice->name || !slice->keys) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+	memcpy(slice->name, name, slice_chunk.name_len);
+	slice->name[slice_chunk.name_len] = '\0';
+	slice->key_count = slice_chunk.number_of_keys;
+	for (u32 i = 0; i < slice_chunk.number_of_keys; i++) {
+		if (!stream_read_into(stream, (u8*)&slice->keys[i], sizeof(AsepriteSliceKey)) || !stream_skip(stream, extra_len)) {
+			return CONVERSION_ERROR_INVALID_CHUNK;
+		}
+	}
+	table->count++;
+	return CONVERSION_OK;
+}
 
-                AsepriteCelChunkHeader *cel_chunk_header = (AsepriteCelChunkHeader*)chunk_data;
-                DEBUGOUTLN("Layer Index: %d", cel_chunk_header->layer_index);
-                if (! (visible_layer_bit_list.data[cel_chunk_header->layer_index/8] & (1 << cel_chunk_header->layer_index%8))) {
-                    continue;
-                }
-                switch (cel_chunk_header->type) {
-					case CCT_RAW_CEL: {
-                        u8 *cel_header_data = chunk_data + sizeof(AsepriteCelChunkHeader);
-                        AsepriteRawAndCompressedCelHeader *rac_cel_header = (AsepriteRawAndCompressedCelHeader*)cel_header_data;
-					    u8 *data = cel_header_data + sizeof(AsepriteRawAndCompressedCelHeader);
-					    if (file_header->color_depth == 32) {
-					        AsepriteRGBAPixel *pixels = (AsepriteRGBAPixel*)data;
-					        for (int y = 0; y < rac_cel_header->height; y++) {
-					      	  for (int x = 0; x < rac_cel_header->width; x++) {
-					      		  frame_bitmap[((y+cel_chunk_header->y)*file_header->width) + x + cel_chunk_header->x] = pixels[y*rac_cel_header->width + x].alpha > 0;
-					      		  DEBUGOUT("%d", pixels[y*rac_cel_header->width + x].alpha > 0);
-					      	  }
-					      	  DEBUGOUT("\n");
-					        }
-					    }
-					    else if (file_header->color_depth == 16) {
-					        AsepriteGrayscalePixel *pixels = (AsepriteGrayscalePixel*)data;
-					        for (int y = 0; y < rac_cel_header->height; y++) {
-					      	  for (int x = 0; x < rac_cel_header->width; x++) {
-					      		  frame_bitmap[((y+cel_chunk_header->y)*file_header->width) + x + cel_chunk_header->x] = pixels[y*rac_cel_header->width + x].alpha > 0;
-					      		  DEBUGOUT("%d", pixels[y*rac_cel_header->width + x].alpha > 0);
-					      	  }
-					      	  DEBUGOUT("\n");
-					        }
-					    }
-					    else {
-					        PRINTERR("Invalid color depth in cel chunk! Either the file is corrupted, or there is a bug in this program (probably the latter).");
-					        exit(1);
-					    }
-					  } break;
-                    case CCT_LINKED_CEL:
-                        //TODO linked cell
-						assert(0);
-                        break;
-                    case CCT_COMPRESSED_CEL: {
-                        u8 *cel_header_data = chunk_data + sizeof(AsepriteCelChunkHeader);
-                        AsepriteRawAndCompressedCelHeader *rac_cel_header = (AsepriteRawAndCompressedCelHeader*)cel_header_data;
-                        u8 *compressed_data = cel_header_data + sizeof(AsepriteRawAndCompressedCelHeader);
-                        mz_ulong tmp_buffer_len = decompression_buffer_len; 
-                        int decompression_result = uncompress(decompression_buffer, &tmp_buffer_len, compressed_data, chunk_header->size - sizeof(AsepriteChunkHeader) - sizeof(AsepriteRawAndCompressedCelHeader));
-						if (decompression_result != MZ_OK) {
-							PRINTERR("Invalid compressed data in cel chunk! Either the file is corrupted, or there is a bug in this program (probably the latter).");
-							exit(1);
-						}
-                        if (file_header->color_depth == 32) {
-                            AsepriteRGBAPixel *pixels = (AsepriteRGBAPixel*)decompression_buffer;
-                            for (int y = 0; y < rac_cel_header->height; y++) {
-                                for (int x = 0; x < rac_cel_header->width; x++) {
-									frame_bitmap[((y+cel_chunk_header->y)*file_header->width) + x + cel_chunk_header->x] = pixels[y*rac_cel_header->width + x].alpha > 0;
-                                    DEBUGOUT("%d", pixels[y*rac_cel_header->width + x].alpha > 0);
-                                }
-                                DEBUGOUT("\n");
-                            }
-                        }
-                        else if (file_header->color_depth == 16) {
-                            AsepriteGrayscalePixel *pixels = (AsepriteGrayscalePixel*)decompression_buffer;
-                            for (int y = 0; y < rac_cel_header->height; y++) {
-                                for (int x = 0; x < rac_cel_header->width; x++) {
-									frame_bitmap[((y+cel_chunk_header->y)*file_header->width) + x + cel_chunk_header->x] = pixels[y*rac_cel_header->width + x].alpha > 0;
-                                    DEBUGOUT("%d", pixels[y*rac_cel_header->width + x].alpha > 0);
-                                }
-                                DEBUGOUT("\n");
-                            }
-                        }
-                        else {
-							PRINTERR("Invalid color depth in cel chunk! Either the file is corrupted, or there is a bug in this program (probably the latter).");
-							exit(1);
-                        }
-
-
-
-                    } break;
-                }
-                DEBUGOUTLN("Cel Chunk type: 0x%X", cel_chunk_header->type);
-            } break;
-            }
-			
+static inline u8 blend_channel(u8 b, u8 s, u16 blend_mode) {
+	switch (blend_mode) {
+	case BLEND_MODE_MULTIPLY: return mul_un8(b, s);
+	case BLEND_MODE_SCREEN: return b + s - mul_un8(b, s);
+	case BLEND_MODE_DARKEN: return (b < s) ? b : s;
+	case BLEND_MODE_LIGHTEN: return (b > s) ? b : s;
+	case BLEND_MODE_DIFFERENCE: return (b > s) ? b - s : s - b;
+	case BLEND_MODE_ADDITION: return (b + s > 255) ? 255 : b + s;
+	case BLEND_MODE_SUBTRACT: return (b > s) ? b - s : 0;
+	default: return s;
+	}
+}
+
+static inline void blend_pixel(AsepriteRGBAPixel *dst, AsepriteRGBAPixel src, u8 opacity, u16 blend_mode) {
+	u8 sa = mul_un8(src.alpha, opacity);
+	u8 ba = dst->alpha;
+	if (ba == 0) {
+		*dst = src;
+		dst->alpha = sa;
+		return;
+	}
+	if (sa == 0) {
+		return;
+	}
+	u8 ra = sa + ba - mul_un8(ba, sa);
+	u8 *bc = &dst->red;
+	const u8 *sc = &src.red;
+	for (int c = 0; c < 3; c++) {
+		u8 blended = mul_un8(sc[c], 255 - ba) + mul_un8(blend_channel(bc[c], sc[c], blend_mode), ba);
+		if (ra == 255) {
+			u32 t = (u32)bc[c]*(255 - sa) + (u32)blended*sa + 128;
+			bc[c] = (u8)((t + (t >> 8)) >> 8);
+		}
+		else {
+			u32 numerator = (u32)blended*sa*255 + (u32)bc[c]*ba*(255 - sa);
+			u32 denominator = (u32)ra*255;
+			bc[c] = (u8)((numerator + denominator/2) / denominator);
 		}
 	}
+	dst->alpha = ra;
+}
+
+#if SIMD_SSSE3
+//x/255 rounded, for x <= 255*255
+static inline __m128i div255_epu16(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
 
+//Two pixels, one channel per 16 bit lane
+static inline __m128i blend_channels_epu16(__m128i b, __m128i s, u16 blend_mode) {
+	switch (blend_mode) {
+	case BLEND_MODE_MULTIPLY: return div255_epu16(_mm_mullo_epi16(b, s));
+	case BLEND_MODE_SCREEN: return _mm_sub_epi16(_mm_add_epi16(b, s), div255_epu16(_mm_mullo_epi16(b, s)));
+	case BLEND_MODE_DARKEN: return _mm_min_epi16(b, s);
+	case BLEND_MODE_LIGHTEN: return _mm_max_epi16(b, s);
+	case BLEND_MODE_DIFFERENCE: return _mm_sub_epi16(_mm_max_epi16(b, s), _mm_min_epi16(b, s));
+	case BLEND_MODE_ADDITION: return _mm_min_epi16(_mm_add_epi16(b, s), _mm_set1_epi16(255));
+	case BLEND_MODE_SUBTRACT: return _mm_subs_epu16(b, s);
+	default: return s;
+	}
+}
 
-	if (pa.should_show_frames) {
-		for (int f = 0; f < file_header->frames; f++) {
-			for (int y = 0; y < file_header->height; y++) {
-				for (int x = 0; x < file_header->width; x++) {
-					printf("%d", output_frames[f*file_header->height*file_header->width + y*file_header->width + x]);
-				}
-				printf("\n");
+static inline __m128i broadcast_alpha_epu16(__m128i x) {
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xFF), 0xFF);
+}
+
+//Blends two pixels unpacked to 16 bit lanes.  Only valid when no pixel is translucent over translucent.
+static inline __m128i blend_pixels_epu16(__m128i b, __m128i s, __m128i opacity, u16 blend_mode) {
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i alpha_lanes = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	__m128i ba = broadcast_alpha_epu16(b);
+	__m128i sa = div255_epu16(_mm_mullo_epi16(broadcast_alpha_epu16(s), opacity));
+	__m128i blended = _mm_add_epi16(div255_epu16(_mm_mullo_epi16(s, _mm_sub_epi16(full, ba))), 
+			div255_epu16(_mm_mullo_epi16(blend_channels_epu16(b, s, blend_mode), ba)));
+	__m128i color = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(b, _mm_sub_epi16(full, sa)), _mm_mullo_epi16(blended, sa)));
+	__m128i alpha = _mm_sub_epi16(_mm_add_epi16(sa, ba), div255_epu16(_mm_mullo_epi16(ba, sa)));
+	__m128i ret = _mm_or_si128(_mm_andnot_si128(alpha_lanes, color), _mm_and_si128(alpha_lanes, alpha));
+	//a transparent backdrop just takes the source
+	__m128i from_src = _mm_or_si128(_mm_andnot_si128(alpha_lanes, s), _mm_and_si128(alpha_lanes, sa));
+	__m128i is_backdrop_clear = _mm_cmpeq_epi16(ba, _mm_setzero_si128());
+	return _mm_or_si128(_mm_andnot_si128(is_backdrop_clear, ret), _mm_and_si128(is_backdrop_clear, from_src));
+}
+#endif
+
+void blend_row(AsepriteRGBAPixel *dst, const AsepriteRGBAPixel *src, usize count, u8 opacity, u16 blend_mode) {
+	usize i = 0;
+#if SIMD_SSSE3
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opacity_epu16 = _mm_set1_epi16(opacity);
+	const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+	const __m128i is_opaque_src_simple = _mm_set1_epi32((opacity == 255) ? -1 : 0);
+	for (; i + 4 <= count; i += 4) {
+		__m128i b = _mm_loadu_si128((const __m128i*)&dst[i]);
+		__m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+		//translucent over translucent needs a division, leave those to the scalar path
+		__m128i sa = _mm_and_si128(s, alpha_mask);
+		__m128i ba = _mm_and_si128(b, alpha_mask);
+		__m128i is_simple = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(sa, zero), _mm_cmpeq_epi32(ba, zero)), 
+				_mm_or_si128(_mm_cmpeq_epi32(ba, alpha_mask), 
+					_mm_and_si128(_mm_cmpeq_epi32(sa, alpha_mask), is_opaque_src_simple)));
+		if (_mm_movemask_epi8(is_simple) != 0xFFFF) {
+			for (usize j = i; j < i + 4; j++) {
+				blend_pixel(&dst[j], src[j], opacity, blend_mode);
 			}
-			printf("\n\n");
+			continue;
 		}
+		__m128i lo = blend_pixels_epu16(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(s, zero), opacity_epu16, blend_mode);
+		__m128i hi = blend_pixels_epu16(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(s, zero), opacity_epu16, blend_mode);
+		_mm_storeu_si128((__m128i*)&dst[i], _mm_packus_epi16(lo, hi));
 	}
-    else if (pa.should_show_python) {
-		printf("animation = [\n");
-		for (int f = 0; f < file_header->frames; f++) {
-			printf("    [\n");
-			for (int y = 0; y < file_header->height; y+=8) {
-				printf("        [");
-				for (int x = 0; x < file_header->width; x++) {
-					u8 pixel_data = 0;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+0)*file_header->width + x] << 0;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+1)*file_header->width + x] << 1;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+2)*file_header->width + x] << 2;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+3)*file_header->width + x] << 3;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+4)*file_header->width + x] << 4;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+5)*file_header->width + x] << 5;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+6)*file_header->width + x] << 6;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+7)*file_header->width + x] << 7;
-					printf("0x%X,", pixel_data);
-				}
-				printf("],\n");
+#endif
+	for (; i < count; i++) {
+		blend_pixel(&dst[i], src[i], opacity, blend_mode);
+	}
+}
+
+//The part of a cel that lands inside bounds (a rectangle of the canvas), in cel coordinates.  Empty when x0 == x1 or y0 == y1.
+typedef struct CelClip {
+	u32 x0, y0, x1, y1;
+} CelClip;
+
+CelClip clip_cel(Rect bounds, const AsepriteCelChunkHeader *cel_chunk_header, u32 cel_width, u32 cel_height) {
+	CelClip ret = {0};
+	i64 x0 = (i64)bounds.x0 - cel_chunk_header->x;
+	i64 y0 = (i64)bounds.y0 - cel_chunk_header->y;
+	i64 x1 = (i64)bounds.x1 - cel_chunk_header->x;
+	i64 y1 = (i64)bounds.y1 - cel_chunk_header->y;
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > cel_width) x1 = cel_width;
+	if (y1 > cel_height) y1 = cel_height;
+	if (x0 < x1 && y0 < y1) {
+		ret.x0 = (u32)x0; ret.y0 = (u32)y0;
+		ret.x1 = (u32)x1; ret.y1 = (u32)y1;
+	}
+	return ret;
+}
+
+//Composites the cel's pixels into the frame: into frame_rgba when compositing at full precision, otherwise 
+//straight into the frame's level plane (0 = black, 255 = white)
+//data starts at row clip.y0 of the cel.  Only the clipped span of each row is touched.
+void composite_cel(u8 *frame_levels, AsepriteRGBAPixel *frame_rgba, AsepriteHeader *file_header, 
+		AsepriteCelChunkHeader *cel_chunk_header, AsepriteRawAndCompressedCelHeader *rac_cel_header, CelClip clip, u8 *data, 
+		u8 opacity, u16 blend_mode, ConversionMode mode, const PaletteLUT *palette_lut, AsepriteRGBAPixel *row_scratch) {
+	usize bytes_per_pixel = file_header->color_depth/8;
+	usize row_stride = rac_cel_header->width*bytes_per_pixel;
+	u32 span = clip.x1 - clip.x0;
+	for (u32 y = clip.y0; y < clip.y1; y++) {
+		usize frame_index = (usize)(y + cel_chunk_header->y)*file_header->width + (clip.x0 + cel_chunk_header->x);
+		const u8 *row = &data[(y - clip.y0)*row_stride + clip.x0*bytes_per_pixel];
+		if (frame_rgba) {
+			const AsepriteRGBAPixel *src = (const AsepriteRGBAPixel*)row;
+			if (file_header->color_depth != 32) {
+				cel_row_to_rgba(row_scratch, row, span, file_header->color_depth, palette_lut);
+				src = row_scratch;
 			}
-			printf("    ],\n\n");
+			blend_row(&frame_rgba[frame_index], src, span, opacity, blend_mode);
+		}
+		else {
+			composite_row_levels(&frame_levels[frame_index], row, span, file_header->color_depth, 
+					opacity, mode, palette_lut, row_scratch);
 		}
-		printf("]\n");
+	}
+}
 
-    }
-	else {
-		printf("const unsigned char animation[%d][%d][%d] = {\n", file_header->frames, byte_height, file_header->width);
-		for (int f = 0; f < file_header->frames; f++) {
-			printf("    {\n");
-			for (int y = 0; y < file_header->height; y+=8) {
-				printf("        {");
-				for (int x = 0; x < file_header->width; x++) {
-					u8 pixel_data = 0;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+0)*file_header->width + x] << 0;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+1)*file_header->width + x] << 1;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+2)*file_header->width + x] << 2;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+3)*file_header->width + x] << 3;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+4)*file_header->width + x] << 4;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+5)*file_header->width + x] << 5;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+6)*file_header->width + x] << 6;
-					pixel_data |= output_frames[f*file_header->height*file_header->width + (y+7)*file_header->width + x] << 7;
-					printf("0x%X,", pixel_data);
-				}
-				printf("},\n");
-			}
-			printf("    },\n\n");
-		}
-		printf("};\n");
+//8x8 bit matrix in a u64, byte i bit j becomes byte j bit i.  Three rounds swapping ever smaller blocks across the 
+//diagonal, from Hacker's Delight.
+static inline u64 transpose_8x8(u64 x) {
+	u64 t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+	x ^= t ^ (t << 28);
+	return x;
+}
+
+//Byte i is 0xFF if bit i of bits is set, else 0
+static inline u64 expand_bits_to_bytes(u8 bits) {
+	u64 x = (bits*0x0101010101010101ull) & 0x8040201008040201ull;
+	//adding 0x7F sets a byte's top bit if it's nonzero, without carrying into the next byte
+	return (((x + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull)*0xFF;
+}
+
+//tiles holds the tile rows from 0 up to the one containing clip.y1 - 1.  Every tile is clipped to the canvas and 
+//copied from the tileset: unflipped tiles in alpha mode OR their mask rows into the level plane, 8 pixels at a time 
+//where they can, everything else composites the decoded RGBA rows.  row_scratch holds 2*tile_width pixels.
+void composite_tilemap_cel(u8 *frame_levels, AsepriteRGBAPixel *frame_rgba, AsepriteHeader *file_header, 
+		AsepriteCelChunkHeader *cel_chunk_header, AsepriteTilemapCelHeader *tilemap_header, CelClip clip, const u32 *tiles, 
+		const Tileset *tileset, u8 opacity, u16 blend_mode, ConversionMode mode, AsepriteRGBAPixel *row_scratch) {
+	u32 tw = tileset->tile_width, th = tileset->tile_height;
+	u32 flip_mask = tilemap_header->x_flip_mask | tilemap_header->y_flip_mask | tilemap_header->diagonal_flip_mask;
+	AsepriteRGBAPixel *flipped_row = &row_scratch[tw];
+	for (u32 ty = clip.y0/th; ty*th < clip.y1; ty++) {
+		for (u32 tx = clip.x0/tw; tx*tw < clip.x1; tx++) {
+			u32 tile = tiles[(usize)ty*tilemap_header->width + tx];
+			u32 tile_id = tile & tilemap_header->tile_id_mask;
+			if (tile_id >= tileset->tile_count || tileset->is_empty[tile_id]) {
+				continue;
+			}
+			//part of the tile on the canvas, in tile coordinates
+			u32 x0 = (clip.x0 > tx*tw) ? clip.x0 - tx*tw : 0;
+			u32 y0 = (clip.y0 > ty*th) ? clip.y0 - ty*th : 0;
+			u32 x1 = (clip.x1 < (tx + 1)*tw) ? clip.x1 - tx*tw : tw;
+			u32 y1 = (clip.y1 < (ty + 1)*th) ? clip.y1 - ty*th : th;
+			//may point before the frame when the tile hangs off its top left, only the clipped part is touched
+			i64 frame_origin = ((i64)cel_chunk_header->y + ty*th)*file_header->width + ((i64)cel_chunk_header->x + tx*tw);
+			const AsepriteRGBAPixel *tile_pixels = &tileset->pixels[(usize)tile_id*tw*th];
+
+			if (!(tile & flip_mask) && !frame_rgba && mode == CONVERSION_MODE_ALPHA && opacity == 255) {
+				const u8 *mask = &tileset->masks[(usize)tile_id*th*tileset->mask_stride];
+				for (u32 y = y0; y < y1; y++) {
+					const u8 *mask_row = &mask[y*tileset->mask_stride];
+					u8 *dst = &frame_levels[frame_origin + (i64)y*file_header->width];
+					u32 x = x0;
+					for (; x < x1 && x%8 != 0; x++) {
+						dst[x] |= -((mask_row[x/8] >> (x%8)) & 1);
+					}
+					//a whole mask byte is 8 pixels, ORed in as 8 levels at once
+					for (; x + 8 <= x1; x += 8) {
+						if (!mask_row[x/8]) {
+							continue;
+						}
+						u64 levels;
+						memcpy(&levels, &dst[x], sizeof(levels));
+						levels |= expand_bits_to_bytes(mask_row[x/8]);
+						memcpy(&dst[x], &levels, sizeof(levels));
+					}
+					for (; x < x1; x++) {
+						dst[x] |= -((mask_row[x/8] >> (x%8)) & 1);
+					}
+				}
+				continue;
+			}
+			for (u32 y = y0; y < y1; y++) {
+				const AsepriteRGBAPixel *src = &tile_pixels[y*tw + x0];
+				if (tile & flip_mask) {
+					//diagonal flip swaps the axes after the x/y flips, so it only applies to square tiles
+					bool is_diagonal = (tile & tilemap_header->diagonal_flip_mask) && tw == th;
+					for (u32 x = x0; x < x1; x++) {
+						u32 sx = (tile & tilemap_header->x_flip_mask) ? tw - 1 - x : x;
+						u32 sy = (tile & tilemap_header->y_flip_mask) ? th - 1 - y : y;
+						flipped_row[x - x0] = is_diagonal ? tile_pixels[sx*tw + sy] : tile_pixels[sy*tw + sx];
+					}
+					src = flipped_row;
+				}
+				usize frame_index = frame_origin + (i64)y*file_header->width + x0;
+				if (frame_rgba) {
+					blend_row(&frame_rgba[frame_index], src, x1 - x0, opacity, blend_mode);
+				}
+				else {
+					composite_row_levels(&frame_levels[frame_index], (const u8*)src, x1 - x0, 32, opacity, mode, NULL, row_scratch);
+				}
+			}
+		}
 	}
+}
 
+//Every mode quantizes as "white if level > threshold(x, y)".  Thresholds tile every 8 rows and 16 columns 
+//(Bayer sizes divide both), so a page only ever needs one 16 byte threshold vector per row.
+typedef struct ThresholdMatrix {
+	u8 rows[8][16];
+} ThresholdMatrix;
+
+ThresholdMatrix make_threshold_matrix(const ProgramArgs *pa) {
+	ThresholdMatrix ret;
+	u8 threshold = (pa->mode == CONVERSION_MODE_THRESHOLD) ? pa->threshold : 127;
+	memset(ret.rows, threshold, sizeof(ret.rows));
+	if (pa->mode == CONVERSION_MODE_ORDERED_DITHER) {
+		u32 n = pa->dither_size;
+		for (u32 y = 0; y < 8; y++) {
+			for (u32 x = 0; x < 16; x++) {
+				//M_2n(x, y) = 4*M_n(x%n, y%n) + M_2(x/n, y/n), built up from the 2x2 matrix {{0, 2}, {3, 1}}
+				u32 index = 0;
+				u32 weight = n*n/4;
+				for (u32 size = 1; size < n; size *= 2, weight /= 4) {
+					u32 qx = (x/size) & 1, qy = (y/size) & 1;
+					index += (((qx ^ qy) << 1) | qy) * weight;
+				}
+				ret.rows[y][x] = (u8)(((2*index + 1)*256) / (2*n*n) - 1);
+			}
+		}
+	}
+	return ret;
+}
+
+//Quantizes 8 rows of levels into one SSD1306 page: bit r of byte x is the pixel at row r, column x.
+//16 columns are done at a time: each row's compare mask is ANDed with its bit and ORed into the page bytes.
+//Rows are passed by pointer so a partial last page can point its missing rows at a black row instead of 
+//needing a bounds checked loop.
+void quantize_page(u8 *page, const u8 *const rows[8], usize width, const ThresholdMatrix *thresholds) {
+	usize x = 0;
+#if SIMD_SSSE3
+	for (; x + 16 <= width; x += 16) {
+		__m128i packed = _mm_setzero_si128();
+		for (int r = 0; r < 8; r++) {
+			__m128i level = _mm_loadu_si128((const __m128i*)&rows[r][x]);
+			__m128i threshold = _mm_loadu_si128((const __m128i*)thresholds->rows[r]);
+			//level > threshold exactly when the saturating difference is non zero
+			__m128i is_black = _mm_cmpeq_epi8(_mm_subs_epu8(level, threshold), _mm_setzero_si128());
+			packed = _mm_or_si128(packed, _mm_andnot_si128(is_black, _mm_set1_epi8((char)(1 << r))));
+		}
+		_mm_storeu_si128((__m128i*)&page[x], packed);
+	}
+#elif SIMD_NEON
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t packed = vdupq_n_u8(0);
+		for (int r = 0; r < 8; r++) {
+			uint8x16_t is_white = vcgtq_u8(vld1q_u8(&rows[r][x]), vld1q_u8(thresholds->rows[r]));
+			packed = vorrq_u8(packed, vandq_u8(is_white, vdupq_n_u8(1 << r)));
+		}
+		vst1q_u8(&page[x], packed);
+	}
+#endif
+	for (; x < width; x++) {
+		u8 pixel_data = 0;
+		for (int r = 0; r < 8; r++) {
+			pixel_data |= (rows[r][x] > thresholds->rows[r][x%16]) << r;
+		}
+		page[x] = pixel_data;
+	}
+}
+
+//The matrix as seen from a page whose top left pixel is at x0, y0, so dithering lines up across pages that don't start 
+//on a page or 16 column boundary of the image
+static ThresholdMatrix offset_threshold_matrix(const ThresholdMatrix *thresholds, u32 x0, u32 y0) {
+	ThresholdMatrix ret;
+	for (u32 y = 0; y < 8; y++) {
+		for (u32 x = 0; x < 16; x++) {
+			ret.rows[y][x] = thresholds->rows[(y + y0) % 8][(x + x0) % 16];
+		}
+	}
+	return ret;
+}
+
+typedef struct QuantizeWork {
+	const u8 *frame_levels;
+	u8 *packed_frames;
+	u16 width;
+	u16 height;
+	u16 page_count;
+	u16 frame_count;
+	const u8 *black_row; //width zeros, stands in for the rows past the bottom of the image
+	ThresholdMatrix thresholds;
+	//--panels
+	u32 panel_columns, panel_rows;
+	u32 panel_width, panel_height, panel_page_count;
+	ThresholdMatrix panel_thresholds[MAX_PANELS];
+} QuantizeWork;
+
+//One work item per page of every frame.  Thresholds depend only on position, so pages are independent.
+static void quantize_page_work(void *data, u32 work_index) {
+	QuantizeWork *work = data;
+	usize frame = work_index / work->page_count;
+	usize page = work_index % work->page_count;
+	usize frame_size = (usize)work->width*work->height;
+	const u8 *rows[8];
+	for (u32 r = 0; r < 8; r++) {
+		usize y = page*8 + r;
+		rows[r] = (y < work->height) ? &work->frame_levels[frame*frame_size + y*work->width] : work->black_row;
+	}
+	quantize_page(&work->packed_frames[(frame*work->page_count + page)*work->width], rows, work->width, &work->thresholds);
+}
+
+//--panels: one work item per page of every panel of every frame.  Each panel's pages go straight into its own block, 
+//panel after panel, so a panel's frame is one run of bytes.  What lies outside the image is black.
+static void quantize_panel_page_work(void *data, u32 work_index) {
+	QuantizeWork *work = data;
+	u32 panel_count = work->panel_columns*work->panel_rows;
+	usize page = work_index % work->panel_page_count;
+	usize frame = (work_index / work->panel_page_count) / panel_count;
+	u32 panel = (work_index / work->panel_page_count) % panel_count;
+	u32 x0 = (panel % work->panel_columns)*work->panel_width, y0 = (panel / work->panel_columns)*work->panel_height;
+	usize frame_size = (usize)work->width*work->height;
+	u32 visible_width = (x0 >= work->width) ? 0 : (work->width - x0 < work->panel_width) ? work->width - x0 : work->panel_width;
+	const u8 *rows[8];
+	for (u32 r = 0; r < 8; r++) {
+		usize y = y0 + page*8 + r;
+		bool is_visible = visible_width > 0 && y < work->height && page*8 + r < work->panel_height;
+		rows[r] = is_visible ? &work->frame_levels[frame*frame_size + y*work->width + x0] : work->black_row;
+	}
+	u8 *panel_page = &work->packed_frames[(((usize)panel*work->frame_count + frame)*work->panel_page_count + page)*work->panel_width];
+	quantize_page(panel_page, rows, visible_width, &work->panel_thresholds[panel]);
+	memset(&panel_page[visible_width], 0, work->panel_width - visible_width);
+}
+
+//Error diffusion.  Rather than pushing each pixel's error forward, every pixel pulls the weighted errors of the 
+//already quantized pixels that the kernel diffuses into it.  Each error cell is written once by the thread that owns 
+//its row, so rows can run concurrently as a skewed wavefront: row y may quantize column x once row y-1 got past x+1 
+//(which in turn means row y-2 got past x+2).  The arithmetic doesn't depend on scheduling, so output is identical for 
+//any thread count.
+//Errors are int16 in 1/16ths of a level.  The planes have 2 zeroed border columns on each side and 2 rows on top, 
+//so no kernel tap needs a bounds check.
+#define DIFFUSION_FRACTION_BITS 4
+#define DIFFUSION_BORDER 2
+#define DIFFUSION_BLOCK_WIDTH 64 //columns quantized between wavefront progress updates
+
+typedef struct DiffusionKernel {
+	u8 divisor_shift;
+	u8 tap_count;
+	struct {
+		i8 dx; //offset from the pixel whose error is diffused
+		i8 dy;
+		u8 weight;
+	} taps[6];
+} DiffusionKernel;
+
+static const DiffusionKernel DIFFUSION_KERNELS[] = {
+	[DIFFUSION_KERNEL_FLOYD_STEINBERG] = {4, 4, {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}},
+	[DIFFUSION_KERNEL_ATKINSON] = {3, 6, {{1, 0, 1}, {2, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}, {0, 2, 1}}},
+	[DIFFUSION_KERNEL_SIERRA_LITE] = {2, 3, {{1, 0, 2}, {-1, 1, 1}, {0, 1, 1}}},
+};
+
+typedef struct DiffusionWork {
+	u8 *frame_levels;
+	u16 width;
+	u16 height;
+	u16 frame_count;
+	const DiffusionKernel *kernel;
+	usize error_stride;
+	//per worker error planes when frames run in parallel, or the single shared plane and row progress of the wavefront
+	i16 *error_planes;
+	u32 *row_progress;
+	u8 *levels; //frame being diffused by the wavefront
+	i16 *errors;
+	u32 next_frame;
+} DiffusionWork;
+
+static inline i16 *diffusion_error_row(DiffusionWork *work, i16 *errors, u32 y) {
+	return &errors[(y + DIFFUSION_BORDER)*work->error_stride + DIFFUSION_BORDER];
+}
+
+//Quantizes columns [x0, x1) of row y in place to 0 or 255
+static void diffuse_row_span(DiffusionWork *work, u8 *levels, i16 *errors, u32 y, u32 x0, u32 x1) {
+	const DiffusionKernel *kernel = work->kernel;
+	u8 *row = &levels[(usize)y*work->width];
+	i16 *error_row = diffusion_error_row(work, errors, y);
+	isize tap_offsets[6];
+	for (u32 i = 0; i < kernel->tap_count; i++) {
+		tap_offsets[i] = -(isize)kernel->taps[i].dy*work->error_stride - kernel->taps[i].dx;
+	}
+	for (u32 x = x0; x < x1; x++) {
+		i32 incoming = 0;
+		for (u32 i = 0; i < kernel->tap_count; i++) {
+			incoming += kernel->taps[i].weight*error_row[x + tap_offsets[i]];
+		}
+		incoming = (incoming + (1 << (kernel->divisor_shift - 1))) >> kernel->divisor_shift;
+		i32 value = ((i32)row[x] << DIFFUSION_FRACTION_BITS) + incoming;
+		bool is_white = value >= (128 << DIFFUSION_FRACTION_BITS);
+		i32 error = value - (is_white ? (255 << DIFFUSION_FRACTION_BITS) : 0);
+		error_row[x] = (i16)((error < INT16_MIN) ? INT16_MIN : (error > INT16_MAX) ? INT16_MAX : error);
+		row[x] = is_white ? 0xFF : 0;
+	}
+}
+
+//Frames in parallel: each worker owns an error plane and pulls whole frames
+static void diffuse_frames_work(void *data, u32 worker_index) {
+	DiffusionWork *work = data;
+	usize plane_size = work->error_stride*(work->height + DIFFUSION_BORDER);
+	i16 *errors = &work->error_planes[worker_index*plane_size];
+	for (;;) {
+		u32 frame = __atomic_fetch_add(&work->next_frame, 1, __ATOMIC_RELAXED);
+		if (frame >= work->frame_count) {
+			return;
+		}
+		memset(errors, 0, plane_size*sizeof(i16));
+		u8 *levels = &work->frame_levels[(usize)frame*work->width*work->height];
+		for (u32 y = 0; y < work->height; y++) {
+			diffuse_row_span(work, levels, errors, y, 0, work->width);
+		}
+	}
+}
+
+//Wavefront: one work item per row.  Rows are handed out in order, so the row being waited on is always running.
+static void diffuse_wavefront_row_work(void *data, u32 y) {
+	DiffusionWork *work = data;
+	for (u32 x0 = 0; x0 < work->width; x0 += DIFFUSION_BLOCK_WIDTH) {
+		u32 x1 = (x0 + DIFFUSION_BLOCK_WIDTH < work->width) ? x0 + DIFFUSION_BLOCK_WIDTH : work->width;
+		if (y > 0) {
+			u32 needed = (x1 + 1 < work->width) ? x1 + 1 : work->width;
+			for (u32 spins = 0; __atomic_load_n(&work->row_progress[y - 1], __ATOMIC_ACQUIRE) < needed; spins++) {
+				if (spins > 1024) {
+					platform_yield_thread();
+				}
+			}
+		}
+		diffuse_row_span(work, work->levels, work->errors, y, x0, x1);
+		__atomic_store_n(&work->row_progress[y], x1, __ATOMIC_RELEASE);
+	}
+}
+
+//Returns false if the error planes don't fit in the arena
+bool diffuse_frames(u8 *frame_levels, u16 width, u16 height, u16 frame_count, DiffusionKernelType kernel_type, 
+		u32 thread_count, ByteStackAllocator *allocator) {
+	DiffusionWork work = {0};
+	work.frame_levels = frame_levels;
+	work.width = width;
+	work.height = height;
+	work.frame_count = frame_count;
+	work.kernel = &DIFFUSION_KERNELS[kernel_type];
+	work.error_stride = width + 2*DIFFUSION_BORDER;
+	usize plane_size = work.error_stride*(height + DIFFUSION_BORDER);
+
+	//a few big frames don't keep the threads busy, so split each one across rows instead
+	if (frame_count >= thread_count || height < 2*thread_count) {
+		if (thread_count > frame_count) thread_count = frame_count;
+		//huge canvases get fewer workers rather than more error planes than the arena holds
+		while (thread_count > 1 && !can_push_array(thread_count, plane_size*sizeof(i16), allocator)) thread_count--;
+		work.error_planes = push_array(thread_count, plane_size*sizeof(i16), allocator);
+		if (!work.error_planes) {
+			return false;
+		}
+		platform_parallel_for(diffuse_frames_work, &work, thread_count, thread_count);
+	}
+	else {
+		work.errors = push_array(plane_size, sizeof(i16), allocator);
+		work.row_progress = push_array(height, sizeof(u32), allocator);
+		if (!work.errors || !work.row_progress) {
+			return false;
+		}
+		for (u32 frame = 0; frame < frame_count; frame++) {
+			memset(work.errors, 0, plane_size*sizeof(i16));
+			memset(work.row_progress, 0, height*sizeof(u32));
+			work.levels = &frame_levels[(usize)frame*width*height];
+			platform_parallel_for(diffuse_wavefront_row_work, &work, height, thread_count);
+		}
+	}
+	return true;
+}
+
+//Tile-indexed output.  Every page of every frame is cut into tile_width wide tiles (the last one in a row is padded 
+//with zeros), and identical tiles are stored once.  The firmware draws a page by copying tile_width bytes per map entry.
+typedef struct TileAtlas {
+	u8 *tiles; //tile_count*tile_width bytes, in order of first use
+	u32 tile_count;
+	u32 tile_width;
+	u32 tiles_per_row;
+	u32 *map; //frames*page_count*tiles_per_row indices into tiles
+} TileAtlas;
+
+static u64 hash_tile(const u8 *tile, u32 len) {
+	//FNV-1a
+	u64 hash = 0xcbf29ce484222325ull;
+	for (u32 i = 0; i < len; i++) {
+		hash = (hash ^ tile[i])*0x100000001b3ull;
+	}
+	return hash;
+}
+
+//Dedupes through an open addressing hash table of tile indices, sized to stay at most half full.  Returns false if 
+//the map, the tiles or the table don't fit in the arena.
+static bool build_tile_atlas(const u8 *packed_frames, u16 width, u32 page_count, u16 frame_count, u32 tile_width, 
+		TileAtlas *out, ByteStackAllocator *allocator) {
+	TileAtlas ret = {0};
+	ret.tile_width = tile_width;
+	ret.tiles_per_row = (width + tile_width - 1)/tile_width;
+	u64 total_tiles = (u64)ret.tiles_per_row*page_count*frame_count;
+	ret.map = push_array(total_tiles, sizeof(u32), allocator);
+	ret.tiles = push_array(total_tiles, tile_width, allocator);
+
+	ByteStackAllocator scratch_allocator = *allocator;
+	u64 slot_count = 16;
+	while (slot_count < 2*total_tiles) slot_count *= 2;
+	u32 *slots = push_array(slot_count, sizeof(u32), &scratch_allocator);
+	u8 *tile = push_array(1, tile_width, &scratch_allocator);
+	if (!ret.map || !ret.tiles || !slots || !tile) {
+		return false;
+	}
+	memset(slots, 0xFF, slot_count*sizeof(u32));
+
+	usize map_index = 0;
+	for (u32 row = 0; row < page_count*frame_count; row++) {
+		const u8 *page = &packed_frames[(usize)row*width];
+		for (u32 t = 0; t < ret.tiles_per_row; t++) {
+			u32 x = t*tile_width;
+			u32 len = (x + tile_width <= width) ? tile_width : width - x;
+			memcpy(tile, &page[x], len);
+			memset(&tile[len], 0, tile_width - len);
+
+			usize slot = (usize)(hash_tile(tile, tile_width) & (slot_count - 1));
+			while (slots[slot] != 0xFFFFFFFF && memcmp(&ret.tiles[(usize)slots[slot]*tile_width], tile, tile_width) != 0) {
+				slot = (slot + 1) & (slot_count - 1);
+			}
+			if (slots[slot] == 0xFFFFFFFF) {
+				slots[slot] = ret.tile_count++;
+				memcpy(&ret.tiles[(usize)slots[slot]*tile_width], tile, tile_width);
+			}
+			ret.map[map_index++] = slots[slot];
+		}
+	}
+	*out = ret;
+	return true;
+}
+
+//Smallest unsigned C type that holds max_value
+static const char *c_uint_type(u32 max_value) {
+	return (max_value <= 0xFF) ? "unsigned char" : (max_value <= 0xFFFF) ? "unsigned short" : "unsigned int";
+}
+
+//8 rows of column x of a packed frame, starting at row y (which needn't be page aligned).  Rows past the last page are 0.
+static inline u8 packed_column_bits(const u8 *packed_frame, u16 width, u32 page_count, u32 x, u32 y) {
+	u32 page = y/8, shift = y%8;
+	u8 ret = (page < page_count) ? packed_frame[page*width + x] >> shift : 0;
+	if (shift && page + 1 < page_count) {
+		ret |= packed_frame[(page + 1)*width + x] << (8 - shift);
+	}
+	return ret;
+}
+
+//Moves page_count pages of width bytes down by shift rows (0-7) into page_count + 1 pages
+static void shift_pages_down(u8 *dst, const u8 *pages, u32 page_count, u32 width, u32 shift) {
+	for (u32 p = 0; p <= page_count; p++) {
+		for (u32 x = 0; x < width; x++) {
+			u8 lo = (p < page_count) ? (u8)(pages[p*width + x] << shift) : 0;
+			u8 hi = (p > 0 && shift > 0) ? pages[(p - 1)*width + x] >> (8 - shift) : 0;
+			dst[p*width + x] = lo | hi;
+		}
+	}
+}
+
+//--commands: each frame as an SSD1306 command stream (see ssd1306_emulator.h) that draws it in the top left corner 
+//of the display.  The first frame sets horizontal addressing and rewrites the whole image, so playback can start or 
+//loop there whatever the display shows.  In delta mode the other frames only rewrite windows around what changed.
+//The SH1106 only has page addressing, so there a window is written page by page, each page behind commands setting 
+//the page and column.
+//With --scroll, runs of frames that are each the previous one moved a column sideways are left to the display's 
+//horizontal scrolling: the first frame of the run is drawn and starts the scroll, the others are empty, and the frame 
+//after the run stops it and is drawn whole.
+typedef struct CommandStreams {
+	u8 *bytes;
+	u32 *offsets; //frame_count + 1, frame f is bytes[offsets[f]] up to bytes[offsets[f + 1]]
+	u32 frame_count;
+} CommandStreams;
+
+typedef struct CommandWriter {
+	u8 *cursor;
+	u8 *data_len; //length byte of the open data packet, NULL if there isn't one
+} CommandWriter;
+
+static void write_commands(CommandWriter *writer, const u8 *commands, u8 len) {
+	writer->data_len = NULL;
+	*writer->cursor++ = SSD1306_CONTROL_COMMANDS;
+	*writer->cursor++ = len;
+	memcpy(writer->cursor, commands, len);
+	writer->cursor += len;
+}
+
+static void write_data_byte(CommandWriter *writer, u8 byte) {
+	if (!writer->data_len || *writer->data_len == SSD1306_MAX_PACKET_LEN) {
+		*writer->cursor++ = SSD1306_CONTROL_DATA;
+		writer->data_len = writer->cursor++;
+		*writer->data_len = 0;
+	}
+	*writer->cursor++ = byte;
+	(*writer->data_len)++;
+}
+
+static inline u32 data_stream_size(u32 data_len) {
+	return data_len + 2*((data_len + SSD1306_MAX_PACKET_LEN - 1)/SSD1306_MAX_PACKET_LEN);
+}
+
+//Sets the window to columns x0-x1 of pages p0-p1 and fills it.  The branch is per window, the byte loops are the 
+//controller's own.
+static void write_window(CommandWriter *writer, const ControllerProfile *controller, const u8 *packed_frame, u16 width, 
+		u32 x0, u32 x1, u32 p0, u32 p1) {
+	u32 column_offset = controller->column_offset;
+	if (controller->controller == SSD1306_CONTROLLER_SH1106) {
+		for (u32 p = p0; p <= p1; p++) {
+			u32 column = x0 + column_offset;
+			u8 commands[] = {(u8)(0xB0 | p), (u8)(column & 0xF), (u8)(0x10 | (column >> 4))};
+			write_commands(writer, commands, sizeof(commands));
+			for (u32 x = x0; x <= x1; x++) {
+				write_data_byte(writer, packed_frame[p*width + x]);
+			}
+		}
+		writer->data_len = NULL;
+		return;
+	}
+	u8 commands[] = {0x21, (u8)(x0 + column_offset), (u8)(x1 + column_offset), 0x22, (u8)p0, (u8)p1};
+	write_commands(writer, commands, sizeof(commands));
+	for (u32 p = p0; p <= p1; p++) {
+		for (u32 x = x0; x <= x1; x++) {
+			write_data_byte(writer, packed_frame[p*width + x]);
+		}
+	}
+	writer->data_len = NULL;
+}
+
+//Bytes write_window puts in the stream
+static u32 window_stream_size(const ControllerProfile *controller, u32 x0, u32 x1, u32 p0, u32 p1) {
+	if (controller->controller == SSD1306_CONTROLLER_SH1106) {
+		return (p1 - p0 + 1)*(2 + 3 + data_stream_size(x1 - x0 + 1));
+	}
+	return 2 + 6 + data_stream_size((x1 - x0 + 1)*(p1 - p0 + 1));
+}
+
+//Most windows plan_delta_windows makes: a page split in runs has gaps longer than a window's overhead between them
+#define MAX_DELTA_WINDOWS (SSD1306_PAGES*(SSD1306_COLUMNS/8 + 1))
+
+//Windows over the pages that differ from the previous frame.  Neighbouring pages share a window (covering both 
+//column spans) when that's smaller than a window each.  An SH1106 window is written page by page anyway, so rather 
+//than sharing windows, pages are split into runs of changed columns wherever the unchanged columns between them cost 
+//more to rewrite than another window.  Returns the bytes the windows take, windows_out gets x0, x1, p0, p1 for each one.
+static u32 plan_delta_windows(const ControllerProfile *controller, const u8 *packed_frame, const u8 *previous_frame, 
+		u16 width, u32 page_count, u32 windows_out[MAX_DELTA_WINDOWS][4], u32 *window_count) {
+	u32 size = 0;
+	*window_count = 0;
+	for (u32 p = 0; p < page_count; p++) {
+		const u8 *page = &packed_frame[p*width], *previous_page = &previous_frame[p*width];
+		u32 x0 = 0, x1 = width;
+		while (x0 < width && page[x0] == previous_page[x0]) x0++;
+		if (x0 == width) {
+			continue;
+		}
+		if (controller->controller == SSD1306_CONTROLLER_SH1106) {
+			u32 window_overhead = window_stream_size(controller, 0, 0, p, p) - 1;
+			u32 run_x0 = x0, run_x1 = x0;
+			for (u32 x = x0 + 1; x <= width; x++) {
+				if (x < width && page[x] == previous_page[x]) {
+					continue;
+				}
+				if (x == width || x - run_x1 - 1 > window_overhead) {
+					u32 *window = windows_out[(*window_count)++];
+					window[0] = run_x0;
+					window[1] = run_x1;
+					window[2] = window[3] = p;
+					size += window_stream_size(controller, run_x0, run_x1, p, p);
+					run_x0 = x;
+				}
+				run_x1 = x;
+			}
+			continue;
+		}
+		while (page[x1 - 1] == previous_page[x1 - 1]) x1--;
+		x1--;
+		if (*window_count > 0) {
+			u32 *last = windows_out[*window_count - 1];
+			u32 merged_x0 = (x0 < last[0]) ? x0 : last[0], merged_x1 = (x1 > last[1]) ? x1 : last[1];
+			u32 last_size = window_stream_size(controller, last[0], last[1], last[2], last[3]);
+			u32 merged_size = window_stream_size(controller, merged_x0, merged_x1, last[2], p);
+			if (merged_size <= last_size + window_stream_size(controller, x0, x1, p, p)) {
+				last[0] = merged_x0;
+				last[1] = merged_x1;
+				last[3] = p;
+				size += merged_size - last_size;
+				continue;
+			}
+		}
+		u32 *window = windows_out[(*window_count)++];
+		window[0] = x0;
+		window[1] = x1;
+		window[2] = window[3] = p;
+		size += window_stream_size(controller, x0, x1, p, p);
+	}
+	return size;
+}
+
+//Draws packed_frame over previous_frame (NULL if the display could show anything) with windows around what changed, 
+//or by rewriting the whole image if that's smaller
+static void write_frame_commands(CommandWriter *writer, const ControllerProfile *controller, const u8 *packed_frame, 
+		const u8 *previous_frame, u16 width, u32 page_count) {
+	if (previous_frame) {
+		u32 windows[MAX_DELTA_WINDOWS][4];
+		u32 window_count;
+		u32 delta_size = plan_delta_windows(controller, packed_frame, previous_frame, width, page_count, windows, &window_count);
+		if (delta_size < window_stream_size(controller, 0, width - 1, 0, page_count - 1)) {
+			for (u32 i = 0; i < window_count; i++) {
+				write_window(writer, controller, packed_frame, width, windows[i][0], windows[i][1], windows[i][2], windows[i][3]);
+			}
+			return;
+		}
+	}
+	write_window(writer, controller, packed_frame, width, 0, width - 1, 0, page_count - 1);
+}
+
+//Bytes write_frame_commands can take
+static usize frame_commands_capacity(const ControllerProfile *controller, u16 width, u32 page_count) {
+	//never more than a window per page, a page split in runs is smaller than one window over it.  Then the addressing 
+	//mode, and stopping and starting a scroll.
+	return (usize)page_count*(window_stream_size(controller, 0, width - 1, 0, 0) + 2) + 20;
+}
+
+//--scroll: frames first_frame to last_frame are shown for a scroll step each, and every one after the first is the 
+//one before moved a column
+typedef struct ScrollRun {
+	u32 first_frame, last_frame;
+	u8 command; //0x26 right, 0x27 left
+	u8 start_page, end_page;
+	u8 interval; //the 0x26/0x27 argument
+} ScrollRun;
+
+//Hardware scroll steps come every few display frames, and a frame takes SSD1306_CLOCKS_PER_ROW oscillator clocks per 
+//row.  These are the power on clock (0xD5 0x80) and precharge (0xD9 0x22), real displays vary by 10% or so.
+#define SSD1306_OSCILLATOR_HZ 370000
+#define SSD1306_CLOCKS_PER_ROW 54
+#define SCROLL_INTERVAL_NONE 0xFF
+
+static double scroll_step_ms(u8 interval, u32 display_rows) {
+	return ssd1306_scroll_interval_frames(interval)*SSD1306_CLOCKS_PER_ROW*display_rows*1000.0/SSD1306_OSCILLATOR_HZ;
+}
+
+//The interval whose steps are closest to duration_ms, SCROLL_INTERVAL_NONE if none is within a quarter of it
+static u8 scroll_interval_for(u32 duration_ms, u32 display_rows) {
+	u8 ret = SCROLL_INTERVAL_NONE;
+	double best_error = duration_ms/4.0;
+	for (u8 interval = 0; interval < 8; interval++) {
+		double error = scroll_step_ms(interval, display_rows) - duration_ms;
+		error = (error < 0) ? -error : error;
+		if (error <= best_error) {
+			best_error = error;
+			ret = interval;
+		}
+	}
+	return ret;
+}
+
+//0x26 if frame is pages start_page-end_page of previous scrolled a column right, 0x27 if left, 0 if it isn't a scroll 
+//step.  Scrolled pages wrap around, and the other pages must be unchanged.
+static u8 scroll_step_command(const u8 *frame, const u8 *previous, u16 width, u32 page_count, u32 *start_page, u32 *end_page) {
+	u32 p0 = 0, p1 = page_count;
+	while (p0 < page_count && memcmp(&frame[p0*width], &previous[p0*width], width) == 0) p0++;
+	if (p0 == page_count) {
+		return 0;
+	}
+	while (memcmp(&frame[(p1 - 1)*width], &previous[(p1 - 1)*width], width) == 0) p1--;
+	bool is_right = true, is_left = true;
+	for (u32 p = p0; p < p1; p++) {
+		const u8 *page = &frame[p*width], *previous_page = &previous[p*width];
+		is_right = is_right && page[0] == previous_page[width - 1] && memcmp(&page[1], previous_page, width - 1) == 0;
+		is_left = is_left && page[width - 1] == previous_page[0] && memcmp(page, &previous_page[1], width - 1) == 0;
+	}
+	*start_page = p0;
+	*end_page = p1 - 1;
+	return is_right ? 0x26 : is_left ? 0x27 : 0;
+}
+
+//Finds the runs of frames the display can scroll itself: steps in the same direction over the same pages, all shown 
+//for as long as a scroll step takes.  The display scrolls whole GRAM rows, so the image must be as wide as the display.
+//runs needs room for frame_count/2.  Returns how many runs there are.
+static u32 plan_scroll_runs(const ControllerProfile *controller, const u8 *packed_frames, u16 width, u32 page_count, 
+		u16 frame_count, const u16 *frame_durations, ScrollRun *runs) {
+	usize frame_pages_size = (usize)page_count*width;
+	u32 run_count = 0;
+	if (width != controller->width || controller->column_offset != 0) {
+		return 0;
+	}
+	for (u32 f = 0; f + 1 < frame_count; ) {
+		ScrollRun run = {f, f};
+		u32 start_page, end_page;
+		run.command = scroll_step_command(&packed_frames[(f + 1)*frame_pages_size], &packed_frames[f*frame_pages_size], 
+				width, page_count, &start_page, &end_page);
+		run.interval = scroll_interval_for(frame_durations[f], controller->height);
+		run.start_page = (u8)start_page;
+		run.end_page = (u8)end_page;
+		while (run.command != 0 && run.interval != SCROLL_INTERVAL_NONE && run.last_frame + 1 < frame_count && 
+				frame_durations[run.last_frame + 1] == frame_durations[f] && 
+				scroll_step_command(&packed_frames[(run.last_frame + 1)*frame_pages_size], 
+					&packed_frames[run.last_frame*frame_pages_size], width, page_count, &start_page, &end_page) == run.command && 
+				start_page == run.start_page && end_page == run.end_page) {
+			run.last_frame++;
+		}
+		if (run.last_frame > f) {
+			runs[run_count++] = run;
+		}
+		f = run.last_frame + 1;
+	}
+	return run_count;
+}
+
+//The image must fit on the display.  scroll_runs are from plan_scroll_runs(), if there are any.  Returns false if the 
+//streams don't fit in the arena.
+bool build_command_streams(const ControllerProfile *controller, const u8 *packed_frames, u16 width, u32 page_count, 
+		u16 frame_count, CommandMode mode, const ScrollRun *scroll_runs, u32 scroll_run_count, CommandStreams *out, 
+		ByteStackAllocator *allocator) {
+	assert(width > 0 && width <= controller->width && page_count*8 <= controller->height);
+	usize frame_pages_size = (usize)page_count*width;
+	CommandStreams ret = {0};
+	ret.frame_count = frame_count;
+	ret.offsets = push_array((u64)frame_count + 1, sizeof(u32), allocator);
+	ret.bytes = push_array(frame_count, frame_commands_capacity(controller, width, page_count), allocator);
+	if (!ret.offsets || !ret.bytes) {
+		return false;
+	}
+	CommandWriter writer = {ret.bytes, NULL};
+	u32 run = 0; //the first scroll run that doesn't end before f
+	for (u32 f = 0; f < frame_count; f++) {
+		const u8 *packed_frame = &packed_frames[f*frame_pages_size];
+		ret.offsets[f] = (u32)(writer.cursor - ret.bytes);
+		while (run < scroll_run_count && scroll_runs[run].last_frame < f) run++;
+		const ScrollRun *scroll = (run < scroll_run_count && scroll_runs[run].first_frame <= f) ? &scroll_runs[run] : NULL;
+		if (scroll && f > scroll->first_frame) {
+			//the display is scrolling, and may not be written to
+			continue;
+		}
+		//after a scroll GRAM has to be rewritten, it's only roughly known how far it got
+		bool was_scrolling = run > 0 && scroll_runs[run - 1].last_frame + 1 == f;
+		if (f == 0) {
+			//playback can loop back from a scroll
+			u8 commands[3], len = 0;
+			if (scroll_run_count > 0) commands[len++] = 0x2E;
+			if (controller->controller != SSD1306_CONTROLLER_SH1106) {
+				commands[len++] = 0x20;
+				commands[len++] = SSD1306_ADDRESSING_HORIZONTAL;
+			}
+			if (len > 0) write_commands(&writer, commands, len);
+		}
+		else if (was_scrolling) {
+			u8 stop_scroll = 0x2E;
+			write_commands(&writer, &stop_scroll, 1);
+		}
+		write_frame_commands(&writer, controller, packed_frame, 
+				(f > 0 && mode == COMMAND_MODE_DELTA && !was_scrolling) ? packed_frame - frame_pages_size : NULL, width, page_count);
+		if (scroll) {
+			u8 start_scroll[] = {scroll->command, 0x00, scroll->start_page, scroll->interval, scroll->end_page, 0x00, 0xFF, 0x2F};
+			write_commands(&writer, start_scroll, sizeof(start_scroll));
+		}
+	}
+	ret.offsets[frame_count] = (u32)(writer.cursor - ret.bytes);
+	*out = ret;
+	return true;
+}
+
+static bool play_frame_stream(SSD1306Emulator *display, const ControllerProfile *controller, const CommandStreams *streams, 
+		u32 f, const u8 *packed_frames, u16 width, u32 page_count) {
+	if (!ssd1306_emulator_run(display, &streams->bytes[streams->offsets[f]], streams->offsets[f + 1] - streams->offsets[f])) {
+		return false;
+	}
+	const u8 *packed_frame = &packed_frames[(usize)f*page_count*width];
+	for (u32 p = 0; p < page_count; p++) {
+		if (memcmp(&display->gram[p][controller->column_offset], &packed_frame[p*width], width) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//Plays the streams on an emulated display that starts out showing garbage, and checks it shows every frame, and the 
+//first one again after looping.  A scrolling display takes a step between frames.  display is left with the bus 
+//traffic of one pass through the frames.
+static bool verify_command_streams(const ControllerProfile *controller, const CommandStreams *streams, const u8 *packed_frames, 
+		u16 width, u32 page_count, SSD1306Emulator *display) {
+	ssd1306_emulator_init(display, controller->controller);
+	memset(display->gram, 0xA5, sizeof(display->gram));
+	if (streams->frame_count == 0) {
+		return true;
+	}
+	for (u32 f = 0; f < streams->frame_count; f++) {
+		ssd1306_emulator_scroll_step(display);
+		if (!play_frame_stream(display, controller, streams, f, packed_frames, width, page_count)) {
+			return false;
+		}
+	}
+	SSD1306Emulator looped = *display;
+	ssd1306_emulator_scroll_step(&looped);
+	return play_frame_stream(&looped, controller, streams, 0, packed_frames, width, page_count) && 
+		display->unknown_command_count == 0 && looped.prohibited_count == 0;
+}
+
+//Glyph atlas for --font.  Glyphs are stored in SSD1306 page order, each one page_count pages of widths[i] bytes, 
+//so a page aligned glyph is drawn with plain byte copies.  For the other 7 row offsets the glyphs are also stored 
+//shifted down into page_count + 1 pages, so drawing them is a masked byte merge instead of per pixel work.
+typedef struct Font {
+	u32 glyph_count;
+	u32 page_count; //of the tallest glyph
+	u32 column_count; //sum of the glyph widths
+	u16 *widths;
+	u16 *advances;
+	u32 *first_columns; //glyph i is at first_columns[i]*page_count in glyphs
+	u8 *glyphs;
+	u8 *shifted_glyphs; //shift s (1-7) starts at (s - 1)*column_count*(page_count + 1), glyph i at first_columns[i]*(page_count + 1) in it
+} Font;
+
+//One glyph per slice (cut from the frame of its first key), or one per frame if there are no slices.  
+//Slice glyphs are as wide as the slice and advance by their width.  Frame glyphs are trimmed to their rightmost 
+//lit column and advance one column more; empty frames (spaces) advance half the canvas width.  Returns false if the 
+//glyphs don't fit in the arena.
+bool build_font(const u8 *packed_frames, u16 width, u16 height, u32 page_count, u16 frame_count, 
+		const SliceTable *slices, Font *out, ByteStackAllocator *allocator) {
+	Font ret = {0};
+	ret.glyph_count = (slices->count > 0) ? slices->count : frame_count;
+	ret.widths = push_array(ret.glyph_count, sizeof(u16), allocator);
+	ret.advances = push_array(ret.glyph_count, sizeof(u16), allocator);
+	ret.first_columns = push_array(ret.glyph_count, sizeof(u32), allocator);
+	u32 *frames = push_array(ret.glyph_count, sizeof(u32), allocator);
+	u32 *xs = push_array(ret.glyph_count, sizeof(u32), allocator);
+	u32 *ys = push_array(ret.glyph_count, sizeof(u32), allocator);
+	u32 *heights = push_array(ret.glyph_count, sizeof(u32), allocator);
+	if (!ret.widths || !ret.advances || !ret.first_columns || !frames || !xs || !ys || !heights) {
+		return false;
+	}
+	usize frame_pages_size = (usize)page_count*width;
+
+	u32 max_height = 1;
+	for (u32 i = 0; i < ret.glyph_count; i++) {
+		if (slices->count > 0) {
+			const Slice *slice = &slices->slices[i];
+			frames[i] = xs[i] = ys[i] = heights[i] = ret.widths[i] = 0;
+			if (slice->key_count > 0) {
+				//clipped to the canvas
+				const AsepriteSliceKey *key = &slice->keys[0];
+				i64 x0 = (key->x > 0) ? key->x : 0, y0 = (key->y > 0) ? key->y : 0;
+				i64 x1 = (i64)key->x + key->width, y1 = (i64)key->y + key->height;
+				if (x1 > width) x1 = width;
+				if (y1 > height) y1 = height;
+				if (x0 < x1 && y0 < y1 && key->frame_number < frame_count) {
+					frames[i] = key->frame_number;
+					xs[i] = (u32)x0; ys[i] = (u32)y0;
+					ret.widths[i] = (u16)(x1 - x0);
+					heights[i] = (u32)(y1 - y0);
+				}
+			}
+			ret.advances[i] = ret.widths[i];
+		}
+		else {
+			frames[i] = i;
+			xs[i] = ys[i] = 0;
+			heights[i] = height;
+			const u8 *frame = &packed_frames[i*frame_pages_size];
+			u32 glyph_width = 0;
+			for (u32 p = 0; p < page_count; p++) {
+				for (u32 x = glyph_width; x < width; x++) {
+					if (frame[p*width + x]) glyph_width = x + 1;
+				}
+			}
+			ret.widths[i] = (u16)glyph_width;
+			ret.advances[i] = (u16)(glyph_width ? glyph_width + 1 : (width + 1)/2);
+		}
+		ret.first_columns[i] = ret.column_count;
+		ret.column_count += ret.widths[i];
+		if (heights[i] > max_height) max_height = heights[i];
+	}
+	ret.page_count = (max_height + 7)/8;
+
+	u32 shifted_page_count = ret.page_count + 1;
+	ret.glyphs = push_array(ret.column_count, ret.page_count, allocator);
+	ret.shifted_glyphs = push_array((u64)7*ret.column_count, shifted_page_count, allocator);
+	if (!ret.glyphs || !ret.shifted_glyphs) {
+		return false;
+	}
+	for (u32 i = 0; i < ret.glyph_count; i++) {
+		const u8 *frame = &packed_frames[frames[i]*frame_pages_size];
+		u8 *glyph = &ret.glyphs[(usize)ret.first_columns[i]*ret.page_count];
+		u32 w = ret.widths[i];
+		for (u32 p = 0; p < ret.page_count; p++) {
+			//rows past the glyph's height are cleared, they may belong to the next glyph
+			u8 row_mask = (heights[i] >= (p + 1)*8) ? 0xFF : (heights[i] > p*8) ? (u8)((1 << (heights[i] - p*8)) - 1) : 0;
+			for (u32 x = 0; x < w; x++) {
+				glyph[p*w + x] = packed_column_bits(frame, width, page_count, xs[i] + x, ys[i] + p*8) & row_mask;
+			}
+		}
+		for (u32 shift = 1; shift < 8; shift++) {
+			u8 *shifted = &ret.shifted_glyphs[((usize)(shift - 1)*ret.column_count + ret.first_columns[i])*shifted_page_count];
+			shift_pages_down(shifted, glyph, ret.page_count, w, shift);
+		}
+	}
+	*out = ret;
+	return true;
+}
+
+static const char FONT_C_DRAW_TEXT[] =
+"//Draws text into a page ordered framebuffer (fb_width bytes per page, like the SSD1306's GRAM) and returns the x\n"
+"//after the last glyph.  Each glyph's box (FONT_PAGES pages tall) replaces what's under it: page aligned glyphs\n"
+"//are byte copies, other rows merge the pre-shifted glyph into the pages it straddles.\n"
+"static int font_draw_text(unsigned char *fb, int fb_width, int fb_pages, int x, int y, const char *text) {\n"
+"    int top_page = (y >= 0) ? y/8 : -((7 - y)/8);\n"
+"    int shift = y - top_page*8;\n"
+"    int pages = shift ? FONT_PAGES + 1 : FONT_PAGES;\n"
+"    for (; *text; text++) {\n"
+"        int c = (unsigned char)*text - FONT_FIRST_CHAR;\n"
+"        if (c < 0 || c >= FONT_GLYPH_COUNT) continue;\n"
+"        int w = font_widths[c];\n"
+"        const unsigned char *glyph = shift ? &font_shifted_glyphs[shift - 1][font_first_columns[c]*(FONT_PAGES + 1)]\n"
+"                                           : &font_glyphs[font_first_columns[c]*FONT_PAGES];\n"
+"        for (int p = 0; p < pages; p++) {\n"
+"            int page = top_page + p;\n"
+"            if (page < 0 || page >= fb_pages) continue;\n"
+"            unsigned char *dst = &fb[page*fb_width];\n"
+"            const unsigned char *src = &glyph[p*w];\n"
+"            unsigned char keep = 0;\n"
+"            if (shift && p == 0) keep = (unsigned char)(0xFF >> (8 - shift));\n"
+"            else if (shift && p == FONT_PAGES) keep = (unsigned char)(0xFF << shift);\n"
+"            for (int i = 0; i < w; i++) {\n"
+"                int dx = x + i;\n"
+"                if (dx >= 0 && dx < fb_width) dst[dx] = (unsigned char)((dst[dx] & keep) | src[i]);\n"
+"            }\n"
+"        }\n"
+"        x += font_advances[c];\n"
+"    }\n"
+"    return x;\n"
+"}\n";
+
+static const char FONT_PYTHON_DRAW_TEXT[] =
+"#Draws text into a page ordered framebuffer (fb_width bytes per page, like the SSD1306's GRAM) and returns the x\n"
+"#after the last glyph.  Each glyph's box (FONT_PAGES pages tall) replaces what's under it.\n"
+"def font_draw_text(fb, fb_width, fb_pages, x, y, text):\n"
+"    top_page = y // 8\n"
+"    shift = y - top_page*8\n"
+"    pages = FONT_PAGES + 1 if shift else FONT_PAGES\n"
+"    for ch in text:\n"
+"        c = ord(ch) - FONT_FIRST_CHAR\n"
+"        if c < 0 or c >= FONT_GLYPH_COUNT:\n"
+"            continue\n"
+"        w = font_widths[c]\n"
+"        if shift:\n"
+"            glyph = font_shifted_glyphs[shift - 1]\n"
+"            start = font_first_columns[c]*(FONT_PAGES + 1)\n"
+"        else:\n"
+"            glyph = font_glyphs\n"
+"            start = font_first_columns[c]*FONT_PAGES\n"
+"        for p in range(pages):\n"
+"            page = top_page + p\n"
+"            if page < 0 or page >= fb_pages:\n"
+"                continue\n"
+"            keep = 0\n"
+"            if shift and p == 0:\n"
+"                keep = 0xFF >> (8 - shift)\n"
+"            elif shift and p == FONT_PAGES:\n"
+"                keep = (0xFF << shift) & 0xFF\n"
+"            for i in range(w):\n"
+"                dx = x + i\n"
+"                if 0 <= dx < fb_width:\n"
+"                    fb[page*fb_width + dx] = (fb[page*fb_width + dx] & keep) | glyph[start + p*w + i]\n"
+"        x += font_advances[c]\n"
+"    return x\n";
+
+static void print_u16_array(FILE *out, const char *name, const u16 *values, u32 count, bool is_python) {
+	u32 max_value = 0;
+	for (u32 i = 0; i < count; i++) {
+		if (values[i] > max_value) max_value = values[i];
+	}
+	if (is_python) fprintf(out, "%s = [", name);
+	else fprintf(out, "const %s %s[%u] = {", c_uint_type(max_value), name, count);
+	for (u32 i = 0; i < count; i++) {
+		fprintf(out, "%u,", values[i]);
+	}
+	fprintf(out, is_python ? "]\n" : "};\n");
+}
+
+void print_font(FILE *out, const Font *font, u8 first_char, bool is_python) {
+	const char *comment = is_python ? "#" : "//";
+	FPRINTLN(out, "%sFont: %u glyphs from character code %u, %u pages tall", comment, font->glyph_count, first_char, font->page_count);
+	if (is_python) {
+		fprintf(out, "FONT_FIRST_CHAR = %u\nFONT_GLYPH_COUNT = %u\nFONT_PAGES = %u\n", first_char, font->glyph_count, font->page_count);
+	}
+	else {
+		fprintf(out, "#define FONT_FIRST_CHAR %u\n#define FONT_GLYPH_COUNT %u\n#define FONT_PAGES %u\n", first_char, font->glyph_count, font->page_count);
+	}
+	print_u16_array(out, "font_widths", font->widths, font->glyph_count, is_python);
+	print_u16_array(out, "font_advances", font->advances, font->glyph_count, is_python);
+	if (is_python) fprintf(out, "font_first_columns = [");
+	else fprintf(out, "const %s font_first_columns[%u] = {", c_uint_type(font->column_count), font->glyph_count);
+	for (u32 i = 0; i < font->glyph_count; i++) {
+		fprintf(out, "%u,", font->first_columns[i]);
+	}
+	fprintf(out, is_python ? "]\n\n" : "};\n\n");
+
+	//one line per glyph
+	if (is_python) fprintf(out, "font_glyphs = [\n");
+	else fprintf(out, "const unsigned char font_glyphs[%u] = {\n", font->column_count*font->page_count);
+	for (u32 i = 0; i < font->glyph_count; i++) {
+		fprintf(out, "    ");
+		for (u32 b = 0; b < (u32)font->widths[i]*font->page_count; b++) {
+			fprintf(out, "0x%X,", font->glyphs[(usize)font->first_columns[i]*font->page_count + b]);
+		}
+		fprintf(out, "\n");
+	}
+	fprintf(out, is_python ? "]\n\n" : "};\n\n");
+
+	u32 shifted_page_count = font->page_count + 1;
+	if (is_python) fprintf(out, "font_shifted_glyphs = [\n");
+	else fprintf(out, "const unsigned char font_shifted_glyphs[7][%u] = {\n", font->column_count*shifted_page_count);
+	for (u32 shift = 1; shift < 8; shift++) {
+		fprintf(out, is_python ? "    [\n" : "    {\n");
+		const u8 *shifted = &font->shifted_glyphs[(usize)(shift - 1)*font->column_count*shifted_page_count];
+		for (u32 i = 0; i < font->glyph_count; i++) {
+			fprintf(out, "        ");
+			for (u32 b = 0; b < (u32)font->widths[i]*shifted_page_count; b++) {
+				fprintf(out, "0x%X,", shifted[(usize)font->first_columns[i]*shifted_page_count + b]);
+			}
+			fprintf(out, "\n");
+		}
+		fprintf(out, is_python ? "    ],\n" : "    },\n");
+	}
+	fprintf(out, is_python ? "]\n\n" : "};\n\n");
+	fprintf(out, "%s", is_python ? FONT_PYTHON_DRAW_TEXT : FONT_C_DRAW_TEXT);
+}
+
+//Matches "--name value" and "--name=value".  Returns NULL if argv[*i] is not this option, or "" if its value is missing.
+static const char *option_value(const char *name, int argc, char **argv, int *i) {
+	const char *arg = argv[*i];
+	usize name_len = strlen(name);
+	if (strncmp(arg, name, name_len) != 0) {
+		return NULL;
+	}
+	if (arg[name_len] == '=') {
+		return &arg[name_len + 1];
+	}
+	if (arg[name_len] != '\0') {
+		return NULL;
+	}
+	if (*i + 1 >= argc) {
+		return "";
+	}
+	*i += 1;
+	return argv[*i];
+}
+
+//i2c or spi, then optionally : and the clock in Hz, with a k or m suffix for kHz or MHz
+static bool parse_bus(const char *str, Bus *out) {
+	if (strncmp(str, "i2c", 3) == 0) {
+		out->type = BUS_I2C;
+		out->hz = 400000;
+	}
+	else if (strncmp(str, "spi", 3) == 0) {
+		out->type = BUS_SPI;
+		out->hz = 8000000;
+	}
+	else {
+		return false;
+	}
+	str += 3;
+	if (*str == '\0') {
+		return true;
+	}
+	char *end;
+	errno = 0;
+	unsigned long hz = (*str == ':' && str[1] >= '0' && str[1] <= '9') ? strtoul(str + 1, &end, 10) : 0;
+	unsigned long multiplier = (hz == 0) ? 0 : (*end == '\0') ? 1 : (strcmp(end, "k") == 0) ? 1000 : (strcmp(end, "m") == 0) ? 1000000 : 0;
+	if (errno != 0 || multiplier == 0 || hz > 0xFFFFFFFFul/multiplier) {
+		return false;
+	}
+	out->hz = (u32)(hz*multiplier);
+	return true;
+}
+
+static bool parse_u32(const char *str, u32 min, u32 max, u32 *out) {
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || errno != 0 || value < min || value > max) {
+		return false;
+	}
+	*out = (u32)value;
+	return true;
+}
+
+//WxH, each 1-max
+static bool parse_size(const char *str, u32 max, u32 *out_width, u32 *out_height) {
+	const char *x = strchr(str, 'x');
+	char width[16];
+	if (!x || x - str >= (isize)sizeof(width)) {
+		return false;
+	}
+	memcpy(width, str, x - str);
+	width[x - str] = '\0';
+	return parse_u32(width, 1, max, out_width) && parse_u32(x + 1, 1, max, out_height);
+}
+
+//argv must be UTF-8
+ProgramArgs parse_args(int argc, char **argv) {
+	ProgramArgs ret = {0};
+	ret.mode = CONVERSION_MODE_ALPHA;
+	ret.threshold = 127;
+	ret.controller = CONTROLLER_PROFILES[0];
+	i32 column_offset = -1;
+	for (int i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		const char *value;
+		u32 number;
+		if ((value = option_value("--threshold", argc, argv, &i))) {
+			if (!parse_u32(value, 0, 254, &number)) {
+				return ret;
+			}
+			ret.mode = CONVERSION_MODE_THRESHOLD;
+			ret.threshold = (u8)number;
+		}
+		else if ((value = option_value("--dither", argc, argv, &i))) {
+			if (strcmp(value, "bayer2") == 0) ret.dither_size = 2;
+			else if (strcmp(value, "bayer4") == 0) ret.dither_size = 4;
+			else if (strcmp(value, "bayer8") == 0) ret.dither_size = 8;
+			else if (strcmp(value, "floyd-steinberg") == 0) ret.diffusion_kernel = DIFFUSION_KERNEL_FLOYD_STEINBERG;
+			else if (strcmp(value, "atkinson") == 0) ret.diffusion_kernel = DIFFUSION_KERNEL_ATKINSON;
+			else if (strcmp(value, "sierra-lite") == 0) ret.diffusion_kernel = DIFFUSION_KERNEL_SIERRA_LITE;
+			else return ret;
+			ret.mode = (ret.dither_size > 0) ? CONVERSION_MODE_ORDERED_DITHER : CONVERSION_MODE_ERROR_DIFFUSION;
+		}
+		else if ((value = option_value("--threads", argc, argv, &i)) || (value = option_value("-j", argc, argv, &i))) {
+			if (!parse_u32(value, 1, MAX_THREADS, &ret.thread_count)) {
+				return ret;
+			}
+		}
+		else if ((value = option_value("--tiles", argc, argv, &i))) {
+			if (!parse_u32(value, 1, 128, &ret.tile_width)) {
+				return ret;
+			}
+		}
+		else if ((value = option_value("--shifts", argc, argv, &i))) {
+			//"all" or a comma separated list of row offsets
+			if (strcmp(value, "all") == 0) {
+				ret.shift_mask = 0xFF;
+			}
+			else {
+				for (const char *c = value; ; c++) {
+					if (*c < '0' || *c > '7' || (c[1] != ',' && c[1] != '\0')) {
+						return ret;
+					}
+					ret.shift_mask |= 1 << (*c - '0');
+					c++;
+					if (*c == '\0') break;
+				}
+			}
+		}
+		else if ((value = option_value("--font", argc, argv, &i))) {
+			if (!parse_u32(value, 0, 255, &number)) {
+				return ret;
+			}
+			ret.is_font = true;
+			ret.font_first_char = (u8)number;
+		}
+		else if ((value = option_value("--slice", argc, argv, &i))) {
+			if (*value == '\0' || ret.slice_name_count == MAX_SLICE_NAMES) {
+				return ret;
+			}
+			ret.slice_names[ret.slice_name_count++] = value;
+		}
+		else if ((value = option_value("--commands", argc, argv, &i))) {
+			if (strcmp(value, "full") == 0) ret.command_mode = COMMAND_MODE_FULL;
+			else if (strcmp(value, "delta") == 0) ret.command_mode = COMMAND_MODE_DELTA;
+			else return ret;
+		}
+		else if ((value = option_value("--optimize", argc, argv, &i))) {
+			if (strcmp(value, "size") == 0) ret.optimize = OPTIMIZE_SIZE;
+			else if (strcmp(value, "bustime") == 0) ret.optimize = OPTIMIZE_BUS_TIME;
+			else if (strcmp(value, "decode") == 0) ret.optimize = OPTIMIZE_DECODE;
+			else return ret;
+		}
+		else if ((value = option_value("--panels", argc, argv, &i))) {
+			if (!parse_size(value, MAX_PANELS, &ret.panel_columns, &ret.panel_rows) || 
+					ret.panel_columns*ret.panel_rows > MAX_PANELS) {
+				return ret;
+			}
+		}
+		else if ((value = option_value("--panel-size", argc, argv, &i))) {
+			if (!parse_size(value, 4096, &ret.panel_width, &ret.panel_height)) {
+				return ret;
+			}
+		}
+		else if ((value = option_value("--controller", argc, argv, &i))) {
+			u32 profile_count = sizeof(CONTROLLER_PROFILES)/sizeof(CONTROLLER_PROFILES[0]);
+			u32 profile = 0;
+			while (profile < profile_count && strcmp(value, CONTROLLER_PROFILES[profile].name) != 0) profile++;
+			if (profile == profile_count) {
+				return ret;
+			}
+			ret.controller = CONTROLLER_PROFILES[profile];
+		}
+		else if ((value = option_value("--column-offset", argc, argv, &i))) {
+			if (!parse_u32(value, 0, SSD1306_MAX_COLUMNS - SSD1306_COLUMNS, &number)) {
+				return ret;
+			}
+			column_offset = (i32)number;
+		}
+		else if ((value = option_value("--rotate", argc, argv, &i))) {
+			if (!parse_u32(value, 0, 270, &number) || number % 90 != 0) {
+				return ret;
+			}
+			ret.rotation = (u16)number;
+		}
+		else if ((value = option_value("--flip", argc, argv, &i))) {
+			if (strcmp(value, "h") == 0) ret.is_flipped_horizontally = true;
+			else if (strcmp(value, "v") == 0) ret.is_flipped_vertically = true;
+			else return ret;
+		}
+		else if ((value = option_value("--bus", argc, argv, &i))) {
+			if (strcmp(value, "all") == 0) {
+				//the usual SSD1306 module speeds
+				static const Bus ALL_BUSES[] = {{BUS_I2C, 100000}, {BUS_I2C, 400000}, {BUS_I2C, 1000000}, {BUS_SPI, 8000000}, {BUS_SPI, 10000000}};
+				memcpy(ret.buses, ALL_BUSES, sizeof(ALL_BUSES));
+				ret.bus_count = sizeof(ALL_BUSES)/sizeof(ALL_BUSES[0]);
+			}
+			else if (ret.bus_count == MAX_BUSES || !parse_bus(value, &ret.buses[ret.bus_count++])) {
+				return ret;
+			}
+		}
+		else if ((value = option_value("--serve", argc, argv, &i))) {
+			if (*value == '\0') {
+				return ret;
+			}
+			ret.serve_path = value;
+		}
+		else if (strcmp(arg, "--all-slices") == 0) {
+			ret.is_all_slices = true;
+		}
+		else if (strcmp(arg, "--scroll") == 0) {
+			ret.should_scroll = true;
+		}
+		else if (strcmp(arg, "--player") == 0) {
+			ret.should_output_player = true;
+		}
+		else if ((value = option_value("--layer", argc, argv, &i))) {
+			if (*value == '\0' || ret.layer_name_count == MAX_LAYER_FILTERS) {
+				return ret;
+			}
+			ret.layer_names[ret.layer_name_count++] = value;
+		}
+		else if ((value = option_value("--exclude-layer", argc, argv, &i))) {
+			if (*value == '\0' || ret.excluded_layer_name_count == MAX_LAYER_FILTERS) {
+				return ret;
+			}
+			ret.excluded_layer_names[ret.excluded_layer_name_count++] = value;
+		}
+		else if (*arg == '-' && arg[1] != '\0') {
+			for (char *flag = arg + 1; *flag; flag++) {
+				switch (*flag) {
+					case 'p':
+						ret.should_show_python = true;
+						break;
+					case 'v':
+						ret.should_show_frames = true;
+						break;
+					default:
+						return ret;
+				}
+			}
+		}
+		else {
+			if (ret.in_file_name) {
+				return ret;
+			}
+			ret.in_file_name = arg;
+		}
+	}
+
+	//--commands and --optimize are other output formats, like --tiles, --shifts and --font
+	u32 format_count = (ret.tile_width > 0) + (ret.shift_mask != 0) + ret.is_font + (ret.command_mode != COMMAND_MODE_NONE) + 
+		(ret.optimize != OPTIMIZE_NONE);
+	if ((ret.command_mode != COMMAND_MODE_NONE || ret.optimize != OPTIMIZE_NONE) && format_count > 1) {
+		return ret;
+	}
+	//a font is drawn into a framebuffer, not onto displays
+	if ((ret.panel_columns > 0 || ret.rotation != 0 || ret.is_flipped_horizontally || ret.is_flipped_vertically) && ret.is_font) {
+		return ret;
+	}
+	if (column_offset >= 0) {
+		ret.controller.column_offset = (u8)column_offset;
+	}
+	if (ret.controller.column_offset + ret.controller.width > ssd1306_controller_column_count(ret.controller.controller)) {
+		return ret;
+	}
+	//the player is C
+	if (ret.should_output_player && (ret.optimize == OPTIMIZE_NONE || ret.should_show_python)) {
+		return ret;
+	}
+	//the scroll commands' arguments are the SSD1306's, the others differ or don't have them
+	if (ret.should_scroll && (ret.command_mode == COMMAND_MODE_NONE || ret.controller.controller != SSD1306_CONTROLLER_SSD1306)) {
+		return ret;
+	}
+	if (ret.panel_width == 0) {
+		ret.panel_width = ret.controller.width;
+		ret.panel_height = ret.controller.height;
+	}
+	ret.is_valid = (ret.in_file_name != NULL) != (ret.serve_path != NULL);
+	return ret;
+}
+
+void print_usage(const char *program_name) {
+	PRINTERR("Aseprite-SSD1306 Utility " ASEPRITE_SSD1306_VERSION);
+	PRINTERR("Usage %s [-pv] [--threshold N | --dither bayer2|bayer4|bayer8|floyd-steinberg|atkinson|sierra-lite] [--threads N] [--tiles W | --shifts all|N,... | --font FIRST_CHAR | --commands full|delta [--scroll] | --optimize size|bustime|decode [--player]] [--bus all|i2c[:HZ]|spi[:HZ]]... [--controller ssd1306|ssd1306-128x32|ssd1309|ssd1305|ssd1305-128x32|sh1106 [--column-offset N]] [--rotate 90|180|270] [--flip h|v]... [--panels CxR [--panel-size WxH]] [--slice NAME]... [--all-slices] [--layer NAME]... [--exclude-layer NAME]... aseprite_file|-", program_name);
+	PRINTERR("      %s --serve socket_path [--threads N]", program_name);
+}
+
+static void print_image_comment(FILE *out, u16 width, u16 height, bool is_python) {
+	u16 byte_height = (height + 7)/8;
+	FPRINTLN(out, "%sImage width: %u pixels, or %u bytes, height: %u pixels, or %u bytes", is_python ? "#" : "//", width, width, height, byte_height);
+}
+
+//Bit reversed bytes, for turning pages upside down
+#define BIT_REVERSE_2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define BIT_REVERSE_4(n) BIT_REVERSE_2(n), BIT_REVERSE_2(n + 2*16), BIT_REVERSE_2(n + 1*16), BIT_REVERSE_2(n + 3*16)
+#define BIT_REVERSE_6(n) BIT_REVERSE_4(n), BIT_REVERSE_4(n + 2*4), BIT_REVERSE_4(n + 1*4), BIT_REVERSE_4(n + 3*4)
+static const u8 BIT_REVERSE[256] = {BIT_REVERSE_6(0), BIT_REVERSE_6(2), BIT_REVERSE_6(1), BIT_REVERSE_6(3)};
+#undef BIT_REVERSE_2
+#undef BIT_REVERSE_4
+#undef BIT_REVERSE_6
+
+//Pixel (x, y) of width x height pages goes to (y, x) of the height x width dst.  8 columns of a page are one 8x8 bit 
+//matrix, and come out as 8 columns of a page of dst.
+static void transpose_pages(u8 *dst, const u8 *pages, u32 width, u32 height) {
+	u32 page_count = (height + 7)/8, dst_page_count = (width + 7)/8;
+	for (u32 q = 0; q < dst_page_count; q++) {
+		for (u32 p = 0; p < page_count; p++) {
+			u64 block = 0;
+			for (u32 i = 0; i < 8 && 8*q + i < width; i++) {
+				block |= (u64)pages[p*width + 8*q + i] << 8*i;
+			}
+			block = transpose_8x8(block);
+			for (u32 r = 0; r < 8 && 8*p + r < height; r++) {
+				dst[q*height + 8*p + r] = (u8)(block >> 8*r);
+			}
+		}
+	}
+}
+
+//Mirrors width x height pages into dst.  Upside down, page p is the 8 rows ending height - 8*p rows from the top 
+//(which needn't be page aligned), bit reversed.
+static void flip_pages(u8 *dst, const u8 *pages, u32 width, u32 height, bool is_flipped_horizontally, bool is_flipped_vertically) {
+	u32 page_count = (height + 7)/8;
+	for (u32 p = 0; p < page_count; p++) {
+		u8 *dst_page = &dst[p*width];
+		if (!is_flipped_vertically) {
+			const u8 *page = &pages[p*width];
+			for (u32 x = 0; x < width; x++) {
+				dst_page[x] = page[is_flipped_horizontally ? width - 1 - x : x];
+			}
+			continue;
+		}
+		//negative for a partial last page, whose rows above the top are black
+		i32 y0 = (i32)height - 8 - 8*(i32)p;
+		for (u32 x = 0; x < width; x++) {
+			u32 src_x = is_flipped_horizontally ? width - 1 - x : x;
+			u8 rows = (y0 >= 0) ? packed_column_bits(pages, (u16)width, page_count, src_x, (u32)y0) : (u8)(pages[src_x] << -y0);
+			dst_page[x] = BIT_REVERSE[rows];
+		}
+	}
+}
+
+static inline bool is_transposed(const ProgramArgs *pa) {
+	return pa->rotation == 90 || pa->rotation == 270;
+}
+
+//Size of width x height pages after --rotate.  Swapping is its own inverse, so this is also the size of the part of the 
+//image a rotated --panel-size display covers.
+static void oriented_size(const ProgramArgs *pa, u32 *width, u32 *height) {
+	if (is_transposed(pa)) {
+		u32 swap = *width;
+		*width = *height;
+		*height = swap;
+	}
+}
+
+//--rotate and --flip: block_count blocks of width x height pages become blocks of their oriented_size().  Rotating is 
+//a transpose for 90 and 270, and flips: 90 is a transpose then a horizontal flip, 180 both flips, 270 a transpose then 
+//a vertical flip.  Flips after a transpose are done as the other flip before it.  Returns NULL if the oriented blocks 
+//don't fit in the arena.
+static u8 *orient_packed_frames(u8 *packed_frames, u32 width, u32 height, u32 block_count, const ProgramArgs *pa, 
+		ByteStackAllocator *allocator) {
+	bool is_flipped_horizontally = (pa->rotation == 90 || pa->rotation == 180) != pa->is_flipped_horizontally;
+	bool is_flipped_vertically = (pa->rotation == 180 || pa->rotation == 270) != pa->is_flipped_vertically;
+	if (!is_transposed(pa) && !is_flipped_horizontally && !is_flipped_vertically) {
+		return packed_frames;
+	}
+	usize block_size = (usize)((height + 7)/8)*width, oriented_block_size = block_size;
+	if (is_transposed(pa)) {
+		oriented_block_size = (usize)((width + 7)/8)*height;
+		bool swap = is_flipped_horizontally;
+		is_flipped_horizontally = is_flipped_vertically;
+		is_flipped_vertically = swap;
+	}
+	u8 *ret = push_array(block_count, oriented_block_size, allocator);
+	ByteStackAllocator scratch_allocator = *allocator;
+	u8 *flipped = push_array(1, block_size, &scratch_allocator);
+	if (!ret || !flipped) {
+		return NULL;
+	}
+	for (u32 b = 0; b < block_count; b++) {
+		const u8 *block = &packed_frames[b*block_size];
+		u8 *oriented_block = &ret[b*oriented_block_size];
+		if (!is_transposed(pa)) {
+			flip_pages(oriented_block, block, width, height, is_flipped_horizontally, is_flipped_vertically);
+			continue;
+		}
+		if (is_flipped_horizontally || is_flipped_vertically) {
+			flip_pages(flipped, block, width, height, is_flipped_horizontally, is_flipped_vertically);
+			block = flipped;
+		}
+		transpose_pages(oriented_block, block, width, height);
+	}
+	return ret;
+}
+
+//Dithers and quantizes frame_count frames of levels into SSD1306 pages.  With --panels the pages are split over the 
+//panels: panel_count blocks of frame_count frames of panel pages.  Frames, or panels, are then rotated and flipped.  
+//Returns NULL if the pages don't fit in the arena.
+static u8 *pack_levels(u8 *frame_levels, u16 width, u16 height, u16 frame_count, const ProgramArgs *pa, 
+		ByteStackAllocator *allocator) {
+	usize frame_size = (usize)width*height;
+	u32 thread_count = (pa->thread_count > 0) ? pa->thread_count : platform_processor_count();
+	//threads aren't worth spawning for a handful of small pages
+	if (frame_size*frame_count < KB(256)) {
+		thread_count = 1;
+	}
+	if (pa->mode == CONVERSION_MODE_ERROR_DIFFUSION) {
+		//levels become 0 or 255, which the quantizer below just packs
+		if (!diffuse_frames(frame_levels, width, height, frame_count, pa->diffusion_kernel, thread_count, allocator)) {
+			return NULL;
+		}
+	}
+
+	//Quantize every page of every frame into SSD1306 bytes
+	QuantizeWork quantize_work = {0};
+	quantize_work.frame_levels = frame_levels;
+	quantize_work.width = width;
+	quantize_work.height = height;
+	quantize_work.page_count = (height + 7)/8;
+	quantize_work.frame_count = frame_count;
+	quantize_work.thresholds = make_threshold_matrix(pa);
+	u8 *black_row = push_array(1, width, allocator);
+	if (!black_row) {
+		return NULL;
+	}
+	memset(black_row, 0, width);
+	quantize_work.black_row = black_row;
+	if (pa->panel_columns > 0) {
+		//panels are cut from the image before they're rotated
+		u32 panel_width = pa->panel_width, panel_height = pa->panel_height;
+		oriented_size(pa, &panel_width, &panel_height);
+		quantize_work.panel_columns = pa->panel_columns;
+		quantize_work.panel_rows = pa->panel_rows;
+		quantize_work.panel_width = panel_width;
+		quantize_work.panel_height = panel_height;
+		quantize_work.panel_page_count = (panel_height + 7)/8;
+		u32 panel_count = pa->panel_columns*pa->panel_rows;
+		for (u32 panel = 0; panel < panel_count; panel++) {
+			quantize_work.panel_thresholds[panel] = offset_threshold_matrix(&quantize_work.thresholds, 
+					(panel % pa->panel_columns)*panel_width, (panel / pa->panel_columns)*panel_height);
+		}
+		usize panel_pages_size = (usize)quantize_work.panel_page_count*panel_width;
+		quantize_work.packed_frames = push_array((u64)frame_count*panel_count, panel_pages_size, allocator);
+		if (!quantize_work.packed_frames) {
+			return NULL;
+		}
+		u32 work_count = quantize_work.panel_page_count*panel_count*frame_count;
+		platform_parallel_for(quantize_panel_page_work, &quantize_work, work_count, thread_count);
+		return orient_packed_frames(quantize_work.packed_frames, panel_width, panel_height, panel_count*frame_count, pa, allocator);
+	}
+	usize frame_pages_size = (usize)quantize_work.page_count*width;
+	quantize_work.packed_frames = push_array(frame_count, frame_pages_size, allocator);
+	if (!quantize_work.packed_frames) {
+		return NULL;
+	}
+	u32 work_count = (u32)quantize_work.page_count*frame_count;
+	platform_parallel_for(quantize_page_work, &quantize_work, work_count, thread_count);
+	return orient_packed_frames(quantize_work.packed_frames, width, height, frame_count, pa, allocator);
+}
+
+//Bytes on the wire and clock cycles it takes to send a command stream.  On I2C every packet is a transfer of its own: 
+//a start condition, the address byte, the control byte and the payload, each byte followed by an ack, and a stop 
+//condition.  On SPI the control byte is the level of the D/C pin, so only the payload is clocked out.
+static u64 stream_wire_bytes(const u8 *stream, u32 len, BusType type, u64 *out_bits) {
+	u64 bytes = 0, packet_count = 0;
+	for (u32 i = 0; i + 1 < len; i += 2 + stream[i + 1]) {
+		bytes += stream[i + 1];
+		packet_count++;
+	}
+	if (type == BUS_I2C) {
+		bytes += 2*packet_count;
+		*out_bits = 9*bytes + 2*packet_count;
+	}
+	else {
+		*out_bits = 8*bytes;
+	}
+	return bytes;
+}
+
+static void format_bus(char *dst, usize dst_size, Bus bus) {
+	const char *type = (bus.type == BUS_I2C) ? "i2c" : "spi";
+	if (bus.hz % 1000000 == 0) snprintf(dst, dst_size, "%s %uMHz", type, bus.hz/1000000);
+	else if (bus.hz % 1000 == 0) snprintf(dst, dst_size, "%s %ukHz", type, bus.hz/1000);
+	else snprintf(dst, dst_size, "%s %uHz", type, bus.hz);
+}
+
+//--bus: a table of what sending each frame takes on each bus, marking frames that take longer than they're shown, 
+//then each bus' frame rate with every frame sent back to back
+static void print_bus_report(FILE *out, const CommandStreams *streams, const u16 *frame_durations, const ProgramArgs *pa) {
+	const char *comment = pa->should_show_python ? "#" : "//";
+	FPRINTLN(out, "%sBus time per frame, bytes on the wire and milliseconds to send them (* = longer than the frame is shown):", comment);
+	fprintf(out, "%s frame   duration", comment);
+	for (u32 b = 0; b < pa->bus_count; b++) {
+		char bus_name[32];
+		format_bus(bus_name, sizeof(bus_name), pa->buses[b]);
+		fprintf(out, "  %-21s", bus_name);
+	}
+	fprintf(out, "\n");
+	u64 total_bits[MAX_BUSES] = {0}, total_bytes[MAX_BUSES] = {0};
+	u32 late_frames[MAX_BUSES] = {0};
+	u64 total_duration_ms = 0;
+	for (u32 f = 0; f < streams->frame_count; f++) {
+		total_duration_ms += frame_durations[f];
+		fprintf(out, "%s%6u %7u ms", comment, f, frame_durations[f]);
+		for (u32 b = 0; b < pa->bus_count; b++) {
+			u64 bits;
+			u64 bytes = stream_wire_bytes(&streams->bytes[streams->offsets[f]], streams->offsets[f + 1] - streams->offsets[f], 
+					pa->buses[b].type, &bits);
+			double ms = (double)bits*1000.0/pa->buses[b].hz;
+			bool is_late = ms > frame_durations[f];
+			late_frames[b] += is_late;
+			total_bits[b] += bits;
+			total_bytes[b] += bytes;
+			fprintf(out, "  %7llu B %7.2f ms%c", (unsigned long long)bytes, ms, is_late ? '*' : ' ');
+		}
+		fprintf(out, "\n");
+	}
+	double requested_fps = (total_duration_ms > 0) ? streams->frame_count*1000.0/total_duration_ms : 0;
+	for (u32 b = 0; b < pa->bus_count; b++) {
+		char bus_name[32];
+		format_bus(bus_name, sizeof(bus_name), pa->buses[b]);
+		double total_ms = (double)total_bits[b]*1000.0/pa->buses[b].hz;
+		FPRINTLN(out, "%s%s: %llu bytes in %.2f ms, %.1f fps at most (the durations ask for %.1f), %u late frames", comment, 
+				bus_name, (unsigned long long)total_bytes[b], total_ms, (total_ms > 0) ? streams->frame_count*1000.0/total_ms : 0, 
+				requested_fps, late_frames[b]);
+	}
+}
+
+//--optimize: every frame is stored in one of these formats, behind a byte saying which.  All of them decode into a 
+//page ordered framebuffer; delta frames expect it to still hold the previous frame.
+typedef enum FrameFormat {
+	FRAME_FORMAT_RAW, //the pages
+	FRAME_FORMAT_RLE, //the pages, run length encoded: a byte n < 128 is followed by n + 1 bytes, n >= 128 by a byte repeated n - 126 times
+	FRAME_FORMAT_DELTA, //a window count, then each window's x0, x1, p0, p1 and its pages: columns x0-x1 of pages p0-p1
+	FRAME_FORMAT_TILES, //an index into the tile atlas for every OPTIMIZE_TILE_WIDTH columns of every page, two bytes 
+	                    //(little endian) each if there are more than 256 tiles
+	FRAME_FORMAT_COUNT,
+} FrameFormat;
+
+#define OPTIMIZE_TILE_WIDTH 8
+#define RLE_MAX_RUN 129
+#define RLE_MAX_LITERALS 128
+
+//Rough cycle counts of a plain C decoder on a small MCU, only good for ranking the formats against each other
+#define DECODE_CYCLES_PER_BYTE 2 //copying a byte into the framebuffer
+#define DECODE_CYCLES_PER_RUN 8 //reading an RLE header, or setting up a run
+#define DECODE_CYCLES_PER_WINDOW 16 //reading a delta window's bounds
+#define DECODE_CYCLES_PER_TILE 6 //looking up a tile
+
+typedef struct FrameCost {
+	u32 len; //bytes of flash, format byte included
+	u64 bus_bits; //clock cycles to send what the frame changes to the display
+	u64 decode_cycles;
+} FrameCost;
+
+//Encodes run after run, a literal run ends where at least 3 equal bytes start.  dst may be NULL to only measure.
+static u32 rle_encode(u8 *dst, const u8 *src, u32 len, u64 *decode_cycles) {
+	u32 out = 0, i = 0;
+	while (i < len) {
+		u32 run = 1;
+		while (i + run < len && run < RLE_MAX_RUN && src[i + run] == src[i]) run++;
+		if (run >= 3) {
+			if (dst) {
+				dst[out] = (u8)(0x80 + run - 2);
+				dst[out + 1] = src[i];
+			}
+			out += 2;
+			i += run;
+			*decode_cycles += DECODE_CYCLES_PER_RUN + run*DECODE_CYCLES_PER_BYTE;
+			continue;
+		}
+		u32 literal_count = 0;
+		while (i + literal_count < len && literal_count < RLE_MAX_LITERALS) {
+			u32 j = i + literal_count;
+			if (j + 2 < len && src[j] == src[j + 1] && src[j] == src[j + 2]) break;
+			literal_count++;
+		}
+		if (dst) {
+			dst[out] = (u8)(literal_count - 1);
+			memcpy(&dst[out + 1], &src[i], literal_count);
+		}
+		out += 1 + literal_count;
+		i += literal_count;
+		*decode_cycles += DECODE_CYCLES_PER_RUN + literal_count*DECODE_CYCLES_PER_BYTE;
+	}
+	return out;
+}
+
+//Encodes frame f in format into dst (which may be NULL to only measure it), format byte first.  Returns false if the 
+//format can't hold the frame: only frames after the first can be deltas.  Delta windows are the ones the controller 
+//gets sent.
+static bool encode_frame(FrameFormat format, const ControllerProfile *controller, const u8 *packed_frames, u32 f, u16 width, 
+		u32 page_count, const TileAtlas *atlas, u8 *dst, FrameCost *cost) {
+	usize frame_pages_size = (usize)page_count*width;
+	const u8 *packed_frame = &packed_frames[f*frame_pages_size];
+	if (dst) {
+		dst[0] = (u8)format;
+		dst++;
+	}
+	cost->len = 1;
+	cost->decode_cycles = DECODE_CYCLES_PER_RUN;
+	switch (format) {
+	case FRAME_FORMAT_RAW:
+		if (dst) memcpy(dst, packed_frame, frame_pages_size);
+		cost->len += (u32)frame_pages_size;
+		cost->decode_cycles += frame_pages_size*DECODE_CYCLES_PER_BYTE;
+		break;
+	case FRAME_FORMAT_RLE:
+		cost->len += rle_encode(dst, packed_frame, (u32)frame_pages_size, &cost->decode_cycles);
+		break;
+	case FRAME_FORMAT_DELTA: {
+		if (f == 0) {
+			return false;
+		}
+		u32 windows[MAX_DELTA_WINDOWS][4];
+		u32 window_count;
+		plan_delta_windows(controller, packed_frame, packed_frame - frame_pages_size, width, page_count, windows, &window_count);
+		u8 *cursor = dst;
+		if (cursor) *cursor++ = (u8)window_count;
+		cost->len += 1;
+		for (u32 i = 0; i < window_count; i++) {
+			u32 *window = windows[i];
+			u32 window_width = window[1] - window[0] + 1;
+			if (cursor) {
+				for (u32 b = 0; b < 4; b++) *cursor++ = (u8)window[b];
+				for (u32 p = window[2]; p <= window[3]; p++) {
+					memcpy(cursor, &packed_frame[p*width + window[0]], window_width);
+					cursor += window_width;
+				}
+			}
+			cost->len += 4 + window_width*(window[3] - window[2] + 1);
+			cost->decode_cycles += DECODE_CYCLES_PER_WINDOW + window_width*(window[3] - window[2] + 1)*DECODE_CYCLES_PER_BYTE;
+		}
+	} break;
+	case FRAME_FORMAT_TILES: {
+		if (atlas->tile_count > 0x10000) {
+			return false;
+		}
+		u32 index_size = (atlas->tile_count > 256) ? 2 : 1;
+		u32 index_count = page_count*atlas->tiles_per_row;
+		const u32 *map = &atlas->map[(usize)f*index_count];
+		for (u32 i = 0; dst && i < index_count; i++) {
+			dst[i*index_size] = (u8)map[i];
+			if (index_size == 2) dst[i*index_size + 1] = (u8)(map[i] >> 8);
+		}
+		cost->len += index_count*index_size;
+		cost->decode_cycles += index_count*DECODE_CYCLES_PER_TILE + frame_pages_size*DECODE_CYCLES_PER_BYTE;
+	} break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+//Decodes a frame encoded by encode_frame into framebuffer, which holds the previous frame.  Returns false if it's malformed.
+static bool decode_frame(const u8 *encoded, u32 len, u8 *framebuffer, u16 width, u32 page_count, const TileAtlas *atlas) {
+	usize frame_pages_size = (usize)page_count*width;
+	const u8 *end = encoded + len;
+	if (len == 0) {
+		return false;
+	}
+	u8 format = *encoded++;
+	switch (format) {
+	case FRAME_FORMAT_RAW:
+		if ((usize)(end - encoded) != frame_pages_size) return false;
+		memcpy(framebuffer, encoded, frame_pages_size);
+		return true;
+	case FRAME_FORMAT_RLE: {
+		usize out = 0;
+		while (encoded < end) {
+			u8 header = *encoded++;
+			u32 count = (header < 0x80) ? header + 1u : header - 126u;
+			if (out + count > frame_pages_size || (header < 0x80 ? (usize)(end - encoded) < count : encoded == end)) return false;
+			if (header < 0x80) {
+				memcpy(&framebuffer[out], encoded, count);
+				encoded += count;
+			}
+			else {
+				memset(&framebuffer[out], *encoded++, count);
+			}
+			out += count;
+		}
+		return out == frame_pages_size;
+	}
+	case FRAME_FORMAT_DELTA: {
+		if (encoded == end) return false;
+		u32 window_count = *encoded++;
+		for (u32 i = 0; i < window_count; i++) {
+			if (end - encoded < 4) return false;
+			u32 x0 = encoded[0], x1 = encoded[1], p0 = encoded[2], p1 = encoded[3];
+			encoded += 4;
+			if (x0 > x1 || x1 >= width || p0 > p1 || p1 >= page_count || 
+					(usize)(end - encoded) < (usize)(x1 - x0 + 1)*(p1 - p0 + 1)) return false;
+			for (u32 p = p0; p <= p1; p++) {
+				memcpy(&framebuffer[p*width + x0], encoded, x1 - x0 + 1);
+				encoded += x1 - x0 + 1;
+			}
+		}
+		return encoded == end;
+	}
+	case FRAME_FORMAT_TILES: {
+		u32 index_size = (atlas->tile_count > 256) ? 2 : 1;
+		if ((usize)(end - encoded) != (usize)page_count*atlas->tiles_per_row*index_size) return false;
+		for (u32 p = 0; p < page_count; p++) {
+			for (u32 t = 0; t < atlas->tiles_per_row; t++) {
+				u32 tile = encoded[0] | ((index_size == 2) ? encoded[1] << 8 : 0);
+				encoded += index_size;
+				u32 x = t*atlas->tile_width;
+				if (tile >= atlas->tile_count) return false;
+				memcpy(&framebuffer[p*width + x], &atlas->tiles[(usize)tile*atlas->tile_width], 
+						(x + atlas->tile_width <= width) ? atlas->tile_width : width - x);
+			}
+		}
+		return true;
+	}
+	}
+	return false;
+}
+
+typedef struct OptimizeWork {
+	const ControllerProfile *controller;
+	const u8 *packed_frames;
+	u16 width;
+	u32 page_count;
+	const TileAtlas *atlas;
+	u32 first_frame;
+	FrameCost *costs; //FRAME_FORMAT_COUNT per frame, len = 0 if the format can't hold the frame
+	u64 *delta_bus_bits; //per frame
+} OptimizeWork;
+
+//Measures one format of one frame of the batch
+static void measure_frame_work(void *data, u32 work_index) {
+	OptimizeWork *work = data;
+	u32 f = work->first_frame + work_index/FRAME_FORMAT_COUNT;
+	FrameFormat format = (FrameFormat)(work_index % FRAME_FORMAT_COUNT);
+	FrameCost *cost = &work->costs[(usize)f*FRAME_FORMAT_COUNT + format];
+	if (!encode_frame(format, work->controller, work->packed_frames, f, work->width, work->page_count, work->atlas, NULL, cost)) {
+		cost->len = 0;
+	}
+}
+
+//What a delta frame sends: windows around what changed, without falling back to the whole image
+static void write_delta_windows(CommandWriter *writer, const ControllerProfile *controller, const u8 *packed_frame, 
+		const u8 *previous_frame, u16 width, u32 page_count) {
+	u32 windows[MAX_DELTA_WINDOWS][4];
+	u32 window_count;
+	plan_delta_windows(controller, packed_frame, previous_frame, width, page_count, windows, &window_count);
+	for (u32 i = 0; i < window_count; i++) {
+		write_window(writer, controller, packed_frame, width, windows[i][0], windows[i][1], windows[i][2], windows[i][3]);
+	}
+}
+
+static u64 delta_bus_bits(const ControllerProfile *controller, const u8 *packed_frame, const u8 *previous_frame, u16 width, 
+		u32 page_count, Bus bus, u8 *scratch) {
+	CommandWriter writer = {scratch, NULL};
+	write_delta_windows(&writer, controller, packed_frame, previous_frame, width, page_count);
+	u64 bits;
+	stream_wire_bytes(scratch, (u32)(writer.cursor - scratch), bus.type, &bits);
+	return bits;
+}
+
+static u64 frame_score(const FrameCost *cost, OptimizeGoal goal) {
+	switch (goal) {
+	case OPTIMIZE_BUS_TIME: return cost->bus_bits;
+	case OPTIMIZE_DECODE: return cost->decode_cycles;
+	default: return cost->len;
+	}
+}
+
+//Picks each frame's format, with or without tiles.  Ties go to the smaller format.  Returns the total score.
+static u64 choose_frame_formats(const FrameCost *costs, u32 frame_count, OptimizeGoal goal, bool can_use_tiles, u8 *formats) {
+	u64 total = 0;
+	for (u32 f = 0; f < frame_count; f++) {
+		const FrameCost *frame_costs = &costs[(usize)f*FRAME_FORMAT_COUNT];
+		u32 best = FRAME_FORMAT_RAW;
+		for (u32 format = 0; format < FRAME_FORMAT_COUNT; format++) {
+			if (frame_costs[format].len == 0 || (format == FRAME_FORMAT_TILES && !can_use_tiles)) {
+				continue;
+			}
+			u64 score = frame_score(&frame_costs[format], goal), best_score = frame_score(&frame_costs[best], goal);
+			if (score < best_score || (score == best_score && frame_costs[format].len < frame_costs[best].len)) {
+				best = format;
+			}
+		}
+		formats[f] = (u8)best;
+		total += frame_score(&frame_costs[best], goal);
+	}
+	return total;
+}
+
+typedef struct OptimizedFrames {
+	u8 *bytes;
+	u32 *offsets; //frame_count + 1
+	u8 *formats; //per frame
+	u32 format_counts[FRAME_FORMAT_COUNT];
+	TileAtlas atlas; //tile_count = 0 if no frame uses it
+} OptimizedFrames;
+
+#define OPTIMIZE_BATCH_FRAMES 64
+
+//Measures every frame in every format, in parallel, and encodes each one in the best one for the goal.  The tile atlas 
+//is only kept if it pays for itself.  Returns CONVERSION_ERROR_TOO_BIG if the frames don't fit in the arena, or 
+//CONVERSION_ERROR_VERIFY_FAILED if the output doesn't decode back to the frames.
+static ConversionErrorCode optimize_frames(const u8 *packed_frames, u16 width, u32 page_count, u16 frame_count, 
+		const ProgramArgs *pa, OptimizedFrames *out, ByteStackAllocator *allocator) {
+	usize frame_pages_size = (usize)page_count*width;
+	OptimizedFrames ret = {0};
+	if (!build_tile_atlas(packed_frames, width, page_count, frame_count, OPTIMIZE_TILE_WIDTH, &ret.atlas, allocator)) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+	ret.formats = push_array(frame_count, 1, allocator);
+	ret.offsets = push_array((u64)frame_count + 1, sizeof(u32), allocator);
+	//the costs are scratch, popped before the frames are encoded
+	ByteStackAllocator scratch_allocator = *allocator;
+	FrameCost *costs = push_array((u64)frame_count*FRAME_FORMAT_COUNT, sizeof(FrameCost), &scratch_allocator);
+	u8 *stream_scratch = push_array(1, frame_commands_capacity(&pa->controller, width, page_count), &scratch_allocator);
+	u8 *formats_without_tiles = push_array(frame_count, 1, &scratch_allocator);
+	if (!ret.formats || !ret.offsets || !costs || !stream_scratch || !formats_without_tiles) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+
+	OptimizeWork work = {&pa->controller, packed_frames, width, page_count, &ret.atlas};
+	work.costs = costs;
+	u32 thread_count = (pa->thread_count > 0) ? pa->thread_count : platform_processor_count();
+	for (u32 first_frame = 0; first_frame < frame_count; first_frame += OPTIMIZE_BATCH_FRAMES) {
+		u32 batch_frames = (frame_count - first_frame < OPTIMIZE_BATCH_FRAMES) ? frame_count - first_frame : OPTIMIZE_BATCH_FRAMES;
+		work.first_frame = first_frame;
+		platform_parallel_for(measure_frame_work, &work, batch_frames*FRAME_FORMAT_COUNT, thread_count);
+	}
+
+	//every format but delta sends the whole image
+	Bus bus = (pa->bus_count > 0) ? pa->buses[0] : (Bus){BUS_I2C, 400000};
+	CommandWriter writer = {stream_scratch, NULL};
+	write_window(&writer, &pa->controller, packed_frames, width, 0, width - 1, 0, page_count - 1);
+	u64 full_bus_bits;
+	stream_wire_bytes(stream_scratch, (u32)(writer.cursor - stream_scratch), bus.type, &full_bus_bits);
+	for (u32 f = 0; f < frame_count; f++) {
+		for (u32 format = 0; format < FRAME_FORMAT_COUNT; format++) {
+			costs[(usize)f*FRAME_FORMAT_COUNT + format].bus_bits = full_bus_bits;
+		}
+		if (f > 0) {
+			costs[(usize)f*FRAME_FORMAT_COUNT + FRAME_FORMAT_DELTA].bus_bits = delta_bus_bits(&pa->controller, 
+					&packed_frames[f*frame_pages_size], &packed_frames[(f - 1)*frame_pages_size], width, page_count, bus, stream_scratch);
+		}
+	}
+
+	u64 score = choose_frame_formats(costs, frame_count, pa->optimize, true, ret.formats);
+	u64 score_without_tiles = choose_frame_formats(costs, frame_count, pa->optimize, false, formats_without_tiles);
+	u32 tile_frame_count = 0;
+	for (u32 f = 0; f < frame_count; f++) {
+		tile_frame_count += (ret.formats[f] == FRAME_FORMAT_TILES);
+	}
+	if (pa->optimize == OPTIMIZE_SIZE) {
+		score += (u64)ret.atlas.tile_count*ret.atlas.tile_width;
+	}
+	if (tile_frame_count == 0 || score_without_tiles <= score) {
+		memcpy(ret.formats, formats_without_tiles, frame_count);
+		ret.atlas.tile_count = 0;
+	}
+
+	u32 offset = 0;
+	for (u32 f = 0; f < frame_count; f++) {
+		ret.offsets[f] = offset;
+		offset += costs[(usize)f*FRAME_FORMAT_COUNT + ret.formats[f]].len;
+		ret.format_counts[ret.formats[f]]++;
+	}
+	ret.offsets[frame_count] = offset;
+
+	//the winners are encoded again, for real this time, and decoded to check them
+	ret.bytes = push_array(offset, 1, allocator);
+	scratch_allocator = *allocator;
+	u8 *framebuffer = push_array(1, frame_pages_size, &scratch_allocator);
+	if (!ret.bytes || !framebuffer) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+	for (u32 f = 0; f < frame_count; f++) {
+		FrameCost cost;
+		u8 *encoded = &ret.bytes[ret.offsets[f]];
+		if (!encode_frame((FrameFormat)ret.formats[f], &pa->controller, packed_frames, f, width, page_count, &ret.atlas, encoded, &cost) || 
+				cost.len != ret.offsets[f + 1] - ret.offsets[f] || 
+				!decode_frame(encoded, cost.len, framebuffer, width, page_count, &ret.atlas) || 
+				memcmp(framebuffer, &packed_frames[f*frame_pages_size], frame_pages_size) != 0) {
+			return CONVERSION_ERROR_VERIFY_FAILED;
+		}
+	}
+	*out = ret;
+	return CONVERSION_OK;
+}
+
+//--player: a display that runs what the player sends, straight away
+typedef struct PlayerCheck {
+	SSD1306Emulator display;
+	SSD1306Player player;
+} PlayerCheck;
+
+static void player_check_transfer(void *context, u8 control, const u8 *bytes, u16 len) {
+	PlayerCheck *check = context;
+	if (control == SSD1306_PLAYER_COMMANDS) ssd1306_emulator_commands(&check->display, bytes, len);
+	else ssd1306_emulator_data(&check->display, bytes, len);
+	check->display.packet_count++;
+	ssd1306_player_transfer_done(&check->player);
+}
+
+//Plays optimized frames with ssd1306_player.c on an emulated display that starts out showing garbage, ticking when 
+//each frame is due, and checks the display shows every frame on time, and the first one again after looping.  Returns 
+//CONVERSION_ERROR_TOO_BIG if the player's buffers don't fit in the arena, or CONVERSION_ERROR_VERIFY_FAILED if it 
+//doesn't show the frames.
+static ConversionErrorCode verify_player(const ControllerProfile *controller, const SSD1306PlayerAnimation *animation, 
+		const u8 *packed_frames, ByteStackAllocator allocator) {
+	assert(SSD1306_PLAYER_FORMAT_TILES == FRAME_FORMAT_TILES && SSD1306_PLAYER_TILE_WIDTH == OPTIMIZE_TILE_WIDTH);
+	u16 width = animation->width;
+	u32 page_count = animation->page_count;
+	usize frame_pages_size = (usize)page_count*width;
+	PlayerCheck *check = push_array(1, sizeof(PlayerCheck), &allocator);
+	u8 *buffers = push_array(1, SSD1306_PLAYER_BUFFERS_SIZE(width, page_count), &allocator);
+	if (!check || !buffers) {
+		return CONVERSION_ERROR_TOO_BIG;
+	}
+	if (animation->frame_count == 0) {
+		//nothing to play
+		return CONVERSION_OK;
+	}
+	ssd1306_emulator_init(&check->display, controller->controller);
+	memset(check->display.gram, 0xA5, sizeof(check->display.gram));
+	SSD1306PlayerPlatform platform = {player_check_transfer, NULL, check};
+	ssd1306_player_init(&check->player, animation, &platform, buffers);
+	u32 now_ms = 0;
+	for (u32 f = 0; f <= animation->frame_count; f++) {
+		u32 shown_frame = f % animation->frame_count;
+		ssd1306_player_tick(&check->player, now_ms);
+		if (!ssd1306_player_is_idle(&check->player) || check->player.shown_frame != shown_frame) {
+			return CONVERSION_ERROR_VERIFY_FAILED;
+		}
+		for (u32 p = 0; p < page_count; p++) {
+			if (memcmp(&check->display.gram[p][controller->column_offset], 
+						&packed_frames[shown_frame*frame_pages_size + p*width], width) != 0) {
+				return CONVERSION_ERROR_VERIFY_FAILED;
+			}
+		}
+		now_ms += animation->frame_durations[shown_frame];
+	}
+	if (check->player.late_frame_count != 0 || check->display.unknown_command_count != 0) {
+		return CONVERSION_ERROR_VERIFY_FAILED;
+	}
+	return CONVERSION_OK;
+}
+
+//What the display gets sent when playing optimized frames, for the --bus report.  Returns false if the streams don't 
+//fit in the arena.
+static bool optimized_command_streams(const ControllerProfile *controller, const OptimizedFrames *frames, 
+		const u8 *packed_frames, u16 width, u32 page_count, u16 frame_count, CommandStreams *out, ByteStackAllocator *allocator) {
+	usize frame_pages_size = (usize)page_count*width;
+	CommandStreams ret = {0};
+	ret.frame_count = frame_count;
+	ret.offsets = push_array((u64)frame_count + 1, sizeof(u32), allocator);
+	ret.bytes = push_array(frame_count, frame_commands_capacity(controller, width, page_count), allocator);
+	if (!ret.offsets || !ret.bytes) {
+		return false;
+	}
+	CommandWriter writer = {ret.bytes, NULL};
+	for (u32 f = 0; f < frame_count; f++) {
+		const u8 *packed_frame = &packed_frames[f*frame_pages_size];
+		ret.offsets[f] = (u32)(writer.cursor - ret.bytes);
+		if (frames->formats[f] == FRAME_FORMAT_DELTA) {
+			write_delta_windows(&writer, controller, packed_frame, packed_frame - frame_pages_size, width, page_count);
+		}
+		else {
+			write_window(&writer, controller, packed_frame, width, 0, width - 1, 0, page_count - 1);
+		}
+	}
+	ret.offsets[frame_count] = (u32)(writer.cursor - ret.bytes);
+	*out = ret;
+	return true;
+}
+
+static ConversionError output_too_big(const AsepriteStream *stream, const char *name, u16 width, u16 height, u16 frame_count) {
+	return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, -1, -1, "The output of %s doesn't fit in memory! (%ux%u, %u frames)", 
+			name, width, height, frame_count);
+}
+
+//Prints packed frames as a preview (-v), a tile atlas (--tiles), command streams (--commands), frames in their best 
+//formats (--optimize) or a C/Python array called name, and the --bus report.  Returns an error if what's printed 
+//doesn't fit in the arena, or the command streams or optimized frames don't reproduce the frames.
+static ConversionError print_animation(FILE *out, const AsepriteStream *stream, const char *name, const u8 *packed_frames, 
+		u16 width, u16 height, u16 frame_count, const u16 *frame_durations, const ProgramArgs *pa, ByteStackAllocator *allocator) {
+	ConversionError ret = {0};
+	u32 page_count = (height + 7)/8;
+	usize frame_pages_size = (usize)page_count*width;
+	CommandStreams streams = {0};
+	if (!pa->should_show_frames) {
+		print_image_comment(out, width, height, pa->should_show_python);
+	}
+
+	if (pa->should_show_frames) {
+		for (int f = 0; f < frame_count; f++) {
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					fprintf(out, "%d", (packed_frames[f*frame_pages_size + (y/8)*width + x] >> (y%8)) & 1);
+				}
+				fprintf(out, "\n");
+			}
+			fprintf(out, "\n\n");
+		}
+	}
+	else if (pa->shift_mask) {
+		//frame f drawn at row y: ORing shifted[f][the index of y%8][p] into page y/8 + p draws it without shifting at runtime
+		u32 shift_count = 0;
+		u8 shifts[8];
+		for (u32 shift = 0; shift < 8; shift++) {
+			if (pa->shift_mask & (1 << shift)) shifts[shift_count++] = (u8)shift;
+		}
+		u32 shifted_page_count = page_count + 1;
+		u8 *shifted = push_array(shifted_page_count, width, allocator);
+		if (!shifted) {
+			return output_too_big(stream, name, width, height, frame_count);
+		}
+		const char *comment = pa->should_show_python ? "#" : "//";
+		FPRINTLN(out, "%sShifted: %u pages per frame per row offset", comment, shifted_page_count);
+		if (pa->should_show_python) fprintf(out, "%s_shift_rows = [", name);
+		else fprintf(out, "const unsigned char %s_shift_rows[%u] = {", name, shift_count);
+		for (u32 i = 0; i < shift_count; i++) {
+			fprintf(out, "%u,", shifts[i]);
+		}
+		if (pa->should_show_python) fprintf(out, "]\n\n%s_shifted = [\n", name);
+		else fprintf(out, "};\n\nconst unsigned char %s_shifted[%d][%u][%u][%d] = {\n", name, frame_count, shift_count, shifted_page_count, width);
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, pa->should_show_python ? "    [\n" : "    {\n");
+			for (u32 i = 0; i < shift_count; i++) {
+				shift_pages_down(shifted, &packed_frames[f*frame_pages_size], page_count, width, shifts[i]);
+				fprintf(out, pa->should_show_python ? "        [\n" : "        {\n");
+				for (u32 p = 0; p < shifted_page_count; p++) {
+					fprintf(out, pa->should_show_python ? "            [" : "            {");
+					for (int x = 0; x < width; x++) {
+						fprintf(out, "0x%X,", shifted[p*width + x]);
+					}
+					fprintf(out, pa->should_show_python ? "],\n" : "},\n");
+				}
+				fprintf(out, pa->should_show_python ? "        ],\n" : "        },\n");
+			}
+			fprintf(out, pa->should_show_python ? "    ],\n\n" : "    },\n\n");
+		}
+		fprintf(out, pa->should_show_python ? "]\n" : "};\n");
+	}
+	else if (pa->tile_width > 0) {
+		TileAtlas atlas;
+		if (!build_tile_atlas(packed_frames, width, page_count, frame_count, pa->tile_width, &atlas, allocator)) {
+			return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, -1, -1, 
+					"The tile atlas of %s doesn't fit in memory! (%ux%u, %u frames, %u pixel wide tiles)", name, width, height, 
+					frame_count, pa->tile_width);
+		}
+		u32 map_rows = page_count*frame_count;
+		//a file without frames has no tiles
+		const char *index_type = c_uint_type((atlas.tile_count > 0) ? atlas.tile_count - 1 : 0);
+		if (pa->should_show_python) {
+			FPRINTLN(out, "#Tiles: %u pixels wide, %u unique out of %u", atlas.tile_width, atlas.tile_count, map_rows*atlas.tiles_per_row);
+			fprintf(out, "%s_tiles = [\n", name);
+		}
+		else {
+			FPRINTLN(out, "//Tiles: %u pixels wide, %u unique out of %u", atlas.tile_width, atlas.tile_count, map_rows*atlas.tiles_per_row);
+			fprintf(out, "const unsigned char %s_tiles[%u][%u] = {\n", name, atlas.tile_count, atlas.tile_width);
+		}
+		for (u32 t = 0; t < atlas.tile_count; t++) {
+			fprintf(out, pa->should_show_python ? "    [" : "    {");
+			for (u32 x = 0; x < atlas.tile_width; x++) {
+				fprintf(out, "0x%X,", atlas.tiles[t*atlas.tile_width + x]);
+			}
+			fprintf(out, pa->should_show_python ? "],\n" : "},\n");
+		}
+		if (pa->should_show_python) {
+			fprintf(out, "]\n\n%s_tile_map = [\n", name);
+		}
+		else {
+			fprintf(out, "};\n\nconst %s %s_tile_map[%d][%u][%u] = {\n", index_type, name, frame_count, page_count, 
+					atlas.tiles_per_row);
+		}
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, pa->should_show_python ? "    [\n" : "    {\n");
+			for (int p = 0; p < page_count; p++) {
+				fprintf(out, pa->should_show_python ? "        [" : "        {");
+				for (u32 t = 0; t < atlas.tiles_per_row; t++) {
+					fprintf(out, "%u,", atlas.map[((usize)f*page_count + p)*atlas.tiles_per_row + t]);
+				}
+				fprintf(out, pa->should_show_python ? "],\n" : "},\n");
+			}
+			fprintf(out, pa->should_show_python ? "    ],\n\n" : "    },\n\n");
+		}
+		fprintf(out, pa->should_show_python ? "]\n" : "};\n");
+	}
+	else if (pa->command_mode != COMMAND_MODE_NONE) {
+		ScrollRun *scroll_runs = NULL;
+		u32 scroll_run_count = 0;
+		if (pa->should_scroll) {
+			scroll_runs = push_array(frame_count/2 + 1, sizeof(ScrollRun), allocator);
+			if (!scroll_runs) {
+				return output_too_big(stream, name, width, height, frame_count);
+			}
+			scroll_run_count = plan_scroll_runs(&pa->controller, packed_frames, width, page_count, frame_count, 
+					frame_durations, scroll_runs);
+		}
+		if (!build_command_streams(&pa->controller, packed_frames, width, page_count, frame_count, pa->command_mode, 
+					scroll_runs, scroll_run_count, &streams, allocator)) {
+			return output_too_big(stream, name, width, height, frame_count);
+		}
+		SSD1306Emulator display;
+		if (!verify_command_streams(&pa->controller, &streams, packed_frames, width, page_count, &display)) {
+			return conversion_error(CONVERSION_ERROR_VERIFY_FAILED, stream, -1, -1, 
+					"The command streams of %s don't reproduce its frames!  This is a bug in this program.", name);
+		}
+		u32 len = streams.offsets[frame_count];
+		const char *comment = pa->should_show_python ? "#" : "//";
+		FPRINTLN(out, "%sCommand streams (%s): %u bytes for %u frames, %llu bytes on the bus in %llu transfers", comment, 
+				(pa->command_mode == COMMAND_MODE_DELTA) ? "delta" : "full", len, frame_count, 
+				(unsigned long long)(display.packet_count + display.command_bytes + display.data_bytes), 
+				(unsigned long long)display.packet_count);
+		for (u32 r = 0; r < scroll_run_count; r++) {
+			const ScrollRun *run = &scroll_runs[r];
+			FPRINTLN(out, "%sFrames %u-%u: the display scrolls pages %u-%u %s, a column every %.1f ms at its power on clock", 
+					comment, run->first_frame, run->last_frame, run->start_page, run->end_page, 
+					(run->command == 0x26) ? "right" : "left", scroll_step_ms(run->interval, pa->controller.height));
+		}
+		FPRINTLN(out, "%sEach is packets of a control byte (0x00 commands, 0x40 data), a length and that many bytes", comment);
+		if (pa->should_show_python) fprintf(out, "%s_commands = [\n", name);
+		else fprintf(out, "const unsigned char %s_commands[%u] = {\n", name, (len > 0) ? len : 1);
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, "    ");
+			for (u32 i = streams.offsets[f]; i < streams.offsets[f + 1]; i++) {
+				fprintf(out, "0x%X,", streams.bytes[i]);
+			}
+			fprintf(out, "\n");
+		}
+		if (pa->should_show_python) fprintf(out, "]\n\n%s_command_offsets = [", name);
+		else fprintf(out, "};\n\nconst %s %s_command_offsets[%d] = {", c_uint_type(len), name, frame_count + 1);
+		for (int f = 0; f <= frame_count; f++) {
+			fprintf(out, "%u,", streams.offsets[f]);
+		}
+		fprintf(out, pa->should_show_python ? "]\n" : "};\n");
+	}
+	else if (pa->optimize != OPTIMIZE_NONE) {
+		OptimizedFrames frames;
+		ConversionErrorCode code = optimize_frames(packed_frames, width, page_count, frame_count, pa, &frames, allocator);
+		if (code == CONVERSION_ERROR_TOO_BIG) {
+			return conversion_error(code, stream, -1, -1, "The optimized frames of %s don't fit in memory! (%u frames)", name, 
+					frame_count);
+		}
+		if (code != CONVERSION_OK) {
+			return conversion_error(code, stream, -1, -1, 
+					"The optimized frames of %s don't reproduce its frames!  This is a bug in this program.", name);
+		}
+		static const char *const GOAL_NAMES[] = {"", "size", "bus time", "decode cycles"};
+		const char *comment = pa->should_show_python ? "#" : "//";
+		u32 len = frames.offsets[frame_count];
+		FPRINTLN(out, "%sOptimized for %s: %u bytes of frames and %u of tiles, %u raw, %u RLE, %u delta and %u tile frames", comment, 
+				GOAL_NAMES[pa->optimize], len, frames.atlas.tile_count*frames.atlas.tile_width, frames.format_counts[FRAME_FORMAT_RAW], 
+				frames.format_counts[FRAME_FORMAT_RLE], frames.format_counts[FRAME_FORMAT_DELTA], frames.format_counts[FRAME_FORMAT_TILES]);
+		FPRINTLN(out, "%sEach frame starts with its format: 0 = raw pages, 1 = RLE pages (a byte n < 128 is followed by n + 1 bytes,", comment);
+		FPRINTLN(out, "%sn >= 128 by a byte repeated n - 126 times), 2 = changes to the previous frame (a window count, then each window's", comment);
+		FPRINTLN(out, "%sx0, x1, p0, p1 and columns x0-x1 of pages p0-p1), 3 = an index into %s_tiles for every %u columns of every page", 
+				comment, name, OPTIMIZE_TILE_WIDTH);
+		if (pa->should_show_python) fprintf(out, "%s_frames = [\n", name);
+		else fprintf(out, "const unsigned char %s_frames[%u] = {\n", name, (len > 0) ? len : 1);
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, "    ");
+			for (u32 i = frames.offsets[f]; i < frames.offsets[f + 1]; i++) {
+				fprintf(out, "0x%X,", frames.bytes[i]);
+			}
+			fprintf(out, "\n");
+		}
+		if (pa->should_show_python) fprintf(out, "]\n\n%s_frame_offsets = [", name);
+		else fprintf(out, "};\n\nconst %s %s_frame_offsets[%d] = {", c_uint_type(len), name, frame_count + 1);
+		for (int f = 0; f <= frame_count; f++) {
+			fprintf(out, "%u,", frames.offsets[f]);
+		}
+		fprintf(out, pa->should_show_python ? "]\n" : "};\n");
+		if (frames.atlas.tile_count > 0) {
+			if (pa->should_show_python) fprintf(out, "\n%s_tiles = [\n", name);
+			else fprintf(out, "\nconst unsigned char %s_tiles[%u][%u] = {\n", name, frames.atlas.tile_count, frames.atlas.tile_width);
+			for (u32 t = 0; t < frames.atlas.tile_count; t++) {
+				fprintf(out, pa->should_show_python ? "    [" : "    {");
+				for (u32 x = 0; x < frames.atlas.tile_width; x++) {
+					fprintf(out, "0x%X,", frames.atlas.tiles[t*frames.atlas.tile_width + x]);
+				}
+				fprintf(out, pa->should_show_python ? "],\n" : "},\n");
+			}
+			fprintf(out, pa->should_show_python ? "]\n" : "};\n");
+		}
+		if (pa->should_output_player) {
+			SSD1306PlayerAnimation animation = {frames.bytes, frames.atlas.tiles, frame_durations, frames.atlas.tile_count, 
+				frame_count, (u8)width, (u8)page_count, pa->controller.column_offset, 
+				pa->controller.controller == SSD1306_CONTROLLER_SH1106};
+			code = verify_player(&pa->controller, &animation, packed_frames, *allocator);
+			if (code == CONVERSION_ERROR_TOO_BIG) {
+				return output_too_big(stream, name, width, height, frame_count);
+			}
+			if (code != CONVERSION_OK) {
+				return conversion_error(code, stream, -1, -1, 
+						"ssd1306_player.c doesn't play the frames of %s right!  This is a bug in this program.", name);
+			}
+			fprintf(out, "\n#include \"ssd1306_player.h\"\n\nconst uint16_t %s_frame_durations[%u] = {", name, frame_count);
+			for (int f = 0; f < frame_count; f++) {
+				fprintf(out, "%u,", frame_durations[f]);
+			}
+			fprintf(out, "};\n\n");
+			FPRINTLN(out, "//Plays the frames with ssd1306_player.c, in the top left corner of the display");
+			fprintf(out, "const SSD1306PlayerAnimation %s_player = {%s_frames, ", name, name);
+			if (frames.atlas.tile_count > 0) fprintf(out, "%s_tiles[0], ", name);
+			else fprintf(out, "NULL, ");
+			fprintf(out, "%s_frame_durations, %u, %u, %u, %u, %u, %s};\n", name, frames.atlas.tile_count, frame_count, width, 
+					page_count, pa->controller.column_offset, animation.is_page_addressed ? "true" : "false");
+		}
+		if (pa->bus_count > 0 && 
+				!optimized_command_streams(&pa->controller, &frames, packed_frames, width, page_count, frame_count, &streams, allocator)) {
+			return output_too_big(stream, name, width, height, frame_count);
+		}
+	}
+    else if (pa->should_show_python) {
+		fprintf(out, "%s = [\n", name);
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, "    [\n");
+			for (int p = 0; p < page_count; p++) {
+				fprintf(out, "        [");
+				for (int x = 0; x < width; x++) {
+					fprintf(out, "0x%X,", packed_frames[f*frame_pages_size + p*width + x]);
+				}
+				fprintf(out, "],\n");
+			}
+			fprintf(out, "    ],\n\n");
+		}
+		fprintf(out, "]\n");
+
+    }
+	else {
+		fprintf(out, "const unsigned char %s[%d][%u][%d] = {\n", name, frame_count, page_count, width);
+		for (int f = 0; f < frame_count; f++) {
+			fprintf(out, "    {\n");
+			for (int p = 0; p < page_count; p++) {
+				fprintf(out, "        {");
+				for (int x = 0; x < width; x++) {
+					fprintf(out, "0x%X,", packed_frames[f*frame_pages_size + p*width + x]);
+				}
+				fprintf(out, "},\n");
+			}
+			fprintf(out, "    },\n\n");
+		}
+		fprintf(out, "};\n");
+	}
+
+	if (pa->bus_count > 0 && !pa->should_show_frames) {
+		//the other outputs are all sent as whole frames
+		if (!streams.bytes && !build_command_streams(&pa->controller, packed_frames, width, page_count, frame_count, 
+					COMMAND_MODE_FULL, NULL, 0, &streams, allocator)) {
+			return output_too_big(stream, name, width, height, frame_count);
+		}
+		print_bus_report(out, &streams, frame_durations, pa);
+	}
+	return ret;
+}
+
+//Copy of name usable as a C or Python identifier, NULL if it doesn't fit in the arena
+static const char *c_identifier(const char *name, ByteStackAllocator *allocator) {
+	usize len = strlen(name);
+	char *ret = push_array((u64)len + 2, 1, allocator);
+	if (!ret) {
+		return NULL;
+	}
+	char *out = ret;
+	if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+		*out++ = '_';
+	}
+	for (usize i = 0; i < len; i++) {
+		char c = name[i];
+		bool is_alnum = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+		*out++ = is_alnum ? c : '_';
+	}
+	*out = '\0';
+	return ret;
+}
+
+static Slice *find_slice(SliceTable *table, const char *name) {
+	for (u32 i = 0; i < table->count; i++) {
+		if (strcmp(table->slices[i].name, name) == 0) {
+			return &table->slices[i];
+		}
+	}
+	return NULL;
+}
+
+static bool is_slice_exported(const ProgramArgs *pa, const Slice *slice) {
+	if (pa->is_all_slices) {
+		return true;
+	}
+	for (u32 i = 0; i < pa->slice_name_count; i++) {
+		if (strcmp(pa->slice_names[i], slice->name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static Rect slice_key_rect(const AsepriteSliceKey *key, const AsepriteHeader *file_header) {
+	Rect ret;
+	i64 x1 = (i64)key->x + key->width, y1 = (i64)key->y + key->height;
+	ret.x0 = (key->x > 0) ? key->x : 0;
+	ret.y0 = (key->y > 0) ? key->y : 0;
+	ret.x1 = (i32)((x1 < file_header->width) ? x1 : file_header->width);
+	ret.y1 = (i32)((y1 < file_header->height) ? y1 : file_header->height);
+	if (ret.x1 < ret.x0) ret.x1 = ret.x0;
+	if (ret.y1 < ret.y0) ret.y1 = ret.y0;
+	return ret;
+}
+
+//Cels only need decoding where an exported slice can see them.  Until every requested slice has been read 
+//(Aseprite writes them after the cels of the first frame), that's the whole canvas.
+static Rect slice_decode_bounds(const ProgramArgs *pa, SliceTable *slices, const AsepriteHeader *file_header) {
+	Rect canvas = {0, 0, file_header->width, file_header->height};
+	if (pa->is_font || (!pa->is_all_slices && pa->slice_name_count == 0) || slices->count == 0) {
+		return canvas;
+	}
+	for (u32 i = 0; i < pa->slice_name_count; i++) {
+		if (!find_slice(slices, pa->slice_names[i])) {
+			return canvas;
+		}
+	}
+	Rect ret = {0};
+	bool is_empty = true;
+	for (u32 i = 0; i < slices->count; i++) {
+		if (!is_slice_exported(pa, &slices->slices[i])) {
+			continue;
+		}
+		for (u32 k = 0; k < slices->slices[i].key_count; k++) {
+			Rect r = slice_key_rect(&slices->slices[i].keys[k], file_header);
+			if (r.x0 == r.x1 || r.y0 == r.y1) {
+				continue;
+			}
+			if (is_empty) {
+				ret = r;
+				is_empty = false;
+			}
+			else {
+				if (r.x0 < ret.x0) ret.x0 = r.x0;
+				if (r.y0 < ret.y0) ret.y0 = r.y0;
+				if (r.x1 > ret.x1) ret.x1 = r.x1;
+				if (r.y1 > ret.y1) ret.y1 = r.y1;
+			}
+		}
+	}
+	return ret;
+}
+
+//A slice is exported as big as its largest key
+static void slice_canvas_size(const Slice *slice, const AsepriteHeader *file_header, u16 *out_width, u16 *out_height) {
+	u16 width = 1, height = 1;
+	for (u32 k = 0; k < slice->key_count; k++) {
+		Rect r = slice_key_rect(&slice->keys[k], file_header);
+		if (r.x1 - r.x0 > width) width = (u16)(r.x1 - r.x0);
+		if (r.y1 - r.y0 > height) height = (u16)(r.y1 - r.y0);
+	}
+	*out_width = width;
+	*out_height = height;
+}
+
+//Crops every frame to the slice key in effect for it (the last one at or before the frame), as its own canvas.  
+//Whatever is outside the frame's key or the canvas is black.  Returns NULL if the frames don't fit in the arena.
+static u8 *crop_slice_levels(const u8 *frame_levels, const AsepriteHeader *file_header, const Slice *slice, 
+		u16 *out_width, u16 *out_height, ByteStackAllocator *allocator) {
+	u16 width, height;
+	slice_canvas_size(slice, file_header, &width, &height);
+	usize frame_size = (usize)file_header->width*file_header->height;
+	u8 *ret = push_array(file_header->frames, (u64)width*height, allocator);
+	if (!ret) {
+		return NULL;
+	}
+	memset(ret, 0, (usize)width*height*file_header->frames);
+	u32 key_index = 0;
+	for (u32 f = 0; f < file_header->frames; f++) {
+		while (key_index + 1 < slice->key_count && slice->keys[key_index + 1].frame_number <= f) {
+			key_index++;
+		}
+		if (slice->key_count == 0 || slice->keys[key_index].frame_number > f) {
+			continue;
+		}
+		Rect r = slice_key_rect(&slice->keys[key_index], file_header);
+		for (i32 y = r.y0; y < r.y1; y++) {
+			memcpy(&ret[((usize)f*height + (y - r.y0))*width], &frame_levels[f*frame_size + (usize)y*file_header->width + r.x0], 
+					r.x1 - r.x0);
+		}
+	}
+	*out_width = width;
+	*out_height = height;
+	return ret;
+}
+
+//--panels need to cover the image, and --commands, --optimize and --bus need what goes on a display (after --rotate) 
+//to fit on it.  what is "The image" or "Slice <name>".
+static ConversionError check_display_size(const ProgramArgs *pa, const AsepriteStream *stream, const char *what, u16 image_width, 
+		u16 image_height, u16 frame_count, const ByteStackAllocator *allocator) {
+	ConversionError ret = {0};
+	u32 width = image_width, height = image_height;
+	if (pa->panel_columns > 0) {
+		//what each panel covers of the image
+		width = pa->panel_width;
+		height = pa->panel_height;
+		oriented_size(pa, &width, &height);
+		if (image_width > pa->panel_columns*width || image_height > pa->panel_rows*height) {
+			return conversion_error(CONVERSION_ERROR_UNSUPPORTED, stream, -1, -1, "%s is %ux%u, more than %ux%u panels of %ux%u%s cover!", 
+					what, image_width, image_height, pa->panel_columns, pa->panel_rows, pa->panel_width, pa->panel_height, 
+					is_transposed(pa) ? " turned sideways" : "");
+		}
+	}
+	//the panels are split up, and the frames rotated, into buffers of their own
+	bool is_reoriented = pa->rotation != 0 || pa->is_flipped_horizontally || pa->is_flipped_vertically;
+	u32 block_count = (pa->panel_columns > 0) ? pa->panel_columns*pa->panel_rows : 1;
+	u64 block_size = (u64)block_count*((height + 7)/8)*width;
+	u64 oriented_block_size = is_transposed(pa) ? (u64)block_count*((width + 7)/8)*height : block_size;
+	u64 required = ((pa->panel_columns > 0) ? 2*block_size : block_size) + (is_reoriented ? oriented_block_size : 0);
+	if ((pa->panel_columns > 0 || is_reoriented) && !can_push_array(frame_count, required, allocator)) {
+		return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, -1, -1, "%s doesn't fit in memory split over the panels or rotated!", what);
+	}
+	oriented_size(pa, &width, &height);
+	bool needs_display = pa->command_mode != COMMAND_MODE_NONE || pa->optimize != OPTIMIZE_NONE || pa->bus_count > 0;
+	const ControllerProfile *controller = &pa->controller;
+	if (needs_display && !pa->should_show_frames && 
+			(width == 0 || width > controller->width || height == 0 || height > controller->height)) {
+		if (pa->panel_columns > 0) {
+			return conversion_error(CONVERSION_ERROR_UNSUPPORTED, stream, -1, -1, 
+					"The panels are %ux%u, --commands, --optimize and --bus need them to fit on a %ux%u display!", width, height, 
+					controller->width, controller->height);
+		}
+		return conversion_error(CONVERSION_ERROR_UNSUPPORTED, stream, -1, -1, 
+				"%s is %ux%u, --commands, --optimize and --bus need it to fit on a %ux%u display!", what, width, height, 
+				controller->width, controller->height);
+	}
+	return ret;
+}
+
+//Prints packed frames from pack_levels() with print_animation(), or with --panels every panel's frames as an animation 
+//of its own called name_panelN, numbered left to right, top to bottom.  width and height are the image's, before --rotate.
+static ConversionError print_panels(FILE *out, const AsepriteStream *stream, const char *name, const u8 *packed_frames, 
+		u16 width, u16 height, u16 frame_count, const u16 *frame_durations, const ProgramArgs *pa, ByteStackAllocator *allocator) {
+	ConversionError ret = {0};
+	if (pa->panel_columns == 0) {
+		u32 oriented_width = width, oriented_height = height;
+		oriented_size(pa, &oriented_width, &oriented_height);
+		return print_animation(out, stream, name, packed_frames, (u16)oriented_width, (u16)oriented_height, frame_count, 
+				frame_durations, pa, allocator);
+	}
+	u32 panel_count = pa->panel_columns*pa->panel_rows;
+	usize panel_pages_size = (usize)((pa->panel_height + 7)/8)*pa->panel_width;
+	for (u32 panel = 0; panel < panel_count; panel++) {
+		ByteStackAllocator panel_allocator = *allocator;
+		usize name_size = strlen(name) + 16;
+		char *panel_name = push_array(name_size, 1, &panel_allocator);
+		if (!panel_name) {
+			return output_too_big(stream, name, width, height, frame_count);
+		}
+		snprintf(panel_name, name_size, "%s_panel%u", name, panel);
+		if (pa->should_show_frames) {
+			FPRINTLN(out, "%s:", panel_name);
+		}
+		ret = print_animation(out, stream, panel_name, &packed_frames[panel*frame_count*panel_pages_size], (u16)pa->panel_width, 
+				(u16)pa->panel_height, frame_count, frame_durations, pa, &panel_allocator);
+		if (ret.code != CONVERSION_OK) {
+			return ret;
+		}
+	}
+	return ret;
+}
+
+//What the cels of one frame get drawn into, and with
+typedef struct CelCanvas {
+	u8 *levels;
+	AsepriteRGBAPixel *rgba; //NULL when cels go straight into levels
+	Rect bounds; //only this part of the frame gets decoded
+	AsepriteHeader *file_header;
+	const PaletteLUT *palette_lut;
+	const PaletteLUT *background_palette_lut; //for background layers
+	const TilesetTable *tilesets;
+	ConversionMode mode;
+} CelCanvas;
+
+//Draws a raw, compressed or tilemap cel whose data follows in stream up to chunk_end.  A cel cut off before its 
+//pixels, or with nothing on the canvas, draws nothing.  Scratch memory comes from allocator and is popped on return.
+static ConversionError draw_cel(AsepriteStream *stream, u64 chunk_end, AsepriteCelChunkHeader *cel_chunk_header, 
+		const LayerInfo *layer, const CelCanvas *canvas, u16 frames_index, u32 chunk_index, ByteStackAllocator scratch_allocator) {
+	ConversionError ret = {0};
+	AsepriteHeader *file_header = canvas->file_header;
+	switch (cel_chunk_header->type) {
+		case CCT_RAW_CEL: 
+		case CCT_COMPRESSED_CEL: {
+			u8 *rac_cel_data = stream_take(stream, sizeof(AsepriteRawAndCompressedCelHeader));
+			if (!rac_cel_data) {
+				break;
+			}
+			AsepriteRawAndCompressedCelHeader rac_cel_header = *(AsepriteRawAndCompressedCelHeader*)rac_cel_data;
+			CelClip clip = clip_cel(canvas->bounds, cel_chunk_header, rac_cel_header.width, rac_cel_header.height);
+			if (clip.x0 == clip.x1) {
+				//nothing lands on the canvas, so the pixels are skipped without inflating them
+				break;
+			}
+			//rows below the clip are never read or inflated.  raw cels skip the rows above it too, 
+			//compressed ones need them as the inflate window.
+			usize row_stride = (usize)rac_cel_header.width * (file_header->color_depth / 8);
+			usize first_row = (cel_chunk_header->type == CCT_RAW_CEL) ? clip.y0 : 0;
+			usize cel_pixels_len = (clip.y1 - first_row)*row_stride;
+			if (cel_chunk_header->type == CCT_RAW_CEL && stream->offset + (u64)rac_cel_header.height*row_stride > chunk_end) {
+				return conversion_error(CONVERSION_ERROR_INVALID_CHUNK, stream, frames_index, chunk_index, 
+						"Invalid cel size in frame %u!", frames_index);
+			}
+			u8 *cel_pixels = push_array(clip.y1 - first_row, row_stride, &scratch_allocator);
+			AsepriteRGBAPixel *row_scratch = push_array(rac_cel_header.width, sizeof(AsepriteRGBAPixel), &scratch_allocator);
+			if (!cel_pixels || !row_scratch) {
+				return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, frames_index, chunk_index, 
+						"The cel in frame %u doesn't fit in memory!", frames_index);
+			}
+			if (cel_chunk_header->type == CCT_RAW_CEL) {
+				if (!stream_skip(stream, first_row*row_stride) || !stream_read_into(stream, cel_pixels, cel_pixels_len)) {
+					return conversion_error(CONVERSION_ERROR_TRUNCATED, stream, frames_index, chunk_index, 
+							"Unexpected end of Aseprite file in raw cel chunk!");
+				}
+			}
+			else if (stream->offset >= chunk_end || 
+					!stream_inflate_into(stream, chunk_end - stream->offset, cel_pixels, cel_pixels_len)) {
+				return conversion_error(CONVERSION_ERROR_CORRUPT_DATA, stream, frames_index, chunk_index, 
+						"Invalid compressed data in cel chunk! Either the file is corrupted, or there is a bug in this program (probably the latter).");
+			}
+			composite_cel(canvas->levels, canvas->rgba, file_header, cel_chunk_header, &rac_cel_header, clip, 
+					&cel_pixels[(clip.y0 - first_row)*row_stride], mul_un8(layer->opacity, cel_chunk_header->opacity), 
+					layer->blend_mode, canvas->mode, layer->is_background ? canvas->background_palette_lut : canvas->palette_lut, 
+					row_scratch);
+		} break;
+		case CCT_COMPRESSED_TILEMAP: {
+			u8 *tilemap_data = stream_take(stream, sizeof(AsepriteTilemapCelHeader));
+			if (!tilemap_data) {
+				break;
+			}
+			AsepriteTilemapCelHeader tilemap_header = *(AsepriteTilemapCelHeader*)tilemap_data;
+			const Tileset *tileset = (layer->tileset_index < MAX_TILESETS) ? &canvas->tilesets->tilesets[layer->tileset_index] : NULL;
+			if (!tileset || tileset->tile_count == 0 || tilemap_header.bits_per_tile != 32) {
+				break;
+			}
+			CelClip clip = clip_cel(canvas->bounds, cel_chunk_header, 
+					(u32)tilemap_header.width*tileset->tile_width, (u32)tilemap_header.height*tileset->tile_height);
+			if (clip.x0 == clip.x1) {
+				break;
+			}
+			//only the tile rows down to the clip are inflated
+			usize tile_rows = (clip.y1 + tileset->tile_height - 1)/tileset->tile_height;
+			usize tiles_len = tile_rows*tilemap_header.width*sizeof(u32);
+			u32 *tiles = push_array(tile_rows, (u64)tilemap_header.width*sizeof(u32), &scratch_allocator);
+			AsepriteRGBAPixel *row_scratch = push_array(2*tileset->tile_width, sizeof(AsepriteRGBAPixel), &scratch_allocator);
+			if (!tiles || !row_scratch) {
+				return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, frames_index, chunk_index, 
+						"The tilemap in frame %u doesn't fit in memory!", frames_index);
+			}
+			if (stream->offset >= chunk_end || 
+					!stream_inflate_into(stream, chunk_end - stream->offset, (u8*)tiles, tiles_len)) {
+				return conversion_error(CONVERSION_ERROR_CORRUPT_DATA, stream, frames_index, chunk_index, 
+						"Invalid compressed data in tilemap cel chunk!");
+			}
+			composite_tilemap_cel(canvas->levels, canvas->rgba, file_header, cel_chunk_header, &tilemap_header, clip, tiles, 
+					tileset, mul_un8(layer->opacity, cel_chunk_header->opacity), layer->blend_mode, canvas->mode, row_scratch);
+		} break;
+	}
+	return ret;
+}
+
+//Every frame of the file composited into level planes, before any quantizing
+typedef struct DecodedAseprite {
+	AsepriteHeader header;
+	u8 *frame_levels; //header.frames planes of width*height levels (0 = black, 255 = white)
+	u16 *frame_durations; //milliseconds
+	SliceTable *slices;
+} DecodedAseprite;
+
+//Reads the whole file into out, allocating from program_allocator.  Returns the first error; warnings about parts 
+//that are skipped go to stderr.
+ConversionError decode_aseprite(const ProgramArgs *pa, AsepriteStream *stream, ByteStackAllocator *program_allocator, 
+		DecodedAseprite *out) {
+	assert(sizeof(AsepriteHeader) == 128);
+	assert(sizeof(AsepriteFrameHeader) == 16);
+	assert(sizeof(AsepriteChunkHeader) == 6);
+	assert(sizeof(AsepriteLinkedCelHeader) == 2);
+	assert(sizeof(AsepriteRawAndCompressedCelHeader) == 4);
+	assert(sizeof(AsepriteRGBAPixel) == 4);
+	assert(sizeof(AsepriteGrayscalePixel) == 2);
+	assert(sizeof(AsepriteLayerChunkHeader) == 18);
+	assert(sizeof(AsepriteTilesetChunkHeader) == 34);
+	assert(sizeof(AsepriteTilemapCelHeader) == 32);
+	assert(sizeof(AsepriteSliceKey) == 20);
+
+	//headers are copied out of the stream, since its buffer gets reused on refill
+	AsepriteHeader *file_header = &out->header;
+	u8 *header_data = stream_take(stream, sizeof(AsepriteHeader));
+
+	//Validation
+	if (!header_data || ((AsepriteHeader*)header_data)->magic != 0xA5E0) {
+		return conversion_error(CONVERSION_ERROR_INVALID_FILE, stream, -1, -1, "Invalid Aseprite file!");
+	}
+	*file_header = *(AsepriteHeader*)header_data;
+
+
+	if (file_header->color_depth != 32 && file_header->color_depth != 16 && file_header->color_depth != 8) {
+		return conversion_error(CONVERSION_ERROR_UNSUPPORTED, stream, -1, -1, "Invalid color depth in Aseprite file!");
+	}
+	usize frame_size = (usize)file_header->width*file_header->height;
+	//the level planes and the RGBA accumulator may take at most half the arena, the rest is for cels and packing
+	u64 table_size = MAX_LAYERS*sizeof(LayerInfo) + sizeof(TilesetTable) + sizeof(SliceTable) + file_header->frames*sizeof(u16);
+	if (!can_push_array(1, 2*frame_size*((u64)file_header->frames + sizeof(AsepriteRGBAPixel)) + table_size, program_allocator)) {
+		return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, -1, -1, "The Aseprite file is too big! (%ux%u, %u frames)", 
+				file_header->width, file_header->height, file_header->frames);
+	}
+	//End Validation
+	
+	u8 *frame_levels = push_bytes(frame_size*file_header->frames, program_allocator);
+	//cels are drawn over black.  fresh pages from the OS are already zero, but the arena may be the caller's memory
+	memset(frame_levels, 0, frame_size*file_header->frames);
+	//only used when some layer needs blending at full precision
+	AsepriteRGBAPixel *frame_rgba = push_bytes(frame_size*sizeof(AsepriteRGBAPixel), program_allocator);
+	bool is_compositing_checked = false;
+	bool needs_full_compositing = false;
+
+	LayerTable layer_table = {0};
+	layer_table.layers = push_bytes(MAX_LAYERS*sizeof(LayerInfo), program_allocator);
+	TilesetTable *tileset_table = push_bytes(sizeof(TilesetTable), program_allocator);
+	memset(tileset_table, 0, sizeof(TilesetTable));
+	SliceTable *slice_table = push_bytes(sizeof(SliceTable), program_allocator);
+	slice_table->count = 0;
+	u16 *frame_durations = push_bytes(file_header->frames*sizeof(u16), program_allocator);
+
+	PaletteLUT palette_lut, background_palette_lut;
+	init_palette_lut(&palette_lut, &background_palette_lut, file_header->transparent_color_index);
+
+	//loop through frames
+	for (u16 frames_index = 0; frames_index < file_header->frames; frames_index++) {
+		u8 *frame_header_data = stream_take(stream, sizeof(AsepriteFrameHeader));
+		if (!frame_header_data) {
+			return conversion_error(CONVERSION_ERROR_TRUNCATED, stream, frames_index, -1, 
+					"Unexpected end of Aseprite file in frame %u!", frames_index);
+		}
+		AsepriteFrameHeader frame_header = *(AsepriteFrameHeader*)frame_header_data;
+		if (frame_header.magic != 0xF1FA || frame_header.frame_size < sizeof(AsepriteFrameHeader)) {
+			return conversion_error(CONVERSION_ERROR_INVALID_FRAME, stream, frames_index, -1, 
+					"Invalid frame header in frame %u!", frames_index);
+		}
+		u64 frame_end = stream->offset - sizeof(AsepriteFrameHeader) + frame_header.frame_size;
+		frame_durations[frames_index] = frame_header.frame_duration_ms;
+
+		DEBUGOUTLN("Frame size %u", frame_header.frame_size);
+		u32 num_chunks = (frame_header.number_of_chunks > 0) ? frame_header.number_of_chunks : frame_header.old_number_of_chunks;
+		u8 *levels = &frame_levels[frames_index*frame_size];
+		Rect decode_bounds = slice_decode_bounds(pa, slice_table, file_header);
+		if (needs_full_compositing) {
+			memset(frame_rgba, 0, frame_size*sizeof(AsepriteRGBAPixel));
+		}
+		//loop through chunks
+		for (u32 chunk_index = 0; chunk_index < num_chunks && stream->offset < frame_end; chunk_index++) {
+			u8 *chunk_header_data = stream_take(stream, sizeof(AsepriteChunkHeader));
+			if (!chunk_header_data) {
+				return conversion_error(CONVERSION_ERROR_TRUNCATED, stream, frames_index, chunk_index, 
+						"Unexpected end of Aseprite file in frame %u!", frames_index);
+			}
+			AsepriteChunkHeader chunk_header = *(AsepriteChunkHeader*)chunk_header_data;
+			u64 chunk_end = stream->offset - sizeof(AsepriteChunkHeader) + chunk_header.size;
+			//every chunk lies inside its frame, so the parsers below only have to stay inside their chunk
+			if (chunk_header.size < sizeof(AsepriteChunkHeader) || chunk_end > frame_end) {
+				return conversion_error(CONVERSION_ERROR_INVALID_CHUNK, stream, frames_index, chunk_index, 
+						"Invalid chunk size in frame %u!", frames_index);
+			}
+			DEBUGOUTLN("Chunk type: 0x%X", chunk_header.type);
+            switch (chunk_header.type) {
+            case 0x2004: { //layer chunk
+				if (is_compositing_checked) {
+					//every layer chunk comes before the first cel, a late one can't be composited consistently
+					PRINTERR("Warning: ignoring layer chunk after the first cel in frame %u.", frames_index);
+				}
+				else if (!parse_layer_chunk(stream, pa, file_header->flags, &layer_table)) {
+					return conversion_error(CONVERSION_ERROR_INVALID_CHUNK, stream, frames_index, chunk_index, 
+							"Invalid layer chunk in frame %u!", frames_index);
+				}
+			} break;
+
+			case 0x2023: { //tileset chunk
+				ConversionErrorCode code = parse_tileset_chunk(stream, chunk_end, file_header, &palette_lut, tileset_table, 
+						program_allocator);
+				if (code != CONVERSION_OK) {
+					return conversion_error(code, stream, frames_index, chunk_index, (code == CONVERSION_ERROR_TOO_BIG) ? 
+							"The tileset in frame %u doesn't fit in memory!" : "Invalid tileset chunk in frame %u!", frames_index);
+				}
+			} break;
+
+			case 0x2022: { //slice chunk
+				ConversionErrorCode code = parse_slice_chunk(stream, chunk_end, slice_table, program_allocator);
+				if (code != CONVERSION_OK) {
+					return conversion_error(code, stream, frames_index, chunk_index, (code == CONVERSION_ERROR_TOO_BIG) ? 
+							"The slice in frame %u doesn't fit in memory!" : "Invalid slice chunk in frame %u!", frames_index);
+				}
+			} break;
+
+			case 0x2019: { //palette chunk
+				if (!parse_palette_chunk(stream, file_header->transparent_color_index, &palette_lut, &background_palette_lut)) {
+					return conversion_error(CONVERSION_ERROR_INVALID_CHUNK, stream, frames_index, chunk_index, 
+							"Invalid palette chunk in frame %u!", frames_index);
+				}
+			} break;
+			
+            case 0x2005: { //cel chunk
+				u8 *cel_chunk_data = stream_take(stream, sizeof(AsepriteCelChunkHeader));
+				if (!cel_chunk_data) {
+					break;
+				}
+                AsepriteCelChunkHeader cel_chunk_header = *(AsepriteCelChunkHeader*)cel_chunk_data;
+                DEBUGOUTLN("Layer Index: %d", cel_chunk_header.layer_index);
+				//cels of hidden, filtered out and reference layers are skipped before anything gets decompressed
+                if (cel_chunk_header.layer_index >= layer_table.count || !layer_table.layers[cel_chunk_header.layer_index].is_visible) {
+                    break;
+                }
+				LayerInfo *layer = &layer_table.layers[cel_chunk_header.layer_index];
+				if (!is_compositing_checked) {
+					//all layer chunks come before the first cel.  if every visible layer is Normal at full opacity, 
+					//cels go straight into the level plane and the RGBA accumulator is never touched
+					for (u32 i = 0; i < layer_table.count; i++) {
+						LayerInfo *l = &layer_table.layers[i];
+						if (l->is_visible && (l->blend_mode != BLEND_MODE_NORMAL || l->opacity != 255)) {
+							needs_full_compositing = true;
+						}
+					}
+					is_compositing_checked = true;
+					if (needs_full_compositing) {
+						memset(frame_rgba, 0, frame_size*sizeof(AsepriteRGBAPixel));
+					}
+				}
+				CelCanvas canvas = {levels, needs_full_compositing ? frame_rgba : NULL, decode_bounds, file_header, &palette_lut, 
+						&background_palette_lut, tileset_table, pa->mode};
+				ConversionError error = {0};
+				if (cel_chunk_header.type == CCT_LINKED_CEL) {
+					u8 *link_data = stream_take(stream, sizeof(AsepriteLinkedCelHeader));
+					if (!link_data) {
+						break;
+					}
+					//a linked cel shares the image, position and opacity of the cel it links to
+					u16 link_frame = ((AsepriteLinkedCelHeader*)link_data)->frame_to_link_with;
+					KeptCel *kept = layer->kept_cels;
+					while (kept && kept->frame_index != link_frame) {
+						kept = kept->next;
+					}
+					if (!kept) {
+						if (layer->has_dropped_cels) {
+							return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, frames_index, chunk_index, 
+									"The cel linked to in frame %u didn't fit in memory!", frames_index);
+						}
+						//like Aseprite, a link to a frame without a cel draws nothing
+						break;
+					}
+					AsepriteStream kept_stream = stream_from_memory(kept->data, kept->len);
+					kept_stream.offset = kept->offset;
+					error = draw_cel(&kept_stream, kept->offset + kept->len, &kept->header, layer, &canvas, frames_index, 
+							chunk_index, *program_allocator);
+				}
+				else if (cel_chunk_header.type <= CCT_COMPRESSED_TILEMAP && stream->offset <= chunk_end) {
+					//every cel is kept in case a later frame links to it.  if it doesn't fit it's still drawn, 
+					//only links to it fail.
+					u64 kept_offset = stream->offset;
+					usize kept_len = (usize)(chunk_end - stream->offset);
+					u8 *kept_data = stream->read ? push_array(kept_len, 1, program_allocator) : stream_take(stream, kept_len);
+					KeptCel *kept = kept_data ? push_array(1, sizeof(KeptCel), program_allocator) : NULL;
+					if (!kept) {
+						layer->has_dropped_cels = true;
+						error = draw_cel(stream, chunk_end, &cel_chunk_header, layer, &canvas, frames_index, chunk_index, 
+								*program_allocator);
+					}
+					else {
+						if (stream->read && !stream_read_into(stream, kept_data, kept_len)) {
+							return conversion_error(CONVERSION_ERROR_TRUNCATED, stream, frames_index, chunk_index, 
+									"Unexpected end of Aseprite file in cel chunk!");
+						}
+						kept->next = layer->kept_cels;
+						kept->header = cel_chunk_header;
+						kept->frame_index = frames_index;
+						kept->offset = kept_offset;
+						kept->len = kept_len;
+						kept->data = kept_data;
+						layer->kept_cels = kept;
+						AsepriteStream kept_stream = stream_from_memory(kept_data, kept_len);
+						kept_stream.offset = kept_offset;
+						error = draw_cel(&kept_stream, chunk_end, &cel_chunk_header, layer, &canvas, frames_index, chunk_index, 
+								*program_allocator);
+					}
+				}
+				if (error.code != CONVERSION_OK) {
+					return error;
+				}
+                DEBUGOUTLN("Cel Chunk type: 0x%X", cel_chunk_header.type);
+            } break;
+            }
+
+			//skip whatever part of the chunk we didn't need
+			if (stream->offset > chunk_end || !stream_skip(stream, chunk_end - stream->offset)) {
+				return conversion_error(CONVERSION_ERROR_INVALID_CHUNK, stream, frames_index, chunk_index, 
+						"Invalid chunk size in frame %u!", frames_index);
+			}
+		}
+		if (stream->offset > frame_end || !stream_skip(stream, frame_end - stream->offset)) {
+			return conversion_error(CONVERSION_ERROR_INVALID_FRAME, stream, frames_index, -1, 
+					"Invalid frame size in frame %u!", frames_index);
+		}
+		if (needs_full_compositing) {
+			rgba_row_to_levels(levels, frame_rgba, frame_size, pa->mode);
+		}
+	}
+	out->frame_levels = frame_levels;
+	out->frame_durations = frame_durations;
+	out->slices = slice_table;
+	ConversionError ret = {0};
+	return ret;
+}
+
+//Converts the file and prints the result to out, returning the first error.  A file that can't be decoded fails 
+//before anything is printed.  The output is printed as it's produced though, so an error converting it (e.g. 
+//CONVERSION_ERROR_TOO_BIG, or CONVERSION_ERROR_VERIFY_FAILED for a later slice or panel) comes with part of it 
+//already in out.  Callers that need all or nothing buffer out and drop it on error, like --serve does.  Warnings 
+//about parts that are skipped go to stderr.
+ConversionError aseprite_to_ssd1306(ProgramArgs pa, AsepriteStream *stream, FILE *out, ByteStackAllocator program_allocator) {
+	DecodedAseprite sprite;
+	ConversionError error = decode_aseprite(&pa, stream, &program_allocator, &sprite);
+	if (error.code != CONVERSION_OK) {
+		return error;
+	}
+	AsepriteHeader *file_header = &sprite.header;
+	u8 *frame_levels = sprite.frame_levels;
+	SliceTable *slice_table = sprite.slices;
+
+	if (pa.is_font && !pa.should_show_frames) {
+		u8 *packed_frames = pack_levels(frame_levels, file_header->width, file_header->height, file_header->frames, &pa, &program_allocator);
+		Font font;
+		if (!packed_frames || !build_font(packed_frames, file_header->width, file_header->height, (file_header->height + 7)/8, 
+					file_header->frames, slice_table, &font, &program_allocator)) {
+			return output_too_big(stream, "the font", file_header->width, file_header->height, file_header->frames);
+		}
+		print_image_comment(out, file_header->width, file_header->height, pa.should_show_python);
+		print_font(out, &font, pa.font_first_char, pa.should_show_python);
+	}
+	else if (pa.slice_name_count > 0 || pa.is_all_slices) {
+		for (u32 i = 0; i < pa.slice_name_count; i++) {
+			if (!find_slice(slice_table, pa.slice_names[i])) {
+				return conversion_error(CONVERSION_ERROR_MISSING_SLICE, stream, -1, -1, "No slice named %s!", pa.slice_names[i]);
+			}
+		}
+		if (pa.is_all_slices && slice_table->count == 0) {
+			return conversion_error(CONVERSION_ERROR_MISSING_SLICE, stream, -1, -1, "The Aseprite file has no slices!");
+		}
+		for (u32 i = 0; i < slice_table->count; i++) {
+			Slice *slice = &slice_table->slices[i];
+			u16 width, height;
+			slice_canvas_size(slice, file_header, &width, &height);
+			char what[64];
+			snprintf(what, sizeof(what), "Slice %s", slice->name);
+			ConversionError error = check_display_size(&pa, stream, what, width, height, file_header->frames, &program_allocator);
+			if (is_slice_exported(&pa, slice) && error.code != CONVERSION_OK) {
+				return error;
+			}
+		}
+		for (u32 i = 0; i < slice_table->count; i++) {
+			Slice *slice = &slice_table->slices[i];
+			if (!is_slice_exported(&pa, slice)) {
+				continue;
+			}
+			//each slice is exported as its own canvas
+			ByteStackAllocator slice_allocator = program_allocator;
+			u16 width, height;
+			u8 *slice_levels = crop_slice_levels(frame_levels, file_header, slice, &width, &height, &slice_allocator);
+			u8 *packed_frames = slice_levels ? pack_levels(slice_levels, width, height, file_header->frames, &pa, &slice_allocator) : NULL;
+			const char *name = c_identifier(slice->name, &slice_allocator);
+			if (!packed_frames || !name) {
+				return conversion_error(CONVERSION_ERROR_TOO_BIG, stream, -1, -1, "Slice %s doesn't fit in memory! (%ux%u, %u frames)", 
+						slice->name, width, height, file_header->frames);
+			}
+			if (pa.should_show_frames) {
+				FPRINTLN(out, "%s:", slice->name);
+			}
+			error = print_panels(out, stream, name, packed_frames, width, height, file_header->frames, sprite.frame_durations, 
+					&pa, &slice_allocator);
+			if (error.code != CONVERSION_OK) {
+				return error;
+			}
+		}
+	}
+	else {
+		ConversionError error = check_display_size(&pa, stream, "The image", file_header->width, file_header->height, 
+				file_header->frames, &program_allocator);
+		if (error.code != CONVERSION_OK) {
+			return error;
+		}
+		u8 *packed_frames = pack_levels(frame_levels, file_header->width, file_header->height, file_header->frames, &pa, &program_allocator);
+		if (!packed_frames) {
+			return output_too_big(stream, "the image", file_header->width, file_header->height, file_header->frames);
+		}
+		error = print_panels(out, stream, "animation", packed_frames, file_header->width, file_header->height, 
+				file_header->frames, sprite.frame_durations, &pa, &program_allocator);
+		if (error.code != CONVERSION_OK) {
+			return error;
+		}
+	}
+	ConversionError ret = {0};
+	return ret;
 }
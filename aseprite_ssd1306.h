@@ -0,0 +1,98 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+
+//C interface of libaseprite_ssd1306 (./build.sh lib).  Decodes an Aseprite file once and hands out its frames as
+//SSD1306 pages: page_count = (height + 7)/8 rows of width bytes each, bit 0 of a byte is the topmost pixel.
+//The library never allocates on its own.  Everything, the handle included, lives in the memory block the caller
+//passes to open, so dropping that block is all the cleanup there is.  A handle must not be used from two threads at once.
+//Warnings about parts of the file that can't be drawn go to stderr.
+#ifndef ASEPRITE_SSD1306_H
+#define ASEPRITE_SSD1306_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#	define ASEPRITE_SSD1306_API
+#else
+#	define ASEPRITE_SSD1306_API __attribute__((visibility("default")))
+#endif
+
+typedef enum AsepriteSSD1306Mode {
+	ASEPRITE_SSD1306_ALPHA, //any non-transparent pixel is white
+	ASEPRITE_SSD1306_THRESHOLD, //white if luminance > threshold
+	ASEPRITE_SSD1306_BAYER2,
+	ASEPRITE_SSD1306_BAYER4,
+	ASEPRITE_SSD1306_BAYER8,
+	ASEPRITE_SSD1306_FLOYD_STEINBERG,
+	ASEPRITE_SSD1306_ATKINSON,
+	ASEPRITE_SSD1306_SIERRA_LITE,
+} AsepriteSSD1306Mode;
+
+//Zeroed options draw every visible layer in alpha mode, like the command line without flags
+typedef struct AsepriteSSD1306Options {
+	AsepriteSSD1306Mode mode;
+	uint8_t threshold; //ASEPRITE_SSD1306_THRESHOLD, 0-254
+	uint32_t thread_count; //0 = one per processor
+	const char *const *layer_names; //only draw these layers (or groups), even if hidden.  UTF-8
+	uint32_t layer_name_count;
+	const char *const *excluded_layer_names; //never draw these layers (or groups).  UTF-8
+	uint32_t excluded_layer_name_count;
+} AsepriteSSD1306Options;
+
+typedef enum AsepriteSSD1306ErrorCode {
+	ASEPRITE_SSD1306_OK,
+	ASEPRITE_SSD1306_ERROR_INVALID_FILE,
+	ASEPRITE_SSD1306_ERROR_UNSUPPORTED,
+	ASEPRITE_SSD1306_ERROR_TOO_BIG, //the memory block is too small
+	ASEPRITE_SSD1306_ERROR_TRUNCATED,
+	ASEPRITE_SSD1306_ERROR_READ_FAILED,
+	ASEPRITE_SSD1306_ERROR_INVALID_FRAME,
+	ASEPRITE_SSD1306_ERROR_INVALID_CHUNK,
+	ASEPRITE_SSD1306_ERROR_CORRUPT_DATA,
+	ASEPRITE_SSD1306_ERROR_MISSING_SLICE,
+} AsepriteSSD1306ErrorCode;
+
+typedef struct AsepriteSSD1306Error {
+	AsepriteSSD1306ErrorCode code;
+	uint64_t offset; //bytes into the file where the problem was found
+	int32_t frame_index; //-1 when it isn't in a frame
+	int32_t chunk_index; //-1 when it isn't in a chunk
+	char message[256];
+} AsepriteSSD1306Error;
+
+typedef struct AsepriteSSD1306 AsepriteSSD1306;
+
+//Called once per frame, in order.  pages is only valid during the call.
+typedef void AsepriteSSD1306FrameSink(void *context, uint32_t frame_index, const uint8_t *pages, uint16_t duration_ms);
+
+//Both return NULL and fill in error (if not NULL) when the file can't be decoded.  data is only read during the call.
+//The memory block needs room for twice the frames at one byte per pixel plus about 2MB (the CLI reserves 1GB).
+ASEPRITE_SSD1306_API AsepriteSSD1306 *aseprite_ssd1306_open_memory(const void *data, size_t len,
+		const AsepriteSSD1306Options *options, void *memory, size_t memory_size, AsepriteSSD1306Error *error);
+ASEPRITE_SSD1306_API AsepriteSSD1306 *aseprite_ssd1306_open_fd(int fd,
+		const AsepriteSSD1306Options *options, void *memory, size_t memory_size, AsepriteSSD1306Error *error);
+
+ASEPRITE_SSD1306_API uint32_t aseprite_ssd1306_frame_count(const AsepriteSSD1306 *file);
+ASEPRITE_SSD1306_API uint16_t aseprite_ssd1306_width(const AsepriteSSD1306 *file);
+ASEPRITE_SSD1306_API uint16_t aseprite_ssd1306_height(const AsepriteSSD1306 *file);
+//bytes in one frame's pages: (height + 7)/8*width
+ASEPRITE_SSD1306_API size_t aseprite_ssd1306_frame_size(const AsepriteSSD1306 *file);
+ASEPRITE_SSD1306_API uint16_t aseprite_ssd1306_frame_duration(const AsepriteSSD1306 *file, uint32_t frame_index);
+
+//Quantizes one frame into out_pages (aseprite_ssd1306_frame_size() bytes).  Returns false if frame_index is out of range 
+//or the memory block has no room left to quantize it.
+ASEPRITE_SSD1306_API bool aseprite_ssd1306_decode_frame(AsepriteSSD1306 *file, uint32_t frame_index, uint8_t *out_pages);
+//Quantizes every frame and passes each one to sink.  Returns false, without calling sink, if the memory block has no 
+//room left to quantize them all at once.
+ASEPRITE_SSD1306_API bool aseprite_ssd1306_decode_frames(AsepriteSSD1306 *file, AsepriteSSD1306FrameSink *sink, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,15 +10,48 @@ else
     exit 1
 fi
 
+#SSSE3 is needed for the pshufb kernels; arm64 gets NEON by default
+ARCH_FLAGS=
+case "$(uname -m)" in
+	x86_64|i?86)
+		ARCH_FLAGS=-mssse3
+		;;
+esac
 
 case "$1" in
 	debug)
-		if ! $CC -g unix.c -o aseprite_ssd1306; then
+		if ! $CC $ARCH_FLAGS -g unix.c -o aseprite_ssd1306 -pthread; then
 			exit 1
 		fi
 		;;
 	'')
-		if ! $CC -DRELEASE=1 -O3 unix.c -o aseprite_ssd1306; then
+		if ! $CC $ARCH_FLAGS -DRELEASE=1 -O3 unix.c -o aseprite_ssd1306 -pthread; then
+			exit 1
+		fi
+		;;
+	lib)
+		#one object with only the aseprite_ssd1306_* functions global, so the converter's internals and miniz can't clash 
+		#with the caller's symbols
+		if ! $CC $ARCH_FLAGS -DRELEASE=1 -O3 -fPIC -fvisibility=hidden -c library.c -o aseprite_ssd1306_lib.o -pthread; then
+			exit 1
+		fi
+		if command -v objcopy > /dev/null 2>&1; then
+			objcopy -w --keep-global-symbol='aseprite_ssd1306_*' aseprite_ssd1306_lib.o
+		fi
+		rm -f libaseprite_ssd1306.a
+		SHARED_LIB=libaseprite_ssd1306.so
+		if [ "$(uname)" = Darwin ]; then
+			SHARED_LIB=libaseprite_ssd1306.dylib
+		fi
+		if ! ar rcs libaseprite_ssd1306.a aseprite_ssd1306_lib.o || 
+				! $CC -shared aseprite_ssd1306_lib.o -o $SHARED_LIB -pthread; then
+			exit 1
+		fi
+		rm aseprite_ssd1306_lib.o
+		;;
+	fuzz)
+		#libFuzzer ships with clang
+		if ! clang $ARCH_FLAGS -DRELEASE=1 -g -O1 -fsanitize=fuzzer,address,undefined fuzz.c -o aseprite_ssd1306_fuzz; then
 			exit 1
 		fi
 		;;
@@ -0,0 +1,168 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+
+//libFuzzer target for the Aseprite parser.  Build with ./build.sh fuzz (needs clang), then run
+//	./aseprite_ssd1306_fuzz corpus_dir examples
+//Built with -DFUZZ_STANDALONE instead, it replays the files given on the command line, so crashes can be
+//reproduced with any compiler, e.g. gcc -g -fsanitize=address,undefined -DFUZZ_STANDALONE fuzz.c
+#include <sys/mman.h>
+#define NL "\n"
+
+#include "3rdparty/miniz.c"
+#include "ssd1306_emulator.c"
+#include "ssd1306_player.c"
+#include "aseprite_ssd1306.c"
+
+static void platform_parallel_for(ParallelWorkFn *fn, void *data, u32 work_count, u32 thread_count) {
+	for (u32 i = 0; i < work_count; i++) {
+		fn(data, i);
+	}
+}
+
+static u32 platform_processor_count(void) {
+	return 1;
+}
+
+static void platform_yield_thread(void) {
+}
+
+//the input's size picks the options, so every file of a corpus also runs through the other output modes
+static char *fuzz_argvs[][6] = {
+	{"fuzz", "-"},
+	{"fuzz", "--threshold", "100", "-"},
+	{"fuzz", "--dither", "bayer4", "-p", "-"},
+	{"fuzz", "--dither", "floyd-steinberg", "-"},
+	{"fuzz", "--tiles", "8", "-"},
+	{"fuzz", "--tiles", "1", "-"},
+	{"fuzz", "--tiles", "3", "-p", "-"},
+	{"fuzz", "--shifts", "all", "-"},
+	{"fuzz", "--font", "32", "-"},
+	{"fuzz", "--all-slices", "-"},
+	{"fuzz", "--commands", "delta", "-"},
+	{"fuzz", "--bus", "all", "-"},
+	{"fuzz", "--optimize", "size", "-"},
+	{"fuzz", "--panels", "2x2", "--panel-size", "20x12", "-"},
+	{"fuzz", "--controller", "sh1106", "--commands", "delta", "-"},
+	{"fuzz", "--rotate", "90", "--flip", "v", "-"},
+	{"fuzz", "--commands", "delta", "--scroll", "-"},
+	{"fuzz", "--optimize", "bustime", "--player", "-"},
+};
+#define FUZZ_ARGV_COUNT (sizeof(fuzz_argvs)/sizeof(fuzz_argvs[0]))
+
+static ByteStackAllocator fuzz_allocator;
+
+//Cases of the emulator that the converter's own streams don't reliably reach
+static bool check_emulator(void) {
+	static SSD1306Emulator display;
+	//on the 132 column controllers a column past the end of GRAM is clamped where data lands, but the register keeps 
+	//the nibble that was set, so setting the other nibble next gets the address asked for
+	static const u8 past_end[] = {0xB0, 0x03, 0x18}, column_31[] = {0xB1, 0x0F, 0x11};
+	static const u8 pixels[] = {0x5A, 0xC3};
+	for (u32 controller = SSD1306_CONTROLLER_SSD1305; controller <= SSD1306_CONTROLLER_SH1106; controller++) {
+		ssd1306_emulator_init(&display, (SSD1306Controller)controller);
+		ssd1306_emulator_commands(&display, past_end, sizeof(past_end));
+		ssd1306_emulator_data(&display, pixels, 1);
+		ssd1306_emulator_commands(&display, column_31, sizeof(column_31));
+		ssd1306_emulator_data(&display, &pixels[1], 1);
+		if (display.gram[0][131] != 0x5A || display.gram[1][31] != 0xC3 || display.unknown_command_count != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static ConversionError fuzz_convert(char **argv, const u8 *data, usize size, ByteStackAllocator allocator) {
+	int argc = 0;
+	while (argc < 6 && argv[argc]) {
+		argc++;
+	}
+	ProgramArgs pa = parse_args(argc, argv);
+	//the stream never writes to a resident buffer
+	AsepriteStream stream = stream_from_memory((u8*)data, size);
+	return aseprite_to_ssd1306(pa, &stream, stdout, allocator);
+}
+
+//A file that's only headers, with a canvas the decoder takes but that most outputs need several times over.  Mutations 
+//rarely get a header like it and stay fast enough to fuzz, so every output runs it once, in an arena small enough that 
+//256x256 is large.  None of them may crash or fail to reproduce its frames.
+static bool check_large_canvas(void) {
+	enum {FRAME_COUNT = 24};
+	static u8 file[sizeof(AsepriteHeader) + FRAME_COUNT*sizeof(AsepriteFrameHeader)];
+	AsepriteHeader header = {0};
+	header.file_size = sizeof(file);
+	header.magic = 0xA5E0;
+	header.frames = FRAME_COUNT;
+	header.width = header.height = 256;
+	header.color_depth = 32;
+	memcpy(file, &header, sizeof(header));
+	for (u32 f = 0; f < FRAME_COUNT; f++) {
+		AsepriteFrameHeader frame_header = {0};
+		frame_header.frame_size = sizeof(frame_header);
+		frame_header.magic = 0xF1FA;
+		memcpy(&file[sizeof(header) + f*sizeof(frame_header)], &frame_header, sizeof(frame_header));
+	}
+	ByteStackAllocator allocator = fuzz_allocator;
+	allocator.capacity = MB(5);
+	for (u32 i = 0; i < FUZZ_ARGV_COUNT; i++) {
+		ConversionError error = fuzz_convert(fuzz_argvs[i], file, sizeof(file), allocator);
+		if (error.code == CONVERSION_ERROR_VERIFY_FAILED) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	if (!check_emulator()) {
+		PRINTERR("The emulator failed its checks!");
+		return 1;
+	}
+	//the exports themselves aren't interesting, and printing them would dominate the run.  stderr stays open for 
+	//the sanitizers, pass -close_fd_mask=2 to silence the converter's error messages too.
+	if (!freopen("/dev/null", "w", stdout)) {
+		return 1;
+	}
+	fuzz_allocator.data = fuzz_allocator.cursor = mmap(NULL, PROGRAM_MEMORY_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (fuzz_allocator.data == MAP_FAILED) {
+		return 1;
+	}
+	fuzz_allocator.capacity = PROGRAM_MEMORY_SIZE;
+	if (!check_large_canvas()) {
+		PRINTERR("A large canvas failed to convert!");
+		return 1;
+	}
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, usize size) {
+	//the allocator is passed by value, so every run starts with an empty arena
+	ConversionError error = fuzz_convert(fuzz_argvs[size % FUZZ_ARGV_COUNT], data, size, fuzz_allocator);
+	if (error.code != CONVERSION_OK) {
+		PRINTERR("%s (byte %llu)", error.message, (unsigned long long)error.offset);
+	}
+	return 0;
+}
+
+#if FUZZ_STANDALONE
+int main(int argc, char **argv) {
+	if (LLVMFuzzerInitialize(&argc, &argv) != 0) {
+		return 1;
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (!file) {
+			continue;
+		}
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		u8 *data = malloc(size > 0 ? size : 1);
+		if (data && fread(data, 1, size, file) == (usize)size) {
+			LLVMFuzzerTestOneInput(data, size);
+		}
+		free(data);
+		fclose(file);
+	}
+	return 0;
+}
+#endif
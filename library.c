@@ -0,0 +1,200 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+
+//libaseprite_ssd1306, see aseprite_ssd1306.h.  Built by ./build.sh lib on top of the unix platform layer.
+#define ASEPRITE_SSD1306_LIBRARY 1
+#include "unix.c"
+#include "aseprite_ssd1306.h"
+
+struct AsepriteSSD1306 {
+	ProgramArgs pa;
+	DecodedAseprite sprite;
+	ByteStackAllocator allocator; //what's left of the caller's block once the file is decoded
+};
+
+static void set_library_error(AsepriteSSD1306Error *error, const ConversionError *conversion_error) {
+	if (!error) {
+		return;
+	}
+	error->code = (AsepriteSSD1306ErrorCode)conversion_error->code;
+	error->offset = conversion_error->offset;
+	error->frame_index = conversion_error->frame_index;
+	error->chunk_index = conversion_error->chunk_index;
+	memcpy(error->message, conversion_error->message, sizeof(error->message));
+}
+
+static bool options_to_program_args(const AsepriteSSD1306Options *options, ProgramArgs *pa) {
+	memset(pa, 0, sizeof(*pa));
+	pa->is_valid = true;
+	pa->mode = CONVERSION_MODE_ALPHA;
+	pa->controller = CONTROLLER_PROFILES[0];
+	if (!options) {
+		return true;
+	}
+	switch (options->mode) {
+	case ASEPRITE_SSD1306_ALPHA: break;
+	case ASEPRITE_SSD1306_THRESHOLD: pa->mode = CONVERSION_MODE_THRESHOLD; break;
+	case ASEPRITE_SSD1306_BAYER2: pa->mode = CONVERSION_MODE_ORDERED_DITHER; pa->dither_size = 2; break;
+	case ASEPRITE_SSD1306_BAYER4: pa->mode = CONVERSION_MODE_ORDERED_DITHER; pa->dither_size = 4; break;
+	case ASEPRITE_SSD1306_BAYER8: pa->mode = CONVERSION_MODE_ORDERED_DITHER; pa->dither_size = 8; break;
+	case ASEPRITE_SSD1306_FLOYD_STEINBERG:
+		pa->mode = CONVERSION_MODE_ERROR_DIFFUSION; pa->diffusion_kernel = DIFFUSION_KERNEL_FLOYD_STEINBERG; break;
+	case ASEPRITE_SSD1306_ATKINSON:
+		pa->mode = CONVERSION_MODE_ERROR_DIFFUSION; pa->diffusion_kernel = DIFFUSION_KERNEL_ATKINSON; break;
+	case ASEPRITE_SSD1306_SIERRA_LITE:
+		pa->mode = CONVERSION_MODE_ERROR_DIFFUSION; pa->diffusion_kernel = DIFFUSION_KERNEL_SIERRA_LITE; break;
+	default: return false;
+	}
+	if (options->threshold > 254 || options->thread_count > MAX_THREADS ||
+			options->layer_name_count > MAX_LAYER_FILTERS || options->excluded_layer_name_count > MAX_LAYER_FILTERS) {
+		return false;
+	}
+	pa->threshold = options->threshold;
+	pa->thread_count = options->thread_count;
+	for (u32 i = 0; i < options->layer_name_count; i++) {
+		pa->layer_names[i] = options->layer_names[i];
+	}
+	pa->layer_name_count = options->layer_name_count;
+	for (u32 i = 0; i < options->excluded_layer_name_count; i++) {
+		pa->excluded_layer_names[i] = options->excluded_layer_names[i];
+	}
+	pa->excluded_layer_name_count = options->excluded_layer_name_count;
+	return true;
+}
+
+//The handle and the decoded file go in the block after the stream buffer, if there is one
+static AsepriteSSD1306 *open_stream(AsepriteStream *stream, ByteStackAllocator allocator, const ProgramArgs *pa,
+		AsepriteSSD1306Error *error) {
+	assert(sizeof(((AsepriteSSD1306Error*)0)->message) == sizeof(((ConversionError*)0)->message));
+	assert((int)ASEPRITE_SSD1306_ERROR_MISSING_SLICE == (int)CONVERSION_ERROR_MISSING_SLICE);
+	AsepriteSSD1306 *ret = push_bytes(sizeof(AsepriteSSD1306), &allocator);
+	ret->pa = *pa;
+	ConversionError conversion_error = decode_aseprite(&ret->pa, stream, &allocator, &ret->sprite);
+	set_library_error(error, &conversion_error);
+	if (conversion_error.code != CONVERSION_OK) {
+		return NULL;
+	}
+	ret->allocator = allocator;
+	return ret;
+}
+
+//Sets up an arena over the caller's block, or fails like a file that doesn't fit in it
+static bool init_library_allocator(void *memory, usize memory_size, ByteStackAllocator *allocator, AsepriteSSD1306Error *error) {
+	u8 *data = memory;
+	usize padding = (8 - ((uintptr_t)data % 8)) % 8;
+	//the handle and the 64KB stream buffer are the least any file needs
+	if (!data || memory_size < padding + sizeof(AsepriteSSD1306) + STREAM_BUFFER_SIZE) {
+		if (error) {
+			memset(error, 0, sizeof(*error));
+			error->code = ASEPRITE_SSD1306_ERROR_TOO_BIG;
+			error->frame_index = error->chunk_index = -1;
+			snprintf(error->message, sizeof(error->message), "The memory block is too small!");
+		}
+		return false;
+	}
+	allocator->data = allocator->cursor = data + padding;
+	allocator->capacity = memory_size - padding;
+	return true;
+}
+
+static bool check_library_options(const AsepriteSSD1306Options *options, ProgramArgs *pa, AsepriteSSD1306Error *error) {
+	if (options_to_program_args(options, pa)) {
+		return true;
+	}
+	if (error) {
+		memset(error, 0, sizeof(*error));
+		error->code = ASEPRITE_SSD1306_ERROR_UNSUPPORTED;
+		error->frame_index = error->chunk_index = -1;
+		snprintf(error->message, sizeof(error->message), "Invalid options!");
+	}
+	return false;
+}
+
+AsepriteSSD1306 *aseprite_ssd1306_open_memory(const void *data, size_t len,
+		const AsepriteSSD1306Options *options, void *memory, size_t memory_size, AsepriteSSD1306Error *error) {
+	ProgramArgs pa;
+	ByteStackAllocator allocator = {0};
+	if (!check_library_options(options, &pa, error) || !init_library_allocator(memory, memory_size, &allocator, error)) {
+		return NULL;
+	}
+	//a resident stream is never written to
+	AsepriteStream stream = stream_from_memory((u8*)data, len);
+	return open_stream(&stream, allocator, &pa, error);
+}
+
+AsepriteSSD1306 *aseprite_ssd1306_open_fd(int fd,
+		const AsepriteSSD1306Options *options, void *memory, size_t memory_size, AsepriteSSD1306Error *error) {
+	ProgramArgs pa;
+	ByteStackAllocator allocator = {0};
+	if (!check_library_options(options, &pa, error) || !init_library_allocator(memory, memory_size, &allocator, error)) {
+		return NULL;
+	}
+	AsepriteStream stream = stream_from_reader(read_fd, (void*)(isize)fd, &allocator);
+	return open_stream(&stream, allocator, &pa, error);
+}
+
+uint32_t aseprite_ssd1306_frame_count(const AsepriteSSD1306 *file) {
+	return file->sprite.header.frames;
+}
+
+uint16_t aseprite_ssd1306_width(const AsepriteSSD1306 *file) {
+	return file->sprite.header.width;
+}
+
+uint16_t aseprite_ssd1306_height(const AsepriteSSD1306 *file) {
+	return file->sprite.header.height;
+}
+
+size_t aseprite_ssd1306_frame_size(const AsepriteSSD1306 *file) {
+	return (usize)(file->sprite.header.height + 7)/8*file->sprite.header.width;
+}
+
+uint16_t aseprite_ssd1306_frame_duration(const AsepriteSSD1306 *file, uint32_t frame_index) {
+	return (frame_index < file->sprite.header.frames) ? file->sprite.frame_durations[frame_index] : 0;
+}
+
+//Error diffusion works in place, so it gets a copy of the levels and the file can be decoded again.
+//Returns NULL if what's left of the block can't hold the copy, the pages and one error plane.
+static u8 *pack_library_frames(AsepriteSSD1306 *file, u32 first_frame, u32 frame_count, ByteStackAllocator *scratch_allocator) {
+	AsepriteHeader *header = &file->sprite.header;
+	usize frame_size = (usize)header->width*header->height;
+	u64 plane_size = ((u64)header->width + 2*DIFFUSION_BORDER)*(header->height + DIFFUSION_BORDER)*sizeof(i16);
+	u64 required = (u64)frame_count*(frame_size + aseprite_ssd1306_frame_size(file)) + plane_size + 
+		header->width + header->height*sizeof(u32) + 64;
+	if (!can_push_array(1, required, scratch_allocator)) {
+		return NULL;
+	}
+	u8 *levels = &file->sprite.frame_levels[first_frame*frame_size];
+	if (file->pa.mode == CONVERSION_MODE_ERROR_DIFFUSION) {
+		u8 *copy = push_bytes(frame_size*frame_count, scratch_allocator);
+		memcpy(copy, levels, frame_size*frame_count);
+		levels = copy;
+	}
+	return pack_levels(levels, header->width, header->height, (u16)frame_count, &file->pa, scratch_allocator);
+}
+
+bool aseprite_ssd1306_decode_frame(AsepriteSSD1306 *file, uint32_t frame_index, uint8_t *out_pages) {
+	if (frame_index >= file->sprite.header.frames) {
+		return false;
+	}
+	ByteStackAllocator scratch_allocator = file->allocator;
+	u8 *packed_frame = pack_library_frames(file, frame_index, 1, &scratch_allocator);
+	if (!packed_frame) {
+		return false;
+	}
+	memcpy(out_pages, packed_frame, aseprite_ssd1306_frame_size(file));
+	return true;
+}
+
+bool aseprite_ssd1306_decode_frames(AsepriteSSD1306 *file, AsepriteSSD1306FrameSink *sink, void *context) {
+	//every frame is packed in one go so the pages are spread over all the threads
+	ByteStackAllocator scratch_allocator = file->allocator;
+	u8 *packed_frames = pack_library_frames(file, 0, file->sprite.header.frames, &scratch_allocator);
+	if (!packed_frames) {
+		return false;
+	}
+	usize frame_pages_size = aseprite_ssd1306_frame_size(file);
+	for (u32 i = 0; i < file->sprite.header.frames; i++) {
+		sink(context, i, &packed_frames[i*frame_pages_size], file->sprite.frame_durations[i]);
+	}
+	return true;
+}
@@ -0,0 +1,275 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+//See ssd1306_emulator.h.  Follows the SSD1306 datasheet, commands that don't touch GRAM or addressing are only counted.
+#include <string.h>
+#include "ssd1306_emulator.h"
+
+uint8_t ssd1306_controller_column_count(SSD1306Controller controller) {
+	return (controller == SSD1306_CONTROLLER_SSD1305 || controller == SSD1306_CONTROLLER_SH1106) ? SSD1306_MAX_COLUMNS : SSD1306_COLUMNS;
+}
+
+void ssd1306_emulator_init(SSD1306Emulator *display, SSD1306Controller controller) {
+	memset(display, 0, sizeof(*display));
+	display->controller = (uint8_t)controller;
+	display->column_count = ssd1306_controller_column_count(controller);
+	ssd1306_emulator_reset(display);
+}
+
+void ssd1306_emulator_reset(SSD1306Emulator *display) {
+	display->addressing_mode = SSD1306_ADDRESSING_PAGE;
+	display->column_start = 0;
+	display->column_end = display->column_count - 1;
+	display->page_start = 0;
+	display->page_end = SSD1306_PAGES - 1;
+	display->page_column_start = 0;
+	display->column = display->page = 0;
+	display->command_len = display->command_args_needed = 0;
+	display->is_scrolling = false;
+	display->scroll_command = 0;
+	display->scroll_start_page = display->scroll_end_page = 0;
+	display->scroll_interval = 0;
+	display->packet_count = display->command_bytes = display->data_bytes = 0;
+	display->unknown_command_count = display->prohibited_count = 0;
+}
+
+uint16_t ssd1306_scroll_interval_frames(uint8_t interval) {
+	static const uint16_t FRAMES[8] = {5, 64, 128, 256, 3, 4, 25, 2};
+	return FRAMES[interval & 7];
+}
+
+//Argument bytes that follow each command byte on the SH1106
+static uint8_t sh1106_command_arg_count(SSD1306Emulator *display, uint8_t command) {
+	switch (command) {
+	case 0x81: //contrast
+	case 0xA8: //multiplex ratio
+	case 0xAD: //DC-DC converter
+	case 0xD3: //display offset
+	case 0xD5: //clock divide
+	case 0xD9: //precharge
+	case 0xDA: //COM pins
+	case 0xDB: //VCOM deselect level
+		return 1;
+	}
+	bool is_known = command <= 0x1F || (command >= 0x30 && command <= 0x33) || (command >= 0x40 && command <= 0x7F) || 
+		(command >= 0xB0 && command <= 0xB7) || command == 0xA0 || command == 0xA1 || command == 0xA4 || command == 0xA5 || 
+		command == 0xA6 || command == 0xA7 || command == 0xAE || command == 0xAF || command == 0xC0 || command == 0xC8 || 
+		command == 0xE0 || command == 0xE3 || command == 0xEE;
+	if (!is_known) {
+		display->unknown_command_count++;
+	}
+	return 0;
+}
+
+//Argument bytes that follow each command byte
+static uint8_t ssd1306_command_arg_count(SSD1306Emulator *display, uint8_t command) {
+	if (display->controller == SSD1306_CONTROLLER_SH1106) {
+		return sh1106_command_arg_count(display, command);
+	}
+	if (display->controller != SSD1306_CONTROLLER_SSD1306 && command == 0xFD) { //command lock
+		return 1;
+	}
+	if (display->controller == SSD1306_CONTROLLER_SSD1305) {
+		switch (command) {
+		case 0x82: //area color brightness
+		case 0xD8: //area color and low power mode
+			return 1;
+		case 0x91: //look up table
+			return 4;
+		}
+	}
+	switch (command) {
+	case 0x20: //addressing mode
+	case 0x81: //contrast
+	case 0x8D: //charge pump
+	case 0xA8: //multiplex ratio
+	case 0xD3: //display offset
+	case 0xD5: //clock divide
+	case 0xD9: //precharge
+	case 0xDA: //COM pins
+	case 0xDB: //VCOMH deselect level
+		return 1;
+	case 0x21: //column address
+	case 0x22: //page address
+	case 0xA3: //vertical scroll area
+		return 2;
+	case 0x29: //vertical and right scroll
+	case 0x2A: //vertical and left scroll
+		return 5;
+	case 0x26: //right scroll
+	case 0x27: //left scroll
+		return 6;
+	}
+	bool is_known = command <= 0x1F || (command >= 0x40 && command <= 0x7F) || (command >= 0xB0 && command <= 0xB7) ||
+		command == 0x2E || command == 0x2F || command == 0xA0 || command == 0xA1 || command == 0xA4 || command == 0xA5 ||
+		command == 0xA6 || command == 0xA7 || command == 0xAE || command == 0xAF || command == 0xC0 || command == 0xC8 ||
+		command == 0xE3;
+	if (!is_known) {
+		display->unknown_command_count++;
+	}
+	return 0;
+}
+
+//Column addresses past the end of GRAM: the SSD1306 ignores the top bit, what the 132 column controllers do isn't 
+//specified, they're clamped
+static uint8_t ssd1306_column_address(const SSD1306Emulator *display, uint8_t column) {
+	if (display->column_count == SSD1306_COLUMNS) {
+		return column & 0x7F;
+	}
+	return (column < display->column_count) ? column : display->column_count - 1;
+}
+
+static void ssd1306_execute(SSD1306Emulator *display, const uint8_t *command) {
+	//the SH1106 doesn't have addressing modes or scrolling, 0x20-0x2F were counted as unknown
+	if (display->controller == SSD1306_CONTROLLER_SH1106 && command[0] >= 0x20 && command[0] <= 0x2F) {
+		return;
+	}
+	switch (command[0]) {
+	case 0x26:
+	case 0x27:
+		if (display->is_scrolling) {
+			display->prohibited_count++;
+		}
+		display->scroll_command = command[0];
+		display->scroll_start_page = command[2] & 7;
+		display->scroll_interval = ssd1306_scroll_interval_frames(command[3]);
+		display->scroll_end_page = command[4] & 7;
+		break;
+	case 0x2E:
+		display->is_scrolling = false;
+		break;
+	case 0x2F:
+		display->is_scrolling = display->scroll_command != 0;
+		break;
+	case 0x20:
+		//0b11 is invalid and ignored
+		if ((command[1] & 3) != 3) {
+			display->addressing_mode = command[1] & 3;
+		}
+		break;
+	case 0x21:
+		display->column_start = ssd1306_column_address(display, command[1]);
+		display->column_end = ssd1306_column_address(display, command[2]);
+		display->column = display->column_start;
+		break;
+	case 0x22:
+		display->page_start = command[1] & 7;
+		display->page_end = command[2] & 7;
+		display->page = display->page_start;
+		break;
+	default:
+		if (command[0] <= 0x0F) {
+			//the register keeps both nibbles as they were set, only where data goes is clamped
+			display->page_column_start = (display->page_column_start & 0xF0) | command[0];
+			display->column = ssd1306_column_address(display, display->page_column_start);
+		}
+		else if (command[0] <= 0x1F) {
+			//the high nibble is 3 bits on the 128 column controllers
+			uint8_t high_mask = (display->column_count == SSD1306_COLUMNS) ? 7 : 0xF;
+			display->page_column_start = (uint8_t)(((command[0] & high_mask) << 4) | (display->page_column_start & 0x0F));
+			display->column = ssd1306_column_address(display, display->page_column_start);
+		}
+		else if (command[0] >= 0xB0 && command[0] <= 0xB7) {
+			display->page = command[0] & 7;
+		}
+		break;
+	}
+}
+
+void ssd1306_emulator_commands(SSD1306Emulator *display, const uint8_t *bytes, size_t len) {
+	display->command_bytes += len;
+	for (size_t i = 0; i < len; i++) {
+		if (display->command_len == 0) {
+			display->command_args_needed = ssd1306_command_arg_count(display, bytes[i]);
+		}
+		else {
+			display->command_args_needed--;
+		}
+		display->command[display->command_len++] = bytes[i];
+		if (display->command_args_needed == 0) {
+			ssd1306_execute(display, display->command);
+			display->command_len = 0;
+		}
+	}
+}
+
+void ssd1306_emulator_data(SSD1306Emulator *display, const uint8_t *bytes, size_t len) {
+	display->data_bytes += len;
+	if (display->is_scrolling && len > 0) {
+		display->prohibited_count++;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (display->controller == SSD1306_CONTROLLER_SH1106) {
+			//no wrapping, bytes past the end of the page are dropped
+			if (display->column < display->column_count) {
+				display->gram[display->page][display->column++] = bytes[i];
+			}
+			continue;
+		}
+		display->gram[display->page][display->column] = bytes[i];
+		switch (display->addressing_mode) {
+		case SSD1306_ADDRESSING_HORIZONTAL:
+			if (display->column != display->column_end) {
+				display->column = (display->column + 1) % display->column_count;
+				break;
+			}
+			display->column = display->column_start;
+			display->page = (display->page == display->page_end) ? display->page_start : (display->page + 1) % SSD1306_PAGES;
+			break;
+		case SSD1306_ADDRESSING_VERTICAL:
+			if (display->page != display->page_end) {
+				display->page = (display->page + 1) % SSD1306_PAGES;
+				break;
+			}
+			display->page = display->page_start;
+			display->column = (display->column == display->column_end) ? display->column_start : (display->column + 1) % display->column_count;
+			break;
+		default:
+			//page addressing never moves to the next page
+			display->column = (display->column == display->column_count - 1) ? 
+				ssd1306_column_address(display, display->page_column_start) : display->column + 1;
+			break;
+		}
+	}
+}
+
+bool ssd1306_emulator_run(SSD1306Emulator *display, const uint8_t *stream, size_t len) {
+	size_t i = 0;
+	while (i < len) {
+		if (len - i < 2 || len - i - 2 < stream[i + 1]) {
+			return false;
+		}
+		uint8_t control = stream[i], packet_len = stream[i + 1];
+		const uint8_t *payload = &stream[i + 2];
+		if (control == SSD1306_CONTROL_COMMANDS) {
+			ssd1306_emulator_commands(display, payload, packet_len);
+		}
+		else if (control == SSD1306_CONTROL_DATA) {
+			ssd1306_emulator_data(display, payload, packet_len);
+		}
+		else {
+			return false;
+		}
+		display->packet_count++;
+		i += 2 + (size_t)packet_len;
+	}
+	return true;
+}
+
+void ssd1306_emulator_scroll_step(SSD1306Emulator *display) {
+	if (!display->is_scrolling) {
+		return;
+	}
+	uint8_t last = display->column_count - 1;
+	for (uint32_t p = display->scroll_start_page; p <= display->scroll_end_page; p++) {
+		uint8_t *row = display->gram[p];
+		if (display->scroll_command == 0x26) {
+			uint8_t wrapped = row[last];
+			memmove(&row[1], row, last);
+			row[0] = wrapped;
+		}
+		else {
+			uint8_t wrapped = row[0];
+			memmove(row, &row[1], last);
+			row[last] = wrapped;
+		}
+	}
+}
@@ -0,0 +1,84 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+
+//Host side model of an SSD1306's display RAM and addressing, so command streams can be checked and measured without
+//hardware.  Self contained, so it can also be built into a firmware's host tests.
+//
+//A command stream (what --commands outputs) is a run of packets, each one a control byte (0x00 = commands,
+//0x40 = data), a length byte and that many bytes.  A packet is one bus transfer: on I2C the control byte follows the
+//address byte, on SPI it picks the level of the D/C pin and isn't sent.
+//
+//The SSD1309, SSD1305 and SH1106 take the same packets and store pixels the same way, they differ in how wide their RAM 
+//is and which commands they have.
+//
+//Horizontal scrolling (0x26/0x27, started by 0x2F) moves GRAM itself, a column every few display frames.  Time isn't 
+//modeled, ssd1306_emulator_scroll_step() does one step.  Vertical scrolling (0x29/0x2A, 0xA3) only moves where the 
+//display starts reading GRAM, it's parsed but not modeled.
+#ifndef SSD1306_EMULATOR_H
+#define SSD1306_EMULATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SSD1306_COLUMNS 128
+#define SSD1306_MAX_COLUMNS 132 //SSD1305 and SH1106 RAM
+#define SSD1306_PAGES 8
+#define SSD1306_CONTROL_COMMANDS 0x00
+#define SSD1306_CONTROL_DATA 0x40
+#define SSD1306_MAX_PACKET_LEN 255
+
+typedef enum SSD1306AddressingMode {
+	SSD1306_ADDRESSING_HORIZONTAL = 0,
+	SSD1306_ADDRESSING_VERTICAL = 1,
+	SSD1306_ADDRESSING_PAGE = 2, //the power on default
+} SSD1306AddressingMode;
+
+typedef enum SSD1306Controller {
+	SSD1306_CONTROLLER_SSD1306,
+	SSD1306_CONTROLLER_SSD1309, //the SSD1306's commands plus 0xFD command lock
+	SSD1306_CONTROLLER_SSD1305, //132 column RAM, plus 0xFD command lock and the area color commands
+	SSD1306_CONTROLLER_SH1106, //132 column RAM and page addressing only: no 0x20-0x22, and the column stops at the end of the page
+} SSD1306Controller;
+
+typedef struct SSD1306Emulator {
+	uint8_t controller; //SSD1306Controller
+	uint8_t column_count; //of GRAM
+	uint8_t gram[SSD1306_PAGES][SSD1306_MAX_COLUMNS]; //bit 0 of a byte is the topmost row of its page
+	uint8_t addressing_mode;
+	uint8_t column_start, column_end; //0x21, horizontal and vertical addressing
+	uint8_t page_start, page_end; //0x22, horizontal and vertical addressing
+	uint8_t page_column_start; //0x00-0x1F, page addressing.  As set, it may be past the end of GRAM.
+	uint8_t column, page; //where the next data byte goes, column_count if past the end of an SH1106 page
+
+	bool is_scrolling; //0x2F after 0x26 or 0x27, until 0x2E
+	uint8_t scroll_command; //0x26 right, 0x27 left
+	uint8_t scroll_start_page, scroll_end_page;
+	uint16_t scroll_interval; //display frames per step
+
+	uint8_t command[8]; //a command whose arguments haven't all arrived, they may come in the next packet
+	uint8_t command_len;
+	uint8_t command_args_needed;
+
+	//bus traffic since the last reset, control bytes are counted once per packet
+	uint64_t packet_count;
+	uint64_t command_bytes;
+	uint64_t data_bytes;
+	uint32_t unknown_command_count;
+	uint32_t prohibited_count; //GRAM writes and scroll setups while scrolling, which the datasheet prohibits
+} SSD1306Emulator;
+
+uint8_t ssd1306_controller_column_count(SSD1306Controller controller);
+//A display with a cleared GRAM, in the power on state
+void ssd1306_emulator_init(SSD1306Emulator *display, SSD1306Controller controller);
+//Power on state.  GRAM is left as it was, like on the real controller.
+void ssd1306_emulator_reset(SSD1306Emulator *display);
+void ssd1306_emulator_commands(SSD1306Emulator *display, const uint8_t *bytes, size_t len);
+void ssd1306_emulator_data(SSD1306Emulator *display, const uint8_t *bytes, size_t len);
+//Runs a command stream.  Returns false if it isn't made of whole packets with a valid control byte.
+bool ssd1306_emulator_run(SSD1306Emulator *display, const uint8_t *stream, size_t len);
+//Moves the scrolled pages one column, if the display is scrolling
+void ssd1306_emulator_scroll_step(SSD1306Emulator *display);
+//Display frames per scroll step of a 0x26/0x27 interval (its low 3 bits)
+uint16_t ssd1306_scroll_interval_frames(uint8_t interval);
+
+#endif
@@ -0,0 +1,212 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+//See ssd1306_player.h.  The frames are trusted to be what --optimize output, nothing is checked.
+#include <string.h>
+#include "ssd1306_player.h"
+
+void ssd1306_player_init(SSD1306Player *player, const SSD1306PlayerAnimation *animation,
+		const SSD1306PlayerPlatform *platform, uint8_t *buffers) {
+	memset(player, 0, sizeof(*player));
+	player->animation = animation;
+	player->platform = *platform;
+	player->buffers[0] = buffers;
+	player->buffers[1] = buffers + (size_t)animation->width*animation->page_count;
+	player->next_encoded = animation->frames;
+	player->is_sent = true;
+}
+
+//Decodes a frame into framebuffer, only a delta frame's windows for those.  Returns where the frame after it starts.
+static const uint8_t *ssd1306_player_decode(const SSD1306PlayerAnimation *animation, const uint8_t *encoded,
+		uint8_t *framebuffer) {
+	size_t frame_pages_size = (size_t)animation->width*animation->page_count;
+	switch (*encoded++) {
+	case SSD1306_PLAYER_FORMAT_RAW:
+		memcpy(framebuffer, encoded, frame_pages_size);
+		return encoded + frame_pages_size;
+	case SSD1306_PLAYER_FORMAT_RLE:
+		for (size_t out = 0; out < frame_pages_size; ) {
+			uint8_t header = *encoded++;
+			if (header < 0x80) {
+				memcpy(&framebuffer[out], encoded, header + 1u);
+				encoded += header + 1u;
+				out += header + 1u;
+			}
+			else {
+				memset(&framebuffer[out], *encoded++, header - 126u);
+				out += header - 126u;
+			}
+		}
+		return encoded;
+	case SSD1306_PLAYER_FORMAT_DELTA: {
+		uint8_t window_count = *encoded++;
+		for (uint32_t i = 0; i < window_count; i++) {
+			uint8_t x0 = encoded[0], x1 = encoded[1], p0 = encoded[2], p1 = encoded[3];
+			encoded += 4;
+			for (uint32_t p = p0; p <= p1; p++) {
+				memcpy(&framebuffer[p*animation->width + x0], encoded, x1 - x0 + 1u);
+				encoded += x1 - x0 + 1u;
+			}
+		}
+		return encoded;
+	}
+	case SSD1306_PLAYER_FORMAT_TILES: {
+		uint32_t index_size = (animation->tile_count > 256) ? 2 : 1;
+		for (uint32_t p = 0; p < animation->page_count; p++) {
+			for (uint32_t x = 0; x < animation->width; x += SSD1306_PLAYER_TILE_WIDTH) {
+				uint32_t tile = encoded[0] | ((index_size == 2) ? encoded[1] << 8 : 0);
+				encoded += index_size;
+				memcpy(&framebuffer[p*animation->width + x], &animation->tiles[tile*SSD1306_PLAYER_TILE_WIDTH],
+						(x + SSD1306_PLAYER_TILE_WIDTH <= animation->width) ? SSD1306_PLAYER_TILE_WIDTH : animation->width - x);
+			}
+		}
+		return encoded;
+	}
+	}
+	return encoded;
+}
+
+//Decodes the next frame into the buffer that isn't being sent.  A delta frame only sends its windows, so the rest of 
+//the buffer can be left holding an older frame.
+static void ssd1306_player_decode_next(SSD1306Player *player) {
+	if (player->next) {
+		return;
+	}
+	uint8_t *back = (player->shown == player->buffers[0]) ? player->buffers[1] : player->buffers[0];
+	uint32_t start = player->platform.read_cycles ? player->platform.read_cycles(player->platform.context) : 0;
+	player->next_end = ssd1306_player_decode(player->animation, player->next_encoded, back);
+	player->next = back;
+	if (player->platform.read_cycles) {
+		player->last_decode_cycles = player->platform.read_cycles(player->platform.context) - start;
+		if (player->last_decode_cycles > player->max_decode_cycles) {
+			player->max_decode_cycles = player->last_decode_cycles;
+		}
+	}
+}
+
+static void ssd1306_player_start(SSD1306Player *player, uint8_t control, const uint8_t *bytes, uint16_t len) {
+	//set first, the transfer may be over before start_transfer returns
+	player->is_transferring = true;
+	player->platform.start_transfer(player->platform.context, control, bytes, len);
+}
+
+//Starts the shown frame's next packet, or marks the frame sent
+static void ssd1306_player_send(SSD1306Player *player) {
+	const SSD1306PlayerAnimation *animation = player->animation;
+	if (!player->is_addressing_set) {
+		player->is_addressing_set = true;
+		if (!animation->is_page_addressed) {
+			//horizontal addressing, so a window's pages follow each other
+			player->commands[0] = 0x20;
+			player->commands[1] = 0x00;
+			ssd1306_player_start(player, SSD1306_PLAYER_COMMANDS, player->commands, 2);
+			return;
+		}
+	}
+	if (!player->is_window_open) {
+		if (player->windows_left == 0) {
+			player->is_sent = true;
+			return;
+		}
+		player->windows_left--;
+		if (player->window_cursor) {
+			const uint8_t *window = player->window_cursor;
+			player->x0 = window[0];
+			player->x1 = window[1];
+			player->p0 = window[2];
+			player->p1 = window[3];
+			player->window_cursor += 4 + (size_t)(window[1] - window[0] + 1)*(window[3] - window[2] + 1);
+		}
+		else {
+			player->x0 = player->p0 = 0;
+			player->x1 = animation->width - 1;
+			player->p1 = animation->page_count - 1;
+		}
+		player->is_window_open = true;
+		player->is_page_open = false;
+		player->page = player->p0;
+		if (!animation->is_page_addressed) {
+			uint8_t commands[] = {0x21, (uint8_t)(player->x0 + animation->column_offset),
+				(uint8_t)(player->x1 + animation->column_offset), 0x22, player->p0, player->p1};
+			memcpy(player->commands, commands, sizeof(commands));
+			ssd1306_player_start(player, SSD1306_PLAYER_COMMANDS, player->commands, sizeof(commands));
+			return;
+		}
+	}
+	if (animation->is_page_addressed && !player->is_page_open) {
+		uint8_t column = player->x0 + animation->column_offset;
+		player->commands[0] = 0xB0 | player->page;
+		player->commands[1] = column & 0x0F;
+		player->commands[2] = 0x10 | (column >> 4);
+		player->is_page_open = true;
+		ssd1306_player_start(player, SSD1306_PLAYER_COMMANDS, player->commands, 3);
+		return;
+	}
+	const uint8_t *pixels = &player->shown[player->page*animation->width + player->x0];
+	uint16_t len = player->x1 - player->x0 + 1;
+	if (!animation->is_page_addressed && len == animation->width) {
+		//whole pages are one run of the buffer
+		len = (uint16_t)(len*(player->p1 - player->page + 1));
+		player->page = player->p1;
+	}
+	if (player->page == player->p1) {
+		player->is_window_open = false;
+	}
+	player->page++;
+	player->is_page_open = false;
+	ssd1306_player_start(player, SSD1306_PLAYER_DATA, pixels, len);
+}
+
+static void ssd1306_player_pump(SSD1306Player *player) {
+	while (!player->is_sent && !player->is_transferring) {
+		ssd1306_player_send(player);
+	}
+}
+
+void ssd1306_player_tick(SSD1306Player *player, uint32_t now_ms) {
+	const SSD1306PlayerAnimation *animation = player->animation;
+	ssd1306_player_pump(player);
+	ssd1306_player_decode_next(player);
+	uint32_t due_ms = now_ms;
+	if (player->shown) {
+		due_ms = player->shown_at_ms + animation->frame_durations[player->shown_frame];
+		if ((int32_t)(now_ms - due_ms) < 0) {
+			return;
+		}
+		if (!player->is_sent) {
+			if (!player->is_late) {
+				player->is_late = true;
+				player->late_frame_count++;
+			}
+			return;
+		}
+	}
+	//a late frame's duration starts when it's shown, the others stay on schedule
+	player->shown_at_ms = player->is_late ? now_ms : due_ms;
+	player->is_late = false;
+	player->shown = player->next;
+	player->shown_encoded = player->next_encoded;
+	player->shown_frame = player->next_frame;
+	player->next = NULL;
+	player->next_frame = (player->shown_frame + 1 == animation->frame_count) ? 0 : player->shown_frame + 1;
+	player->next_encoded = (player->next_frame == 0) ? animation->frames : player->next_end;
+
+	player->is_sent = false;
+	player->is_window_open = false;
+	if (*player->shown_encoded == SSD1306_PLAYER_FORMAT_DELTA) {
+		player->windows_left = player->shown_encoded[1];
+		player->window_cursor = player->shown_encoded + 2;
+	}
+	else {
+		player->windows_left = 1;
+		player->window_cursor = NULL;
+	}
+	ssd1306_player_pump(player);
+	ssd1306_player_decode_next(player);
+}
+
+void ssd1306_player_transfer_done(SSD1306Player *player) {
+	player->is_transferring = false;
+}
+
+bool ssd1306_player_is_idle(const SSD1306Player *player) {
+	return player->shown && player->is_sent && !player->is_transferring;
+}
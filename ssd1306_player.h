@@ -0,0 +1,98 @@
+//Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
+
+//Plays --optimize frames on an SSD1306 (or SH1106) from a firmware's main loop.  Self contained C99 with no allocation,
+//so it can be copied into a firmware as it is, and built on the host with ssd1306_emulator.c to test and benchmark it.
+//
+//It's double buffered: while one buffer is being sent to the display, the next frame is decoded into the other.
+//Sending is done in packets handed to the platform's start_transfer, which starts a DMA transfer (or blocks, or runs an
+//emulator) and calls ssd1306_player_transfer_done() when it's over.  Delta frames only send the windows that changed.
+//
+//	static uint8_t buffers[SSD1306_PLAYER_BUFFERS_SIZE(128, 8)]; //the image's width and pages
+//	ssd1306_player_init(&player, &animation_player, &platform, buffers);
+//	for (;;) ssd1306_player_tick(&player, millis());
+#ifndef SSD1306_PLAYER_H
+#define SSD1306_PLAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SSD1306_PLAYER_COMMANDS 0x00 //the control byte of a command packet
+#define SSD1306_PLAYER_DATA 0x40 //the control byte of a data packet
+#define SSD1306_PLAYER_TILE_WIDTH 8
+//The format byte in front of each frame, see the comments --optimize outputs
+#define SSD1306_PLAYER_FORMAT_RAW 0
+#define SSD1306_PLAYER_FORMAT_RLE 1
+#define SSD1306_PLAYER_FORMAT_DELTA 2
+#define SSD1306_PLAYER_FORMAT_TILES 3
+//Both of the player's buffers
+#define SSD1306_PLAYER_BUFFERS_SIZE(width, page_count) (2*(size_t)(width)*(page_count))
+
+//What --optimize --player outputs as name_player
+typedef struct SSD1306PlayerAnimation {
+	const uint8_t *frames; //name_frames, each frame starts with its format byte
+	const uint8_t *tiles; //name_tiles, NULL if no frame uses them
+	const uint16_t *frame_durations; //milliseconds
+	uint32_t tile_count;
+	uint16_t frame_count;
+	uint8_t width, page_count;
+	uint8_t column_offset; //RAM column of the image's left edge
+	bool is_page_addressed; //the SH1106: every page is addressed on its own
+} SSD1306PlayerAnimation;
+
+typedef struct SSD1306PlayerPlatform {
+	//Starts sending a packet, control is SSD1306_PLAYER_COMMANDS or SSD1306_PLAYER_DATA.  On I2C that's a transfer
+	//of the address, the control byte and the bytes, on SPI the control byte sets D/C and isn't sent.  bytes stay
+	//untouched until ssd1306_player_transfer_done(), which may be called before start_transfer returns.
+	void (*start_transfer)(void *context, uint8_t control, const uint8_t *bytes, uint16_t len);
+	//A free running cycle counter (e.g. DWT->CYCCNT), to measure decoding.  May be NULL.
+	uint32_t (*read_cycles)(void *context);
+	void *context;
+} SSD1306PlayerPlatform;
+
+typedef struct SSD1306Player {
+	const SSD1306PlayerAnimation *animation;
+	SSD1306PlayerPlatform platform;
+	uint8_t *buffers[2];
+
+	//the frame being sent or shown
+	uint16_t shown_frame;
+	const uint8_t *shown; //its pixels, in one of the buffers, NULL before the first frame
+	const uint8_t *shown_encoded; //its format byte
+	uint32_t shown_at_ms;
+	bool is_late; //it wasn't ready when it was due
+
+	//the frame after it
+	uint16_t next_frame;
+	uint8_t *next; //its pixels once decoded, else NULL
+	const uint8_t *next_encoded;
+	const uint8_t *next_end; //where the frame after it starts, once it's decoded
+
+	//where sending the shown frame is at: the window, and the page of it
+	bool is_sent;
+	bool is_addressing_set;
+	uint8_t windows_left;
+	const uint8_t *window_cursor; //next window of a delta frame
+	bool is_window_open;
+	uint8_t x0, x1, p0, p1;
+	uint8_t page;
+	bool is_page_open; //the SH1106 commands addressing the page have been sent
+	uint8_t commands[8]; //the packet being sent, if it's commands
+	volatile bool is_transferring;
+
+	uint32_t late_frame_count;
+	uint32_t last_decode_cycles, max_decode_cycles; //0 without read_cycles
+} SSD1306Player;
+
+//buffers is SSD1306_PLAYER_BUFFERS_SIZE bytes.  Nothing is sent before the first tick.
+void ssd1306_player_init(SSD1306Player *player, const SSD1306PlayerAnimation *animation,
+		const SSD1306PlayerPlatform *platform, uint8_t *buffers);
+//Never waits: sends the next packet if the last one is done, decodes the next frame if it isn't yet, and moves on to
+//it once the shown frame's duration is over and it's been sent.  Call it as often as possible.  The animation loops.
+void ssd1306_player_tick(SSD1306Player *player, uint32_t now_ms);
+//Call when a packet from start_transfer has been sent, an interrupt handler may
+void ssd1306_player_transfer_done(SSD1306Player *player);
+//The shown frame has been sent, and the display shows it
+bool ssd1306_player_is_idle(const SSD1306Player *player);
+
+#endif
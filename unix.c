@@ -1,86 +1,481 @@
 //Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sysexits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #define NL "\n"
 
 //unity build
 #include "3rdparty/miniz.c"
+#include "ssd1306_emulator.c"
+#include "ssd1306_player.c"
 #include "aseprite_ssd1306.c"
 
-static ProgramArgs parse_args(int argc, char **argv) {
-	ProgramArgs ret = {0};
-	if (argc < 2) {
-		return ret;
-	}
-	for (int i = 1; i < argc; i++) {
-		char *arg = argv[i];
-		if (*arg == '-') {
-			switch (arg[1]) {
-				case 'p':
-					ret.should_show_python = true;
-					break;
-				case 'v':
-					ret.should_show_frames = true;
-					break;
-				default:
-					return ret;
+typedef struct ParallelForJob {
+	ParallelWorkFn *fn;
+	void *data;
+	u32 work_count;
+	u32 next_work_index;
+} ParallelForJob;
+
+static void *parallel_for_thread(void *arg) {
+	ParallelForJob *job = arg;
+	for (;;) {
+		u32 work_index = __atomic_fetch_add(&job->next_work_index, 1, __ATOMIC_RELAXED);
+		if (work_index >= job->work_count) {
+			return NULL;
+		}
+		job->fn(job->data, work_index);
+	}
+}
+
+static void platform_parallel_for(ParallelWorkFn *fn, void *data, u32 work_count, u32 thread_count) {
+	ParallelForJob job = {fn, data, work_count, 0};
+	if (thread_count > work_count) thread_count = work_count;
+	if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+
+	//the calling thread is one of the workers
+	pthread_t threads[MAX_THREADS];
+	u32 threads_started = 0;
+	for (; threads_started + 1 < thread_count; threads_started++) {
+		if (pthread_create(&threads[threads_started], NULL, parallel_for_thread, &job) != 0) {
+			break;
+		}
+	}
+	parallel_for_thread(&job);
+	for (u32 i = 0; i < threads_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+static u32 platform_processor_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (u32)count : 1;
+}
+
+static void platform_yield_thread(void) {
+	sched_yield();
+}
+
+static isize read_fd(void *context, u8 *dst, usize len) {
+	int fd = (int)(isize)context;
+	for (;;) {
+		ssize_t result = read(fd, dst, len);
+		if (result >= 0) {
+			return result;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+#if !ASEPRITE_SSD1306_LIBRARY
+static int conversion_exit_code(ConversionErrorCode code) {
+	switch (code) {
+	case CONVERSION_OK: return 0;
+	case CONVERSION_ERROR_READ_FAILED: return EX_IOERR;
+	case CONVERSION_ERROR_MISSING_SLICE: return EX_USAGE;
+	case CONVERSION_ERROR_VERIFY_FAILED: return EX_SOFTWARE;
+	default: return EX_DATAERR;
+	}
+}
+
+//the file is streamed, so its size is unknown up front. reserve plenty of address space and let the OS commit pages as the arena grows
+static bool reserve_arena(ByteStackAllocator *allocator) {
+	allocator->data = allocator->cursor = mmap(NULL, PROGRAM_MEMORY_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (allocator->data == MAP_FAILED) {
+		PRINTERR("Failed to allocate required %zu bytes!  Exiting...", PROGRAM_MEMORY_SIZE);
+		return false;
+	}
+	allocator->capacity = PROGRAM_MEMORY_SIZE;
+	return true;
+}
+
+//--serve: a conversion daemon on a Unix domain socket.  A connection carries any number of requests, one after another:
+//	request:  u32 argument count, then each argument as a u32 length and its bytes.  The arguments are the command line 
+//	          options and the file path, or - to send the file inline.  Then a u64 length and the inline file (0 bytes 
+//	          if a path was given).
+//	response: u32 status (0, a ConversionErrorCode or SERVE_STATUS_BAD_REQUEST), then a u64 length and either the output 
+//	          the command line would have printed or the error message.
+//Integers are little endian.  Connections go to a pool of workers, each with its own arena that stays mapped between 
+//requests (inflate state lives on the worker's stack).  A connection that sends or takes nothing for 
+//SERVE_TIMEOUT_SECONDS is closed, so idle clients can't hold on to every worker.
+#define SERVE_STATUS_BAD_REQUEST 255
+//at most 16MB of arguments, far less than a worker's arena
+#define SERVE_MAX_ARGUMENTS 256
+#define SERVE_MAX_ARGUMENT_LEN KB(64)
+#define SERVE_QUEUE_SIZE 256
+#define SERVE_TIMEOUT_SECONDS 10
+
+//Outputs of requests for a path, so a file that hasn't changed since is answered without converting it again.  The 
+//key is the request's arguments and the file's identity, size and modification times.  Inline files aren't cached, 
+//they would have to be read in full before the conversion could start.  Entries are replaced round robin.
+#define SERVE_CACHE_SIZE 64
+#define SERVE_CACHE_MAX_OUTPUT MB(4)
+
+typedef struct ServeCacheEntry {
+	u8 *key; //malloc'd, NULL if the entry is unused
+	usize key_len;
+	char *output; //malloc'd
+	usize output_len;
+} ServeCacheEntry;
+
+typedef struct ServeCache {
+	pthread_mutex_t mutex;
+	ServeCacheEntry entries[SERVE_CACHE_SIZE];
+	u32 next_entry; //replaced next
+} ServeCache;
+
+static ServeCache serve_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+typedef struct ServeQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int fds[SERVE_QUEUE_SIZE];
+	u32 head;
+	u32 count;
+} ServeQueue;
+
+typedef struct SocketReader {
+	int fd;
+	u64 remaining; //inline file bytes not read yet
+} SocketReader;
+
+static bool read_exactly(int fd, void *dst, usize len) {
+	u8 *cursor = dst;
+	while (len > 0) {
+		ssize_t result = read(fd, cursor, len);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			return false;
+		}
+		cursor += result;
+		len -= result;
+	}
+	return true;
+}
+
+static bool write_exactly(int fd, const void *src, usize len) {
+	const u8 *cursor = src;
+	while (len > 0) {
+		ssize_t result = write(fd, cursor, len);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			return false;
+		}
+		cursor += result;
+		len -= result;
+	}
+	return true;
+}
+
+//The inline file ends after its announced length, however much more the client sent
+static isize read_socket(void *context, u8 *dst, usize len) {
+	SocketReader *reader = context;
+	if (len > reader->remaining) {
+		len = (usize)reader->remaining;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	for (;;) {
+		ssize_t result = read(reader->fd, dst, len);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			return -1;
+		}
+		reader->remaining -= result;
+		return result;
+	}
+}
+
+//Skips whatever part of the inline file the conversion didn't read, so the next request starts in the right place
+static bool skip_inline_file(SocketReader *reader, ByteStackAllocator scratch_allocator) {
+	u8 *buffer = push_bytes(STREAM_BUFFER_SIZE, &scratch_allocator);
+	while (reader->remaining > 0) {
+		if (read_socket(reader, buffer, STREAM_BUFFER_SIZE) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool send_response(int fd, u32 status, const void *payload, u64 len) {
+	return write_exactly(fd, &status, sizeof(status)) && write_exactly(fd, &len, sizeof(len)) && write_exactly(fd, payload, len);
+}
+
+//Returns a malloc'd copy of the cached output for key, or NULL
+static char *find_cached_output(const u8 *key, usize key_len, usize *out_len) {
+	char *ret = NULL;
+	pthread_mutex_lock(&serve_cache.mutex);
+	for (u32 i = 0; i < SERVE_CACHE_SIZE; i++) {
+		ServeCacheEntry *entry = &serve_cache.entries[i];
+		if (entry->key && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+			ret = malloc(entry->output_len ? entry->output_len : 1);
+			if (ret) {
+				memcpy(ret, entry->output, entry->output_len);
+				*out_len = entry->output_len;
 			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&serve_cache.mutex);
+	return ret;
+}
+
+//Takes ownership of output
+static void cache_output(const u8 *key, usize key_len, char *output, usize output_len) {
+	u8 *key_copy = malloc(key_len);
+	if (!key_copy || output_len > SERVE_CACHE_MAX_OUTPUT) {
+		free(key_copy);
+		free(output);
+		return;
+	}
+	memcpy(key_copy, key, key_len);
+	pthread_mutex_lock(&serve_cache.mutex);
+	ServeCacheEntry *entry = &serve_cache.entries[serve_cache.next_entry];
+	serve_cache.next_entry = (serve_cache.next_entry + 1) % SERVE_CACHE_SIZE;
+	free(entry->key);
+	free(entry->output);
+	entry->key = key_copy;
+	entry->key_len = key_len;
+	entry->output = output;
+	entry->output_len = output_len;
+	pthread_mutex_unlock(&serve_cache.mutex);
+}
+
+//Handles one request.  Returns false once the connection is closed or can't be trusted to be in sync any more.
+static bool serve_request(int fd, ByteStackAllocator request_allocator) {
+	u32 argument_count;
+	if (!read_exactly(fd, &argument_count, sizeof(argument_count)) || argument_count > SERVE_MAX_ARGUMENTS) {
+		return false;
+	}
+	char **argv = push_bytes((argument_count + 1)*sizeof(char*), &request_allocator);
+	u32 *argument_lens = push_bytes((argument_count + 1)*sizeof(u32), &request_allocator);
+	argv[0] = "aseprite_ssd1306";
+	usize arguments_size = 0;
+	for (u32 i = 1; i <= argument_count; i++) {
+		u32 len;
+		if (!read_exactly(fd, &len, sizeof(len)) || len > SERVE_MAX_ARGUMENT_LEN) {
+			return false;
 		}
-		else {
-			ret.in_file_name = arg;
+		argv[i] = push_bytes(len + 1, &request_allocator);
+		if (!read_exactly(fd, argv[i], len)) {
+			return false;
 		}
+		argv[i][len] = '\0';
+		argument_lens[i] = len;
+		arguments_size += sizeof(u32) + len;
+	}
+	SocketReader reader = {fd, 0};
+	if (!read_exactly(fd, &reader.remaining, sizeof(reader.remaining))) {
+		return false;
 	}
 
-	if (ret.should_show_frames || ret.should_show_python) {
-		ret.is_valid = argc == 3;
-	} 
+	ProgramArgs pa = parse_args(argument_count + 1, argv);
+	bool is_inline = pa.in_file_name && strcmp(pa.in_file_name, "-") == 0;
+	if (!pa.is_valid || pa.serve_path || (!is_inline && reader.remaining > 0)) {
+		const char message[] = "Invalid arguments!";
+		return skip_inline_file(&reader, request_allocator) && 
+			send_response(fd, SERVE_STATUS_BAD_REQUEST, message, sizeof(message) - 1);
+	}
+	//the pool already keeps every processor busy
+	if (pa.thread_count == 0) {
+		pa.thread_count = 1;
+	}
+	int file_fd = -1;
+	AsepriteStream stream;
+	if (is_inline) {
+		stream = stream_from_reader(read_socket, &reader, &request_allocator);
+	}
 	else {
-		ret.is_valid = argc == 2;
+		file_fd = open(pa.in_file_name, O_RDONLY);
+		if (file_fd < 0) {
+			char message[512];
+			int len = snprintf(message, sizeof(message), "Error opening '%s' -- %s", pa.in_file_name, strerror(errno));
+			return send_response(fd, CONVERSION_ERROR_READ_FAILED, message, (len < (int)sizeof(message)) ? len : sizeof(message) - 1);
+		}
+		stream = stream_from_reader(read_fd, (void*)(isize)file_fd, &request_allocator);
+	}
+	//the cache key: every argument with its length, then what identifies this version of the file
+	u8 *cache_key = NULL;
+	usize cache_key_len = 0;
+	struct stat file_stat;
+	if (file_fd >= 0 && fstat(file_fd, &file_stat) == 0) {
+#ifdef __APPLE__
+		struct timespec modified = file_stat.st_mtimespec, changed = file_stat.st_ctimespec;
+#else
+		struct timespec modified = file_stat.st_mtim, changed = file_stat.st_ctim;
+#endif
+		u64 file_version[] = {(u64)file_stat.st_dev, (u64)file_stat.st_ino, (u64)file_stat.st_size, 
+			(u64)modified.tv_sec, (u64)modified.tv_nsec, (u64)changed.tv_sec, (u64)changed.tv_nsec};
+		cache_key_len = arguments_size + sizeof(file_version);
+		u8 *cursor = cache_key = push_bytes(cache_key_len, &request_allocator);
+		for (u32 i = 1; i <= argument_count; i++) {
+			memcpy(cursor, &argument_lens[i], sizeof(u32));
+			memcpy(cursor + sizeof(u32), argv[i], argument_lens[i]);
+			cursor += sizeof(u32) + argument_lens[i];
+		}
+		memcpy(cursor, file_version, sizeof(file_version));
+		usize cached_len = 0;
+		char *cached = find_cached_output(cache_key, cache_key_len, &cached_len);
+		if (cached) {
+			close(file_fd);
+			bool is_sent = send_response(fd, CONVERSION_OK, cached, cached_len);
+			free(cached);
+			return is_sent;
+		}
 	}
 
-	return ret;
+	char *output = NULL;
+	size_t output_len = 0;
+	FILE *out = open_memstream(&output, &output_len);
+	if (!out) {
+		if (file_fd >= 0) close(file_fd);
+		return false;
+	}
+	ConversionError error = aseprite_to_ssd1306(pa, &stream, out, request_allocator);
+	fclose(out);
+	if (file_fd >= 0) {
+		close(file_fd);
+	}
+	bool is_in_sync = skip_inline_file(&reader, request_allocator);
+	bool is_sent = is_in_sync && ((error.code == CONVERSION_OK) ? 
+		send_response(fd, CONVERSION_OK, output, output_len) : 
+		send_response(fd, error.code, error.message, strlen(error.message)));
+	if (cache_key && error.code == CONVERSION_OK) {
+		cache_output(cache_key, cache_key_len, output, output_len);
+	}
+	else {
+		free(output);
+	}
+	return is_sent;
+}
+
+static void *serve_worker(void *arg) {
+	ServeQueue *queue = arg;
+	ByteStackAllocator worker_allocator = {0};
+	if (!reserve_arena(&worker_allocator)) {
+		exit(EX_OSERR);
+	}
+	for (;;) {
+		pthread_mutex_lock(&queue->mutex);
+		while (queue->count == 0) {
+			pthread_cond_wait(&queue->not_empty, &queue->mutex);
+		}
+		int fd = queue->fds[queue->head];
+		queue->head = (queue->head + 1) % SERVE_QUEUE_SIZE;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+		pthread_mutex_unlock(&queue->mutex);
+
+		//the arena is passed by value, so every request starts with it empty
+		while (serve_request(fd, worker_allocator)) {
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int serve(const char *socket_path, u32 worker_count) {
+	//a client hanging up mid response must not take the daemon down
+	signal(SIGPIPE, SIG_IGN);
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		PRINTERR("Socket path '%s' is too long!", socket_path);
+		return EX_USAGE;
+	}
+	strcpy(address.sun_path, socket_path);
+	//a socket left behind by an earlier run is replaced, anything else at the path is left alone
+	struct stat path_stat;
+	if (lstat(socket_path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+		unlink(socket_path);
+	}
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+		PRINTERR("Failed to listen on '%s' -- %s", socket_path, strerror(errno));
+		return EX_OSERR;
+	}
+
+	static ServeQueue queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+	for (u32 i = 0; i < worker_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, serve_worker, &queue) != 0) {
+			PRINTERR("Failed to start worker %u -- %s", i, strerror(errno));
+			return EX_OSERR;
+		}
+		pthread_detach(thread);
+	}
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			PRINTERR("Failed to accept a connection -- %s", strerror(errno));
+			return EX_OSERR;
+		}
+		struct timeval timeout = {SERVE_TIMEOUT_SECONDS, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		pthread_mutex_lock(&queue.mutex);
+		while (queue.count == SERVE_QUEUE_SIZE) {
+			pthread_cond_wait(&queue.not_full, &queue.mutex);
+		}
+		queue.fds[(queue.head + queue.count) % SERVE_QUEUE_SIZE] = fd;
+		queue.count++;
+		pthread_cond_signal(&queue.not_empty);
+		pthread_mutex_unlock(&queue.mutex);
+	}
 }
 
 int main(int argc, char **argv) {
     ProgramArgs pa = parse_args(argc, argv);
 
 	if (!pa.is_valid) {
-		PRINTERR("Aseprite-SSD1306 Utility " ASEPRITE_SSD1306_VERSION);
-		PRINTERR("Usage %s [-pv] aseprite_file", argv[0]);
+		print_usage(argv[0]);
 		return 1;
 	}
-	const char *in_file_name = pa.in_file_name;
-	FILE *f = fopen(in_file_name, "rb");
-	if (!f) {
-        PRINTERR("Error opening '%s' -- %s",  in_file_name, strerror(errno));
-        exit(1);
+	if (pa.serve_path) {
+		return serve(pa.serve_path, (pa.thread_count > 0) ? pa.thread_count : platform_processor_count());
 	}
-
-	fseek(f, 0L, SEEK_END); 
-	long file_size = ftell(f);
-	if (file_size < sizeof(AsepriteHeader)) {
-		PRINTERR("'%s' is not a valid Aseprite file!", in_file_name);
-		exit(1);
+	const char *in_file_name = pa.in_file_name;
+	int fd = STDIN_FILENO;
+	if (strcmp(in_file_name, "-") != 0) {
+		fd = open(in_file_name, O_RDONLY);
+		if (fd < 0) {
+			PRINTERR("Error opening '%s' -- %s",  in_file_name, strerror(errno));
+			exit(1);
+		}
 	}
 
-	rewind(f);
-	
 	ByteStackAllocator program_allocator = {0};
-	usize program_bytes_required = MB(4)+file_size;
-	program_allocator.data = program_allocator.cursor = mmap(NULL, program_bytes_required, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-	if (!program_allocator.data) {
-		PRINTERR("Failed to allocate required %zu bytes!  Exiting...", program_bytes_required);
+	if (!reserve_arena(&program_allocator)) {
 		exit(1);
 	}
-	program_allocator.capacity = program_bytes_required;
-	u8 *file_buffer = push_bytes(file_size, &program_allocator);
-	int read_result = fread(file_buffer, file_size, 1, f);
-	if (read_result != 1) {
-		PRINTERR("Failed to read in Aseprite file! -- %s", strerror(errno));
-        exit(1);
-	}
-	fclose(f);
+	AsepriteStream stream = stream_from_reader(read_fd, (void*)(isize)fd, &program_allocator);
 
-    aseprite_to_ssd1306(pa, file_buffer, file_size, program_allocator);
+    ConversionError error = aseprite_to_ssd1306(pa, &stream, stdout, program_allocator);
+	close(fd);
+	if (error.code != CONVERSION_OK) {
+		PRINTERR("%s", error.message);
+	}
 
-	return 0;
-}
\ No newline at end of file
+	return conversion_exit_code(error.code);
+}
+#endif
@@ -1,9 +1,13 @@
 //Copyright (C) 2021 Daniel Bokser.  See LICENSE file for license
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #define NL "\r\n"
 
 //unity build
 #include "3rdparty/miniz.c"
+#include "ssd1306_emulator.c"
+#include "ssd1306_player.c"
 #include "aseprite_ssd1306.c"
 
 #define PRINTERRNO_EXIT(err_no, fmt, ...) do {\
@@ -13,79 +17,151 @@
 	exit(1);\
 	}while(0)
 
-static ProgramArgs parse_args(int argc, wchar_t **argv) {
-	ProgramArgs ret = {0};
-	if (argc < 2) {
-		return ret;
-	}
-	for (int i = 1; i < argc; i++) {
-		wchar_t *arg = argv[i];
-		if (*arg == L'-') {
-			switch (arg[1]) {
-				case L'p':
-					ret.should_show_python = true;
-					break;
-				case L'v':
-					ret.should_show_frames = true;
-					break;
-				default:
-					return ret;
-			}
-		}
-		else {
-			ret.in_file_name = arg;
+typedef struct ParallelForJob {
+	ParallelWorkFn *fn;
+	void *data;
+	u32 work_count;
+	volatile LONG next_work_index;
+} ParallelForJob;
+
+static DWORD WINAPI parallel_for_thread(LPVOID arg) {
+	ParallelForJob *job = arg;
+	for (;;) {
+		u32 work_index = (u32)(InterlockedIncrement(&job->next_work_index) - 1);
+		if (work_index >= job->work_count) {
+			return 0;
 		}
+		job->fn(job->data, work_index);
 	}
+}
 
-	if (ret.should_show_frames || ret.should_show_python) {
-		ret.is_valid = argc == 3;
-	} 
-	else {
-		ret.is_valid = argc == 2;
+static void platform_parallel_for(ParallelWorkFn *fn, void *data, u32 work_count, u32 thread_count) {
+	ParallelForJob job = {fn, data, work_count, 0};
+	if (thread_count > work_count) thread_count = work_count;
+	if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+
+	//the calling thread is one of the workers
+	HANDLE threads[MAX_THREADS];
+	DWORD threads_started = 0;
+	for (; threads_started + 1 < thread_count; threads_started++) {
+		threads[threads_started] = CreateThread(NULL, 0, parallel_for_thread, &job, 0, NULL);
+		if (!threads[threads_started]) {
+			break;
+		}
+	}
+	parallel_for_thread(&job);
+	if (threads_started > 0) {
+		WaitForMultipleObjects(threads_started, threads, TRUE, INFINITE);
+	}
+	for (DWORD i = 0; i < threads_started; i++) {
+		CloseHandle(threads[i]);
 	}
+}
+
+static u32 platform_processor_count(void) {
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return (system_info.dwNumberOfProcessors > 0) ? system_info.dwNumberOfProcessors : 1;
+}
+
+static void platform_yield_thread(void) {
+	SwitchToThread();
+}
 
+static char *utf16_to_utf8(const wchar_t *str, ByteStackAllocator *allocator) {
+	int len = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+	char *ret = push_bytes(len, allocator);
+	WideCharToMultiByte(CP_UTF8, 0, str, -1, ret, len, NULL, NULL);
 	return ret;
 }
 
-int wmain(int argc, wchar_t **argv) {
-    ProgramArgs pa = parse_args(argc, argv);
+static wchar_t *utf8_to_utf16(const char *str, ByteStackAllocator *allocator) {
+	int len = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	wchar_t *ret = push_bytes(len*sizeof(wchar_t), allocator);
+	MultiByteToWideChar(CP_UTF8, 0, str, -1, ret, len);
+	return ret;
+}
 
-	if (!pa.is_valid) {
-		PRINTERR("Aseprite-SSD1306 Utility " ASEPRITE_SSD1306_VERSION);
-		PRINTERR("Usage %ls [-pv] aseprite_file", argv[0]);
-		return 1;
-	}
-	const wchar_t *in_file_name = pa.in_file_name;
-	FILE *f;
-	if (_wfopen_s(&f, in_file_name, L"rb") != 0) {
-		PRINTERRNO_EXIT(errno, "Error opening '%ls'", in_file_name);
+static isize read_file(void *context, u8 *dst, usize len) {
+	FILE *f = context;
+	usize result = fread(dst, 1, len, f);
+	if (result == 0 && ferror(f)) {
+		return -1;
 	}
+	return (isize)result;
+}
 
-	fseek(f, 0L, SEEK_END); 
-	long file_size = ftell(f);
-	if (file_size < sizeof(AsepriteHeader)) {
-		PRINTERR("'%ls' is not a valid Aseprite file!", in_file_name);
-		exit(1);
+//The arena is only reserved, and committed a chunk at a time the first time it's touched, like the MAP_NORESERVE 
+//mapping on Unix.  Committing all of it up front would count against the commit limit before any file is read.
+#define ARENA_COMMIT_CHUNK MB(1)
+static u8 *arena_data;
+static usize arena_size;
+
+static LONG WINAPI commit_arena_chunk(EXCEPTION_POINTERS *exception) {
+	EXCEPTION_RECORD *record = exception->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) {
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+	u8 *address = (u8*)record->ExceptionInformation[1];
+	if (address < arena_data || address >= arena_data + arena_size) {
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+	//threads faulting on the same chunk at once both commit it, which is harmless
+	usize offset = (usize)(address - arena_data) & ~(usize)(ARENA_COMMIT_CHUNK - 1);
+	usize len = (arena_size - offset < ARENA_COMMIT_CHUNK) ? arena_size - offset : ARENA_COMMIT_CHUNK;
+	if (!VirtualAlloc(arena_data + offset, len, MEM_COMMIT, PAGE_READWRITE)) {
+		PRINTERR("Failed to commit %zu more bytes!  Exiting...", len);
+		ExitProcess(1);
 	}
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
 
-	rewind(f);
-	
+int wmain(int argc, wchar_t **wide_argv) {
+	//the file is streamed, so its size is unknown up front. reserve plenty of address space, it's committed as the arena grows
 	ByteStackAllocator program_allocator = {0};
-	usize program_bytes_required = MB(4)+file_size;
-	program_allocator.data = program_allocator.cursor = VirtualAlloc(NULL, program_bytes_required, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (!program_allocator.data) {
+	usize program_bytes_required = PROGRAM_MEMORY_SIZE;
+	program_allocator.data = program_allocator.cursor = VirtualAlloc(NULL, program_bytes_required, MEM_RESERVE, PAGE_READWRITE);
+	if (!program_allocator.data || !AddVectoredExceptionHandler(1, commit_arena_chunk)) {
 		PRINTERR("Failed to allocate required %zu bytes!  Exiting...", program_bytes_required);
 		exit(1);
 	}
 	program_allocator.capacity = program_bytes_required;
-	u8 *file_buffer = push_bytes(file_size, &program_allocator);
-	int read_result = fread(file_buffer, file_size, 1, f);
-	if (read_result != 1) {
-		PRINTERRNO_EXIT(errno, "Failed to read in Aseprite file!");
+	arena_data = program_allocator.data;
+	arena_size = program_bytes_required;
+
+	//options and layer names are matched as UTF-8
+	char **argv = push_bytes(argc*sizeof(char*), &program_allocator);
+	for (int i = 0; i < argc; i++) {
+		argv[i] = utf16_to_utf8(wide_argv[i], &program_allocator);
 	}
-	fclose(f);
+    ProgramArgs pa = parse_args(argc, argv);
 
-    aseprite_to_ssd1306(pa, file_buffer, file_size, program_allocator);
+	if (!pa.is_valid) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (pa.serve_path) {
+		PRINTERR("--serve is only supported on Linux and macOS.");
+		return 1;
+	}
+	FILE *f = stdin;
+	if (strcmp(pa.in_file_name, "-") == 0) {
+		_setmode(_fileno(stdin), _O_BINARY);
+	}
+	else {
+		const wchar_t *in_file_name = utf8_to_utf16(pa.in_file_name, &program_allocator);
+		if (_wfopen_s(&f, in_file_name, L"rb") != 0) {
+			PRINTERRNO_EXIT(errno, "Error opening '%ls'", in_file_name);
+		}
+	}
+	AsepriteStream stream = stream_from_reader(read_file, f, &program_allocator);
+
+    ConversionError error = aseprite_to_ssd1306(pa, &stream, stdout, program_allocator);
+	fclose(f);
+	if (error.code != CONVERSION_OK) {
+		PRINTERR("%s", error.message);
+		return 1;
+	}
 
 	return 0;
-}
\ No newline at end of file
+}